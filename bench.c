@@ -0,0 +1,2170 @@
+#include <poll.h>
+#include <sys/wait.h>
+
+// The benchmarks see everything main.c has, statics included, and bring their own main().
+#define EWM_BENCH
+#include "main.c"
+
+static inline uint32_t bench_random(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+// Window IDs look like the X server's: a per-connection resource base plus a small counter.
+static inline xcb_window_t bench_window_id(uint64_t idx)
+{
+    return (xcb_window_t)((((idx % 32) + 1) << 21) | (idx / 32 + 1));
+}
+
+// The focused 1920x1080 monitor most benchmarks run on, with clients_num tiled clients on tag 1.
+// The clients are also stored into clients unless it is NULL.
+static struct monitor *bench_monitor_with_clients(uint64_t clients_num, struct client **clients)
+{
+    struct monitor *monitor = monitor_create(0, 0, 0, 1920, 1080);
+    if (monitor == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    list_append(&global_monitors, &monitor->list_node);
+    global_focused_monitor = monitor;
+    global_monitor_index_outdated = true;
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        struct client *client = client_alloc();
+        if (client == NULL) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        client->window = bench_window_id(i);
+        client->border_width = global_client_border_width;
+        client->tags = MASK_TAG1;
+        monitor_append_client(monitor, client);
+        if (clients != NULL) {
+            clients[i] = client;
+        }
+    }
+    return monitor;
+}
+
+static void bench_monitor_free(struct monitor *monitor)
+{
+    global_focused_monitor = NULL;
+    while (monitor->clients != NULL) {
+        client_unmanage(container_of(monitor->clients, struct client, list_node));
+    }
+    list_remove(&global_monitors, &monitor->list_node);
+    global_monitor_index_outdated = true;
+    monitor_free(monitor);
+}
+
+// The monitor-by-monitor scan get_client_by_win used before windows were indexed.
+static struct client *bench_get_client_by_win_linear(xcb_window_t window)
+{
+    for (struct list_node *monitor_cursor = global_monitors; monitor_cursor != NULL;
+         monitor_cursor = monitor_cursor->next) {
+        struct monitor *monitor = container_of(monitor_cursor, struct monitor, list_node);
+        for (struct list_node *client_cursor = monitor->clients; client_cursor != NULL;
+             client_cursor = client_cursor->next) {
+            struct client *client = container_of(client_cursor, struct client, list_node);
+            if (client->window == window) {
+                return client;
+            }
+        }
+    }
+    return NULL;
+}
+
+void bench_client_lookup(void)
+{
+    const uint64_t clients_nums[] = {10, 100, 1000, 10000};
+    for (uint64_t i = 0; i < sizeof(clients_nums) / sizeof(clients_nums[0]); ++i) {
+        uint64_t clients_num = clients_nums[i];
+        struct monitor *monitor = bench_monitor_with_clients(clients_num, NULL);
+
+        uint32_t random_state = 1;
+        uintptr_t checksum = 0;
+        uint64_t linear_lookups = 10000000 / clients_num;
+        uint64_t start = monotonic_now_ns();
+        for (uint64_t j = 0; j < linear_lookups; ++j) {
+            xcb_window_t window = bench_window_id(bench_random(&random_state) % clients_num);
+            checksum += (uintptr_t)bench_get_client_by_win_linear(window);
+        }
+        double linear_ns = (double)(monotonic_now_ns() - start) / linear_lookups;
+
+        uint64_t table_lookups = 10000000;
+        start = monotonic_now_ns();
+        for (uint64_t j = 0; j < table_lookups; ++j) {
+            xcb_window_t window = bench_window_id(bench_random(&random_state) % clients_num);
+            checksum += (uintptr_t)get_client_by_win(window);
+        }
+        double table_ns = (double)(monotonic_now_ns() - start) / table_lookups;
+
+        printf("client lookup %5lu clients: linear %9.1f ns, table %5.1f ns (checksum %lx)\n",
+               clients_num, linear_ns, table_ns, (unsigned long)(checksum & 0xff));
+
+        bench_monitor_free(monitor);
+    }
+}
+
+static void bench_print_configures(const char *const step, struct configure_counters before)
+{
+    printf("arrange damage %s: %lu configures sent, %lu skipped\n", step,
+           global_configure_counters.sent - before.sent,
+           global_configure_counters.skipped - before.skipped);
+}
+
+void bench_arrange_damage(void)
+{
+    const uint64_t clients_num = 30;
+    struct client *clients[clients_num + 1];
+    struct monitor *monitor = bench_monitor_with_clients(clients_num + 1, clients);
+    monitor_remove_client(monitor, clients[clients_num]);
+
+    struct configure_counters before = global_configure_counters;
+    monitor_arrange(monitor);
+    bench_print_configures("initial 30 clients", before);
+
+    before = global_configure_counters;
+    monitor_arrange(monitor);
+    bench_print_configures("unchanged rearrange", before);
+
+    before = global_configure_counters;
+    monitor_append_client(monitor, clients[clients_num]);
+    monitor_arrange(monitor);
+    bench_print_configures("31st client to stack", before);
+
+    bench_monitor_free(monitor);
+}
+
+// The scattered variant emulates the store that slabs replaced: every client calloc'd on its own
+// with the name inline, interleaved with unrelated allocations as in a long-running session.
+void bench_arrange_store(void)
+{
+    const uint64_t clients_nums[] = {1000, 10000};
+    const char *const variants[] = {"scattered calloc", "client slab"};
+    for (uint64_t i = 0; i < sizeof(clients_nums) / sizeof(clients_nums[0]); ++i) {
+        uint64_t clients_num = clients_nums[i];
+        for (uint64_t variant = 0; variant < 2; ++variant) {
+            struct monitor *monitor = bench_monitor_with_clients(0, NULL);
+            struct client **clients =
+                (struct client **)calloc(clients_num, sizeof(struct client *));
+            void **noise = (void **)calloc(clients_num, sizeof(void *));
+            if (clients == NULL || noise == NULL) {
+                fprintf(stderr, "Out of memory!\n");
+                exit(1);
+            }
+            uint32_t random_state = 1;
+            for (uint64_t j = 0; j < clients_num; ++j) {
+                if (variant == 0) {
+                    noise[j] = malloc(64 + bench_random(&random_state) % 512);
+                    clients[j] = (struct client *)calloc(1, sizeof(struct client) + 256);
+                } else {
+                    clients[j] = client_alloc();
+                }
+                clients[j]->window = bench_window_id(j);
+                clients[j]->border_width = global_client_border_width;
+                clients[j]->tags = MASK_TAG1;
+                monitor_append_client(monitor, clients[j]);
+            }
+            monitor_arrange(monitor);
+
+            uint64_t rounds = 1000000 / clients_num;
+            uint64_t start = monotonic_now_ns();
+            for (uint64_t j = 0; j < rounds; ++j) {
+                monitor_arrange(monitor);
+            }
+            double arrange_us = (double)(monotonic_now_ns() - start) / rounds / 1000;
+            printf("arrange %5lu clients, %-16s: %8.1f us\n", clients_num, variants[variant],
+                   arrange_us);
+
+            for (uint64_t j = 0; j < clients_num; ++j) {
+                monitor_remove_client(monitor, clients[j]);
+                if (variant == 0) {
+                    free(clients[j]);
+                    free(noise[j]);
+                } else {
+                    client_free(clients[j]);
+                }
+            }
+            free(noise);
+            free(clients);
+            bench_monitor_free(monitor);
+        }
+    }
+}
+
+// Replays a resize storm from a few floating clients, once as a single event batch and once with
+// every request in its own batch, which is how requests were handled before coalescing.
+void bench_configure_storm(void)
+{
+    const uint64_t clients_num = 5;
+    const uint64_t requests_num = 1000;
+    struct client *clients[clients_num];
+    struct monitor *monitor = bench_monitor_with_clients(clients_num, clients);
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        clients[i]->is_floating = true;
+    }
+
+    const uint64_t batch_sizes[] = {1, requests_num};
+    for (uint64_t j = 0; j < sizeof(batch_sizes) / sizeof(batch_sizes[0]); ++j) {
+        uint64_t batch_size = batch_sizes[j];
+        struct configure_counters before = global_configure_counters;
+        for (uint64_t i = 0; i < requests_num; ++i) {
+            xcb_configure_request_event_t event = {0};
+            event.response_type = XCB_CONFIGURE_REQUEST;
+            event.window = clients[i % clients_num]->window;
+            event.value_mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT;
+            // Every replay ends on a new size, otherwise the second one would have nothing to send.
+            event.width = 400 + j * requests_num + i;
+            event.height = 300 + j * requests_num + i;
+            handle_configure_request(&event);
+            if ((i + 1) % batch_size == 0) {
+                configure_requests_apply();
+            }
+        }
+        configure_requests_apply();
+        printf("configure storm, %4lu requests per batch: %lu received, %lu applied, %lu sent\n",
+               batch_size, global_configure_counters.requests_received - before.requests_received,
+               global_configure_counters.requests_applied - before.requests_applied,
+               global_configure_counters.sent - before.sent);
+    }
+
+    bench_monitor_free(monitor);
+}
+
+void bench_property_storm(void)
+{
+    const uint64_t batches_num = 10;
+    const uint64_t notifies_num = 1000;
+    struct client *client = NULL;
+    struct monitor *monitor = bench_monitor_with_clients(1, &client);
+
+    // A terminal retitling itself on every line of output, one burst of notifies per batch.
+    struct property_counters before = global_property_counters;
+    for (uint64_t j = 0; j < batches_num; ++j) {
+        for (uint64_t i = 0; i < notifies_num; ++i) {
+            xcb_property_notify_event_t event = {0};
+            event.response_type = XCB_PROPERTY_NOTIFY;
+            event.window = client->window;
+            event.atom = XCB_ATOM_WM_NAME;
+            handle_property_notify(&event);
+        }
+        property_fetches_poll();
+        client_properties_refresh();
+    }
+    property_fetches_poll();
+    printf("property storm, %lu batches: %lu notifies, %lu fetches sent\n", batches_num,
+           global_property_counters.notifies - before.notifies,
+           global_property_counters.fetches_sent - before.fetches_sent);
+
+    bench_monitor_free(monitor);
+}
+
+void bench_client_list(void)
+{
+    const uint64_t windows_num = 500;
+    const uint64_t batches_num = 10;
+    const uint64_t closes_per_batch = 5;
+    struct ewmh_counters before = global_ewmh_counters;
+    for (uint64_t i = 0; i < windows_num; ++i) {
+        client_list_add(bench_window_id(i));
+    }
+    ewmh_publish();
+    printf("client list, %lu windows mapped in one batch: %lu appends, %lu windows written\n",
+           windows_num, global_ewmh_counters.appends - before.appends,
+           global_ewmh_counters.windows_written - before.windows_written);
+
+    before = global_ewmh_counters;
+    for (uint64_t j = 0; j < batches_num; ++j) {
+        for (uint64_t i = 0; i < closes_per_batch; ++i) {
+            client_list_remove(bench_window_id(j * closes_per_batch + i));
+        }
+        ewmh_publish();
+    }
+    printf("client list, %lu closes in %lu batches: %lu rewrites, %lu windows written\n",
+           batches_num * closes_per_batch, batches_num,
+           global_ewmh_counters.rewrites - before.rewrites,
+           global_ewmh_counters.windows_written - before.windows_written);
+
+    // Clients dragged one per batch, each raised to the top.
+    before = global_ewmh_counters;
+    for (uint64_t j = 0; j < batches_num; ++j) {
+        client_list_raise(global_client_list[j]);
+        ewmh_publish();
+    }
+    printf("client list, %lu raises in %lu batches: %lu restacks, %lu windows written, top %s\n",
+           batches_num, batches_num, global_ewmh_counters.restacks - before.restacks,
+           global_ewmh_counters.windows_written - before.windows_written,
+           global_client_stacking[global_client_list_num - 1] ==
+                   global_client_list[batches_num - 1]
+               ? "last raised"
+               : "wrong");
+
+    while (global_client_list_num > 0) {
+        client_list_remove(global_client_list[0]);
+    }
+    ewmh_publish();
+}
+
+void bench_tag_switch(void)
+{
+    const uint64_t clients_num = 50;
+    struct client *clients[clients_num];
+    struct monitor *monitor = bench_monitor_with_clients(clients_num, clients);
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        clients[i]->tags = i % 2 == 0 ? MASK_TAG1 : MASK_TAG2;
+    }
+    monitor_arrange(monitor);
+
+    const uint64_t rounds = 10000;
+    struct configure_counters before = global_configure_counters;
+    uint64_t start = monotonic_now_ns();
+    for (uint64_t i = 0; i < rounds; ++i) {
+        monitor_view(monitor, i % 2 == 0 ? MASK_TAG2 : MASK_TAG1);
+        monitors_arrange_pending();
+    }
+    printf("tag switch %lu clients: %.2f us, %.1f configures sent per switch\n", clients_num,
+           (double)(monotonic_now_ns() - start) / rounds / 1000,
+           (double)(global_configure_counters.sent - before.sent) / rounds);
+
+    bench_monitor_free(monitor);
+}
+
+void bench_ipc_batch(void)
+{
+    const uint64_t clients_num = 50;
+    const char *const commands[] = {"view 2", "main-count 2", "main-fraction 0.5", "layout grid"};
+    const char *const reset = "view 1;layout tile;main-count 1;main-fraction 0.6\n";
+    const uint64_t commands_num = sizeof(commands) / sizeof(commands[0]);
+    struct client *clients[clients_num];
+    struct monitor *monitor = bench_monitor_with_clients(clients_num, clients);
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+        fprintf(stderr, "Can't create IPC socket pair!\n");
+        exit(1);
+    }
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        clients[i]->tags = i % 2 == 0 ? MASK_TAG1 : MASK_TAG2;
+    }
+    monitor_arrange(monitor);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    struct ipc_connection *connection = &global_ipc_connections[0];
+    connection->fd = fds[0];
+
+    // The same commands once as separate batches, each arranged on its own, then as one batch.
+    for (uint64_t j = 0; j < 2; ++j) {
+        if (write(fds[1], reset, strlen(reset)) != (ssize_t)strlen(reset)) {
+            fprintf(stderr, "Can't write IPC commands!\n");
+            exit(1);
+        }
+        handle_ipc_connection(connection);
+        monitors_arrange_pending();
+        connection->output_len = 0;
+        struct configure_counters before = global_configure_counters;
+        char line[IPC_INPUT_SIZE] = {0};
+        for (uint64_t i = 0; i < commands_num; ++i) {
+            if (j == 0) {
+                snprintf(line, sizeof(line), "%s\n", commands[i]);
+            } else {
+                snprintf(&line[strlen(line)], sizeof(line) - strlen(line), "%s%s", commands[i],
+                         i + 1 == commands_num ? "\n" : ";");
+            }
+            if (j == 0 || i + 1 == commands_num) {
+                if (write(fds[1], line, strlen(line)) != (ssize_t)strlen(line)) {
+                    fprintf(stderr, "Can't write IPC commands!\n");
+                    exit(1);
+                }
+                handle_ipc_connection(connection);
+                monitors_arrange_pending();
+            }
+        }
+        uint64_t replies_num = 0;
+        for (uint32_t i = 0; i < connection->output_len; ++i) {
+            replies_num += connection->output[i] == '\n';
+        }
+        printf("ipc %lu commands %s: %lu configures sent, %lu replies\n", commands_num,
+               j == 0 ? "one per batch" : "in one batch ",
+               global_configure_counters.sent - before.sent, replies_num);
+        connection->output_len = 0;
+    }
+
+    ipc_connection_close(connection);
+    close(fds[1]);
+    bench_monitor_free(monitor);
+}
+
+// The scan pointer hit tests had to do before the spatial index.
+static struct monitor *bench_get_monitor_by_point_linear(int16_t x, int16_t y)
+{
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        struct monitor *monitor = container_of(cursor, struct monitor, list_node);
+        if (box_contains(monitor->crtc_box, x, y) == true) {
+            return monitor;
+        }
+    }
+    return NULL;
+}
+
+void bench_motion(void)
+{
+    const uint64_t monitors_num = 6;
+    const uint64_t events_num = 100000;
+    const uint64_t events_per_batch = 100;
+    struct monitor *monitors[monitors_num];
+    for (uint64_t i = 0; i < monitors_num; ++i) {
+        monitors[i] = monitor_create(i, (i % 3) * 1920, (i / 3) * 1080, 1920, 1080);
+        if (monitors[i] == NULL) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        list_append(&global_monitors, &monitors[i]->list_node);
+    }
+    global_focused_monitor = monitors[0];
+    global_monitor_index_outdated = true;
+
+    int16_t *points = (int16_t *)malloc(2 * events_num * sizeof(int16_t));
+    if (points == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    uint32_t seed = 1;
+    for (uint64_t i = 0; i < events_num; ++i) {
+        points[2 * i] = bench_random(&seed) % (3 * 1920);
+        points[2 * i + 1] = bench_random(&seed) % (2 * 1080);
+    }
+
+    uint64_t hits_num = 0;
+    uint64_t start = monotonic_now_ns();
+    for (uint64_t i = 0; i < events_num; ++i) {
+        hits_num += bench_get_monitor_by_point_linear(points[2 * i], points[2 * i + 1]) != NULL;
+    }
+    double linear_ns = (double)(monotonic_now_ns() - start) / events_num;
+    start = monotonic_now_ns();
+    for (uint64_t i = 0; i < events_num; ++i) {
+        hits_num -= get_monitor_by_point(points[2 * i], points[2 * i + 1]) != NULL;
+    }
+    double index_ns = (double)(monotonic_now_ns() - start) / events_num;
+    uint64_t mismatches_num = hits_num;
+    for (uint64_t i = 0; i < events_num; ++i) {
+        mismatches_num += bench_get_monitor_by_point_linear(points[2 * i], points[2 * i + 1]) !=
+                          get_monitor_by_point(points[2 * i], points[2 * i + 1]);
+    }
+    printf("hit test %lu monitors: linear %.1f ns, index %.1f ns, %lu mismatches\n", monitors_num,
+           linear_ns, index_ns, mismatches_num);
+
+    // Delivered in batches the way the event loop drains them, only the last of each is handled.
+    struct motion_counters before = global_motion_counters;
+    start = monotonic_now_ns();
+    for (uint64_t i = 0; i < events_num; ++i) {
+        xcb_motion_notify_event_t event = {0};
+        event.response_type = XCB_MOTION_NOTIFY;
+        event.root_x = points[2 * i];
+        event.root_y = points[2 * i + 1];
+        handle_event((xcb_generic_event_t *)&event);
+        if ((i + 1) % events_per_batch == 0) {
+            motion_flush();
+        }
+    }
+    printf("motion %lu events in batches of %lu: %lu handled, %.1f ns per event\n", events_num,
+           events_per_batch, global_motion_counters.handled - before.handled,
+           (double)(monotonic_now_ns() - start) / events_num);
+
+    free(points);
+    global_focused_monitor = NULL;
+    for (uint64_t i = 0; i < monitors_num; ++i) {
+        list_remove(&global_monitors, &monitors[i]->list_node);
+        monitor_free(monitors[i]);
+    }
+    global_monitor_index_outdated = true;
+}
+
+// A 1000 Hz mouse dragging a window across a 60 Hz monitor for one second. The frame timer is
+// expired by hand at the simulated frame boundaries.
+void bench_drag(void)
+{
+    const uint64_t events_num = 1000;
+    const uint64_t event_interval_ns = 1000000;
+    global_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (global_timer_fd < 0) {
+        fprintf(stderr, "Can't create frame timer!\n");
+        exit(1);
+    }
+    struct client *client = NULL;
+    struct monitor *monitor = bench_monitor_with_clients(1, &client);
+    struct box box = {100, 100, 640, 480};
+    client->box = box;
+
+    xcb_button_press_event_t press = {0};
+    press.response_type = XCB_BUTTON_PRESS;
+    press.detail = XCB_BUTTON_INDEX_1;
+    press.state = global_drag_modifier;
+    press.child = client->window;
+    press.root_x = 200;
+    press.root_y = 200;
+    handle_event((xcb_generic_event_t *)&press);
+
+    struct configure_counters before = global_configure_counters;
+    uint64_t next_frame_ns = monitor->refresh_interval_ns;
+    for (uint64_t i = 0; i < events_num; ++i) {
+        if (i * event_interval_ns >= next_frame_ns) {
+            handle_timer();
+            next_frame_ns += monitor->refresh_interval_ns;
+        }
+        xcb_motion_notify_event_t motion = {0};
+        motion.response_type = XCB_MOTION_NOTIFY;
+        motion.root_x = 200 + i;
+        motion.root_y = 200 + i / 2;
+        handle_motion_notify(&motion);
+    }
+    xcb_button_release_event_t release = {0};
+    release.response_type = XCB_BUTTON_RELEASE;
+    release.root_x = 200 + events_num;
+    release.root_y = 200 + events_num / 2;
+    handle_event((xcb_generic_event_t *)&release);
+    printf("drag %lu motion events at 1000 Hz on a 60 Hz monitor: %lu configures sent\n",
+           events_num, global_configure_counters.sent - before.sent);
+
+    close(global_timer_fd);
+    global_timer_fd = -1;
+    bench_monitor_free(monitor);
+}
+
+// Ten layout changes in a row on a monitor of clients that take several frames to repaint. With
+// sync requests each client gets one resize per repaint, the last layout, instead of all ten.
+void bench_sync_resize(void)
+{
+    const uint64_t clients_num = 20;
+    const uint64_t changes_num = 10;
+    struct client *clients[clients_num];
+    struct monitor *monitor = bench_monitor_with_clients(clients_num, clients);
+
+    for (uint64_t j = 0; j < 2; ++j) {
+        bool is_synced = j == 1;
+        for (uint64_t i = 0; i < clients_num; ++i) {
+            clients[i]->sync_alarm =
+                is_synced == true ? bench_window_id(clients_num + i) : XCB_NONE;
+        }
+        monitor->main_area_fraction = 0.6;
+        monitor_arrange(monitor);
+        struct configure_counters before = global_configure_counters;
+        for (uint64_t i = 0; i < changes_num; ++i) {
+            monitor->main_area_fraction = 0.3 + 0.04 * i;
+            monitor->main_area_win_num = 1 + i % 3;
+            monitor_arrange(monitor);
+        }
+        // Every client repaints once, then their latest held geometry goes out.
+        for (uint64_t i = 0; is_synced == true && i < clients_num; ++i) {
+            xcb_sync_alarm_notify_event_t event = {0};
+            event.alarm = clients[i]->sync_alarm;
+            event.counter_value.hi = clients[i]->sync_value >> 32;
+            event.counter_value.lo = clients[i]->sync_value & 0xffffffff;
+            handle_sync_alarm_notify(&event);
+        }
+        printf("sync %lu clients %lu layout changes %s: %lu configures sent, %lu held\n",
+               clients_num, changes_num, is_synced == true ? "with sync   " : "without sync",
+               global_configure_counters.sent - before.sent,
+               global_configure_counters.held - before.held);
+        for (uint64_t i = 0; i < clients_num; ++i) {
+            clients[i]->is_waiting_sync = false;
+            clients[i]->has_held_box = false;
+        }
+        global_sync_waits_num = 0;
+    }
+
+    bench_monitor_free(monitor);
+}
+
+// A restart at 500 windows over two monitors, from the snapshot written on exit to the adoption
+// scan of the next instance, with the X replies of the scan already at hand.
+void bench_session_restart(void)
+{
+    const uint64_t monitors_num = 2;
+    const uint64_t clients_num = 500;
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/ewm-bench-session-%d", getpid());
+    struct monitor *monitors[monitors_num];
+    struct pending_client *pendings =
+        (struct pending_client *)calloc(clients_num, sizeof(struct pending_client));
+    uint16_t *saved_tags = (uint16_t *)calloc(clients_num, sizeof(uint16_t));
+    if (pendings == NULL || saved_tags == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    for (uint64_t i = 0; i < monitors_num; ++i) {
+        monitors[i] = monitor_create(i + 1, i * 1920, 0, 1920, 1080);
+        if (monitors[i] == NULL) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        list_append(&global_monitors, &monitors[i]->list_node);
+    }
+    global_focused_monitor = monitors[0];
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        pendings[i].window = bench_window_id(i);
+        pendings[i].window_attributes_reply = (xcb_get_window_attributes_reply_t *)calloc(
+            1, sizeof(xcb_get_window_attributes_reply_t));
+        pendings[i].geometry_reply =
+            (xcb_get_geometry_reply_t *)calloc(1, sizeof(xcb_get_geometry_reply_t));
+        if (pendings[i].window_attributes_reply == NULL || pendings[i].geometry_reply == NULL) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        pendings[i].geometry_reply->width = 640;
+        pendings[i].geometry_reply->height = 480;
+    }
+
+    // The session of the previous instance, then its exit.
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        client_adopt(&pendings[i]);
+    }
+    uint32_t seed = 1;
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        struct monitor *monitor = container_of(cursor, struct monitor, list_node);
+        monitor->main_area_fraction = 0.45;
+        monitor->main_area_win_num = 2;
+        monitor->current_layout_idx = LAYOUT_GRID;
+    }
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        struct client *client = get_client_by_win(pendings[i].window);
+        client_set_monitor(client, monitors[i % monitors_num]);
+        client->tags = 1 << (bench_random(&seed) % 4);
+        client->is_floating = i % 7 == 0;
+        saved_tags[i] = client->tags;
+    }
+    for (uint64_t i = 0; i < monitors_num; ++i) {
+        monitor_arrange(monitors[i]);
+    }
+    uint64_t start = monotonic_now_ns();
+    session_save(path);
+    double save_us = (double)(monotonic_now_ns() - start) / 1000;
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        struct client *client = get_client_by_win(pendings[i].window);
+        monitor_remove_client(client->monitor, client);
+        client_list_remove(client->window);
+        client_free(client);
+    }
+    for (uint64_t i = 0; i < monitors_num; ++i) {
+        list_remove(&global_monitors, &monitors[i]->list_node);
+        monitor_free(monitors[i]);
+        monitors[i] = monitor_create(i + 1, i * 1920, 0, 1920, 1080);
+        list_append(&global_monitors, &monitors[i]->list_node);
+    }
+    global_focused_monitor = monitors[0];
+    global_dirty_windows_num = 0;
+
+    // The next instance.
+    struct configure_counters before = global_configure_counters;
+    start = monotonic_now_ns();
+    session_load(path);
+    session_restore_monitors();
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        client_adopt(&pendings[i])->needs_arrange = true;
+    }
+    monitors_arrange_pending();
+    session_restore_focus();
+    session_unload();
+    double restore_us = (double)(monotonic_now_ns() - start) / 1000;
+
+    uint64_t mismatches_num = 0;
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        struct client *client = get_client_by_win(pendings[i].window);
+        mismatches_num += client->monitor != monitors[i % monitors_num] ||
+                          client->tags != saved_tags[i] || client->is_floating != (i % 7 == 0);
+    }
+    for (uint64_t i = 0; i < monitors_num; ++i) {
+        mismatches_num += monitors[i]->current_layout_idx != LAYOUT_GRID ||
+                          monitors[i]->main_area_win_num != 2;
+    }
+    printf("session %lu windows: save %.1f us, restore %.1f us, %lu configures sent, "
+           "%lu mismatches\n",
+           clients_num, save_us, restore_us, global_configure_counters.sent - before.sent,
+           mismatches_num);
+
+    global_focused_monitor = NULL;
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        struct client *client = get_client_by_win(pendings[i].window);
+        monitor_remove_client(client->monitor, client);
+        client_list_remove(client->window);
+        client_free(client);
+        pending_client_free(&pendings[i]);
+    }
+    for (uint64_t i = 0; i < monitors_num; ++i) {
+        list_remove(&global_monitors, &monitors[i]->list_node);
+        monitor_free(monitors[i]);
+    }
+    global_dirty_windows_num = 0;
+    global_monitor_index_outdated = true;
+    free(saved_tags);
+    free(pendings);
+}
+
+// BadWindow errors for a tenth of 1000 clients with a configure each in flight. The offline
+// connection numbers every request 0, so the sequences are made up here.
+void bench_error_routing(void)
+{
+    const uint64_t clients_num = 1000;
+    const uint64_t errors_num = 100;
+    struct monitor *monitor = bench_monitor_with_clients(clients_num, NULL);
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        error_route(1000 + i, ERROR_ROUTE_CLIENT, bench_window_id(i));
+    }
+
+    struct error_counters before = global_error_counters;
+    uint64_t start = monotonic_now_ns();
+    for (uint64_t i = 0; i < errors_num; ++i) {
+        xcb_generic_error_t error = {0};
+        error.error_code = XCB_WINDOW;
+        error.full_sequence = 1000 + i * (clients_num / errors_num);
+        error.resource_id = bench_window_id(i * (clients_num / errors_num));
+        handle_event((xcb_generic_event_t *)&error);
+    }
+    printf("errors %lu BadWindow over %lu routes: %lu routed, %lu clients dropped, %.1f ns per "
+           "error\n",
+           errors_num, clients_num, global_error_counters.routed - before.routed,
+           global_error_counters.clients_dropped - before.clients_dropped,
+           (double)(monotonic_now_ns() - start) / errors_num);
+
+    // Requests whose routes were already overwritten by later ones.
+    before = global_error_counters;
+    for (uint64_t i = 0; i < errors_num; ++i) {
+        xcb_generic_error_t error = {0};
+        error.error_code = XCB_WINDOW;
+        error.full_sequence = 1;
+        error.resource_id = bench_window_id(i * (clients_num / errors_num) + 1);
+        handle_event((xcb_generic_event_t *)&error);
+    }
+    printf("errors %lu BadWindow without routes: %lu routed, %lu clients dropped\n", errors_num,
+           global_error_counters.routed - before.routed,
+           global_error_counters.clients_dropped - before.clients_dropped);
+
+    bench_monitor_free(monitor);
+    memset(global_error_routes, 0, sizeof(global_error_routes));
+}
+
+// The size hint solver with integer division, which the batch pass must match exactly.
+static struct box bench_constrain_reference(const struct size_constraints *const c, struct box box)
+{
+    int32_t width = max((int32_t)box.width - c->aspect_base_width, 0);
+    int32_t height = max((int32_t)box.height - c->aspect_base_height, 0);
+    if (c->max_aspect > 0 && width > (height * c->max_aspect >> 16)) {
+        width = height * c->max_aspect >> 16;
+    }
+    if (c->min_aspect > 0 && ((int64_t)width << 16) < height * c->min_aspect) {
+        height = width * c->inverse_min_aspect >> 16;
+    }
+    width = max(width + c->aspect_base_width - c->base_width, 0);
+    height = max(height + c->aspect_base_height - c->base_height, 0);
+    width -= width % max(c->width_inc, 1);
+    height -= height % max(c->height_inc, 1);
+    width = max(width + c->base_width, max(c->min_width, 1));
+    height = max(height + c->base_height, max(c->min_height, 1));
+    box.width = c->max_width > 0 ? min(width, c->max_width) : width;
+    box.height = c->max_height > 0 ? min(height, c->max_height) : height;
+    return box;
+}
+
+// Terminals with cell-size increments: random hints checked against the reference, then a tiled
+// monitor of 300 of them constrained per client and in one batch.
+void bench_size_hints(void)
+{
+    const uint64_t boxes_num = 100000;
+    const uint64_t clients_num = 300;
+    const uint64_t rounds = 1000;
+    struct size_constraints *constraints =
+        (struct size_constraints *)malloc(boxes_num * sizeof(struct size_constraints));
+    struct box *boxes = (struct box *)malloc(boxes_num * sizeof(struct box));
+    struct client *clients = (struct client *)calloc(clients_num, sizeof(struct client));
+    struct monitor *monitor = monitor_create(0, 0, 0, 3840, 2160);
+    if (constraints == NULL || boxes == NULL || clients == NULL || monitor == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    uint32_t seed = 1;
+    uint64_t mismatches_num = 0;
+    for (uint64_t i = 0; i < boxes_num; ++i) {
+        xcb_size_hints_t size_hints = {0};
+        // Every fifth has no base size, so min stands in for it and the aspect base is 0.
+        size_hints.flags = (i % 5 != 0 ? XCB_ICCCM_SIZE_HINT_BASE_SIZE : 0) |
+                           XCB_ICCCM_SIZE_HINT_P_RESIZE_INC;
+        size_hints.base_width = bench_random(&seed) % 32;
+        size_hints.base_height = bench_random(&seed) % 32;
+        size_hints.width_inc = 1 + bench_random(&seed) % 300;
+        size_hints.height_inc = 1 + bench_random(&seed) % 300;
+        if (i % 4 == 0) {
+            size_hints.flags |= XCB_ICCCM_SIZE_HINT_P_MIN_SIZE | XCB_ICCCM_SIZE_HINT_P_MAX_SIZE;
+            size_hints.min_width = bench_random(&seed) % 200;
+            size_hints.min_height = bench_random(&seed) % 200;
+            size_hints.max_width = bench_random(&seed) % 4000;
+            size_hints.max_height = bench_random(&seed) % 4000;
+        }
+        if (i % 3 == 0) {
+            size_hints.flags |= XCB_ICCCM_SIZE_HINT_P_ASPECT;
+            size_hints.min_aspect_num = 1 + bench_random(&seed) % 16;
+            size_hints.min_aspect_den = 1 + bench_random(&seed) % 16;
+            size_hints.max_aspect_num = size_hints.min_aspect_num + bench_random(&seed) % 16;
+            size_hints.max_aspect_den = size_hints.min_aspect_den;
+        }
+        client_set_size_hints(&clients[0], &size_hints);
+        constraints[i] = clients[0].size_constraints;
+        struct box box = {0, 0, bench_random(&seed) % UINT16_MAX, bench_random(&seed) % 4000};
+        boxes[i] = box;
+    }
+    struct box *expected = (struct box *)malloc(boxes_num * sizeof(struct box));
+    if (expected == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    for (uint64_t i = 0; i < boxes_num; ++i) {
+        expected[i] = bench_constrain_reference(&constraints[i], boxes[i]);
+    }
+    size_constraints_apply(constraints, boxes, boxes_num);
+    for (uint64_t i = 0; i < boxes_num; ++i) {
+        mismatches_num += box_compare(boxes[i], expected[i]) == false;
+    }
+
+    xcb_size_hints_t terminal_hints = {0};
+    terminal_hints.flags = XCB_ICCCM_SIZE_HINT_BASE_SIZE | XCB_ICCCM_SIZE_HINT_P_MIN_SIZE |
+                           XCB_ICCCM_SIZE_HINT_P_RESIZE_INC;
+    terminal_hints.base_width = 4;
+    terminal_hints.base_height = 4;
+    terminal_hints.min_width = 4 + 9;
+    terminal_hints.min_height = 4 + 18;
+    terminal_hints.width_inc = 9;
+    terminal_hints.height_inc = 18;
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        clients[i].monitor = monitor;
+        client_set_size_hints(&clients[i], &terminal_hints);
+        constraints[i] = clients[i].size_constraints;
+    }
+    monitor->layouts[LAYOUT_GRID].arrange(monitor, clients_num, expected);
+    uint64_t start = monotonic_now_ns();
+    for (uint64_t j = 0; j < rounds; ++j) {
+        for (uint64_t i = 0; i < clients_num; ++i) {
+            boxes[i] = get_box_with_size_hints(&clients[i], expected[i]);
+        }
+    }
+    double per_client_ns = (double)(monotonic_now_ns() - start) / (rounds * clients_num);
+    start = monotonic_now_ns();
+    for (uint64_t j = 0; j < rounds; ++j) {
+        memcpy(boxes, expected, clients_num * sizeof(struct box));
+        size_constraints_apply(constraints, boxes, clients_num);
+    }
+    double batch_ns = (double)(monotonic_now_ns() - start) / (rounds * clients_num);
+    printf("size hints %lu random boxes: %lu mismatches; %lu terminals: per client %.1f ns, "
+           "batch %.1f ns per box\n",
+           boxes_num, mismatches_num, clients_num, per_client_ns, batch_ns);
+
+    free(expected);
+    free(constraints);
+    free(boxes);
+    free(clients);
+    monitor_free(monitor);
+}
+
+// Stands in for the worker: pushes records through the real ring as fast as the event loop takes
+// them, waking it once per METADATA_BATCH_SIZE records.
+static void *bench_metadata_produce(void *argument)
+{
+    const uint64_t records_num = *(const uint64_t *)argument;
+    const uint64_t clients_num = 300;
+    for (uint64_t i = 0; i < records_num; ++i) {
+        uint32_t slot = 0;
+        if (metadata_worker_reserve(&slot) == false) {
+            break;
+        }
+        struct metadata_record *record = &global_metadata_records[slot];
+        record->window = bench_window_id(i % clients_num);
+        record->requested = PROPERTY_NAMES | PROPERTY_NET_WM_PID;
+        record->fetched = record->requested;
+        record->values.has_net_wm_name = true;
+        record->values.pid = i;
+        snprintf(record->values.name, sizeof(record->values.name), "title %lu", i);
+        spsc_ring_push(&global_metadata_record_ring);
+        if ((i + 1) % METADATA_BATCH_SIZE == 0 || i + 1 == records_num) {
+            counter_fd_add(global_metadata_record_fd, 1);
+        }
+    }
+    return NULL;
+}
+
+// Stands in for a worker that lost its connection: a single record without values.
+static void *bench_metadata_fail(void *argument)
+{
+    uint32_t slot = 0;
+    if (metadata_worker_reserve(&slot) == true) {
+        struct metadata_record *record = &global_metadata_records[slot];
+        memset(record, 0, sizeof(struct metadata_record));
+        record->window = bench_window_id(0);
+        record->requested = PROPERTY_NAMES;
+        spsc_ring_push(&global_metadata_record_ring);
+        counter_fd_add(global_metadata_record_fd, 1);
+    }
+    return NULL;
+}
+
+void bench_metadata_worker(void)
+{
+    uint64_t records_num = 100000;
+    const uint64_t clients_num = 300;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    global_metadata_record_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = EVENT_SOURCE_METADATA};
+    if (epoll_fd < 0 || global_metadata_record_fd < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, global_metadata_record_fd, &event) != 0) {
+        fprintf(stderr, "Can't set up metadata bench!\n");
+        exit(1);
+    }
+    struct monitor *monitor = bench_monitor_with_clients(clients_num, NULL);
+
+    atomic_store(&global_metadata_worker_running, true);
+    struct metadata_counters before = global_metadata_counters;
+    uint64_t longest_ns = 0;
+    uint64_t applying_ns = 0;
+    pthread_t producer;
+    pthread_create(&producer, NULL, bench_metadata_produce, &records_num);
+    while (global_metadata_counters.records - before.records < records_num) {
+        if (epoll_wait(epoll_fd, &event, 1, 1000) != 1) {
+            break;
+        }
+        uint64_t batch_start = monotonic_now_ns();
+        handle_metadata_records();
+        uint64_t batch_ns = monotonic_now_ns() - batch_start;
+        applying_ns += batch_ns;
+        longest_ns = max(longest_ns, batch_ns);
+    }
+    atomic_store(&global_metadata_worker_running, false);
+    pthread_join(producer, NULL);
+
+    // Every client must end up with the values of the last record sent for it.
+    uint64_t mismatches_num = 0;
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        struct client *client = get_client_by_win(bench_window_id(i));
+        uint64_t last = (records_num - 1 - i) / clients_num * clients_num + i;
+        char name[32];
+        snprintf(name, sizeof(name), "title %lu", last);
+        if (client == NULL || client_properties(client)->pid != last ||
+            strcmp(client_name(client), name) != 0) {
+            ++mismatches_num;
+        }
+    }
+    uint64_t batches_num = global_metadata_counters.batches - before.batches;
+    printf("metadata %lu records over %lu clients: %lu wakeups, main thread %.1f ns per record, "
+           "longest batch %.1f us, %lu mismatches\n",
+           records_num, clients_num, batches_num, (double)applying_ns / records_num,
+           (double)longest_ns / 1000, mismatches_num);
+
+    // Every client has its icon with the worker when it fails.
+    for (struct list_node *node = monitor->clients; node != NULL; node = node->next) {
+        container_of(node, struct client, list_node)->fetching_properties = PROPERTY_NET_WM_ICON;
+    }
+    global_metadata_request_fd = eventfd(0, EFD_CLOEXEC);
+    atomic_store(&global_metadata_worker_running, true);
+    global_metadata_properties = PROPERTY_METADATA;
+    pthread_create(&global_metadata_thread, NULL, bench_metadata_fail, NULL);
+    if (epoll_wait(epoll_fd, &event, 1, 1000) == 1) {
+        handle_metadata_records();
+    }
+    uint64_t refetched_num = 0;
+    for (struct list_node *node = monitor->clients; node != NULL; node = node->next) {
+        struct client *client = container_of(node, struct client, list_node);
+        refetched_num += client->fetching_properties == 0 &&
+                         (client->dirty_properties & PROPERTY_NET_WM_ICON) != 0;
+    }
+    printf("metadata worker failure: %s, %lu of %lu clients refetched on the main connection\n",
+           global_metadata_properties == 0 ? "stopped" : "still running", refetched_num,
+           clients_num);
+    global_dirty_windows_num = 0;
+
+    bench_monitor_free(monitor);
+    metadata_worker_stop();
+    close(epoll_fd);
+}
+
+void bench_bar(void)
+{
+    const uint64_t batches_num = 100000;
+    // What bar_init() would take from "fixed", which is 6 by 13 pixels.
+    memset(global_bar_glyph_widths, 6, sizeof(global_bar_glyph_widths));
+    global_bar_tag_width = 6 + 2 * global_bar_padding;
+    global_bar_height = 13 + global_bar_padding;
+    global_bar_baseline = global_bar_padding / 2 + 11;
+    global_bar_has_icons = true;
+    const uint64_t clients_num = 3;
+    struct client *clients[clients_num];
+    struct monitor *monitor = bench_monitor_with_clients(clients_num, clients);
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        struct client_properties *properties = client_properties(clients[i]);
+        snprintf(properties->name, sizeof(properties->name), "terminal %lu - vim main.c", i);
+        properties->has_icon = true;
+    }
+    monitor->focused_client = clients[clients_num - 1];
+    snprintf(global_bar_status, sizeof(global_bar_status), "vol 40%% | bat 81%%");
+    snprintf(global_bar_clock, sizeof(global_bar_clock), "Sat 17 Oct 12:00");
+    bars_draw();
+    // Stands in for the segment bar_create() attaches, so icons take the shared memory path
+    // without a SysV segment.
+    static uint32_t shm_pixels[ICON_SIZE * ICON_SIZE];
+    monitor->bar.shm_pixels = shm_pixels;
+    monitor->bar.shm_seg = xcb_generate_id(global_xconnection);
+
+    uint32_t round_trips = global_round_trips;
+    struct bar_counters before = global_bar_counters;
+    uint64_t start = monotonic_now_ns();
+    for (uint64_t i = 0; i < batches_num; ++i) {
+        bars_draw();
+    }
+    printf("bar unchanged, %lu batches: %.1f ns per batch, %lu segments drawn\n", batches_num,
+           (double)(monotonic_now_ns() - start) / batches_num,
+           global_bar_counters.segments_drawn - before.segments_drawn);
+
+    before = global_bar_counters;
+    start = monotonic_now_ns();
+    for (uint64_t i = 0; i < batches_num; ++i) {
+        snprintf(global_bar_clock, sizeof(global_bar_clock), "Sat 17 Oct 12:%02lu", i % 60);
+        bars_draw();
+    }
+    printf("bar clock tick, %lu batches: %.1f ns per batch, %.2f segments drawn per batch, %u "
+           "round trips\n",
+           batches_num, (double)(monotonic_now_ns() - start) / batches_num,
+           (double)(global_bar_counters.segments_drawn - before.segments_drawn) / batches_num,
+           global_round_trips - round_trips);
+
+    // Focus moving between clients with icons, the completion of each put arriving in between.
+    before = global_bar_counters;
+    start = monotonic_now_ns();
+    for (uint64_t i = 0; i < batches_num; ++i) {
+        monitor->focused_client = container_of(
+            i % 2 == 0 ? monitor->clients : monitor->clients->next, struct client, list_node);
+        bars_draw();
+        xcb_shm_completion_event_t completion = {0};
+        completion.drawable = monitor->bar.pixmap;
+        completion.shmseg = monitor->bar.shm_seg;
+        handle_shm_completion(&completion);
+    }
+    printf("bar focus change, %lu batches: %.1f ns per batch, %lu icons deferred, %u round trips\n",
+           batches_num, (double)(monotonic_now_ns() - start) / batches_num,
+           global_bar_counters.icons_deferred - before.icons_deferred,
+           global_round_trips - round_trips);
+
+    // The monitor shrinks while an icon is still uploading to the pixmap that gets replaced.
+    monitor->focused_client = container_of(monitor->clients, struct client, list_node);
+    bars_draw();
+    xcb_shm_completion_event_t completion = {0};
+    completion.drawable = monitor->bar.pixmap;
+    completion.shmseg = monitor->bar.shm_seg;
+    monitor->crtc_box.width = 1280;
+    bars_draw();
+    handle_shm_completion(&completion);
+    printf("bar resize during an icon upload: %s\n",
+           monitor->bar.is_shm_busy == false ? "completed" : "stuck");
+
+    monitor->bar.shm_pixels = NULL;
+    bench_monitor_free(monitor);
+    global_bar_height = 0;
+}
+
+void bench_focus(void)
+{
+    const uint64_t clients_num = 1000;
+    const uint64_t changes_num = 100000;
+    const uint64_t changes_per_batch = 100;
+    const uint64_t removals_num = 100;
+    const uint64_t enters_num = 1000;
+    struct client **clients = (struct client **)calloc(clients_num, sizeof(struct client *));
+    if (clients == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        exit(1);
+    }
+    struct monitor *monitor = bench_monitor_with_clients(clients_num, clients);
+
+    // Focus jumping around, published once per batch.
+    uint32_t random = 1;
+    struct focus_counters before = global_focus_counters;
+    uint64_t start = monotonic_now_ns();
+    for (uint64_t i = 0; i < changes_num; ++i) {
+        monitor_focus_client(monitor, clients[bench_random(&random) % clients_num]);
+        if ((i + 1) % changes_per_batch == 0) {
+            focus_publish();
+        }
+    }
+    printf("focus %lu changes over %lu clients: %.1f ns per change, %lu published in %lu "
+           "batches\n",
+           changes_num, clients_num, (double)(monotonic_now_ns() - start) / changes_num,
+           global_focus_counters.changes - before.changes, changes_num / changes_per_batch);
+
+    // Closing the focused client hands the focus back along the MRU stack.
+    for (uint64_t i = 0; i < removals_num; ++i) {
+        monitor_focus_client(monitor, clients[i]);
+    }
+    uint64_t mismatches_num = 0;
+    start = monotonic_now_ns();
+    for (uint64_t i = removals_num; i > 1; --i) {
+        client_unmanage(clients[i - 1]);
+        mismatches_num += monitor->focused_client != clients[i - 2];
+    }
+    printf("focus %lu removals of the focused client: %.1f ns each, %lu mismatches\n",
+           removals_num - 1, (double)(monotonic_now_ns() - start) / (removals_num - 1),
+           mismatches_num);
+
+    // Half the crossings come from a layout before the barrier, half from the pointer after it.
+    global_focus_barrier_sequence = 100000;
+    before = global_focus_counters;
+    for (uint64_t i = 0; i < enters_num; ++i) {
+        union {
+            xcb_enter_notify_event_t enter;
+            xcb_generic_event_t generic;
+        } event = {0};
+        event.enter.response_type = XCB_ENTER_NOTIFY;
+        event.enter.mode = XCB_NOTIFY_MODE_NORMAL;
+        event.enter.detail = XCB_NOTIFY_DETAIL_NONLINEAR;
+        event.enter.event = bench_window_id(removals_num + i % (clients_num - removals_num));
+        event.generic.full_sequence = global_focus_barrier_sequence - enters_num / 2 + i;
+        handle_event(&event.generic);
+    }
+    printf("focus %lu crossings: %lu suppressed, %lu handled\n", enters_num,
+           global_focus_counters.enters_suppressed - before.enters_suppressed,
+           global_focus_counters.enters_handled - before.enters_handled);
+
+    bench_monitor_free(monitor);
+    free(clients);
+    global_published_focus = XCB_NONE;
+    global_focus_barrier_sequence = 0;
+}
+
+void bench_layouts(void)
+{
+    const uint64_t clients_nums[] = {1, 10, 100, 1000, 10000};
+    const uint64_t clients_nums_len = sizeof(clients_nums) / sizeof(clients_nums[0]);
+    printf("arrange us/call %8s", "");
+    for (uint64_t i = 0; i < clients_nums_len; ++i) {
+        printf(" %8lu", clients_nums[i]);
+    }
+    printf("\n");
+    for (uint8_t layout_idx = 0; layout_idx < LAYOUT_END; ++layout_idx) {
+        printf("arrange %-16s", global_layouts[layout_idx].name);
+        for (uint64_t i = 0; i < clients_nums_len; ++i) {
+            uint64_t clients_num = clients_nums[i];
+            struct monitor *monitor = monitor_create(0, 0, 0, 3840, 2160);
+            struct client **clients =
+                (struct client **)calloc(clients_num, sizeof(struct client *));
+            if (monitor == NULL || clients == NULL) {
+                fprintf(stderr, "Out of memory!\n");
+                exit(1);
+            }
+            list_append(&global_monitors, &monitor->list_node);
+            monitor_set_layout(monitor, layout_idx);
+            for (uint64_t j = 0; j < clients_num; ++j) {
+                clients[j] = client_alloc();
+                clients[j]->window = bench_window_id(j);
+                clients[j]->border_width = global_client_border_width;
+                clients[j]->tags = MASK_TAG1;
+                monitor_append_client(monitor, clients[j]);
+            }
+            monitor_arrange(monitor);
+
+            uint64_t rounds = max(100, 1000000 / clients_num);
+            uint64_t start = monotonic_now_ns();
+            for (uint64_t j = 0; j < rounds; ++j) {
+                // Alternate the main area so that every round commits new geometry.
+                monitor->main_area_fraction = j % 2 == 0 ? 0.5 : 0.6;
+                monitor_arrange(monitor);
+            }
+            printf(" %8.2f", (double)(monotonic_now_ns() - start) / rounds / 1000);
+
+            for (uint64_t j = 0; j < clients_num; ++j) {
+                monitor_remove_client(monitor, clients[j]);
+                client_free(clients[j]);
+            }
+            list_remove(&global_monitors, &monitor->list_node);
+            free(clients);
+            monitor_free(monitor);
+        }
+        printf("\n");
+    }
+}
+
+// An X Server inside the benchmark process. It speaks the protocol on one end of a socket pair,
+// answers what the window manager asks from a scripted model of windows and CRTCs, and counts
+// every request. Replies are held back until the window manager announces through
+// global_x11_before_wait that it blocks on one of them, and each such wait counts as a round trip.
+#define FAKE_X_ROOT 0x3a0
+#define FAKE_X_VISUAL 0x21
+#define FAKE_X_WINDOW_BASE 0x400000
+#define FAKE_X_CRTCS_NUM 2
+#define FAKE_X_ATOMS_MAX 1024
+#define FAKE_X_RANDR_OPCODE 140
+#define FAKE_X_RANDR_FIRST_EVENT 89
+#define FAKE_X_RANDR_FIRST_ERROR 147
+#define FAKE_X_UNANNOUNCED_WAIT_MS 1000
+
+struct fake_x_window {
+    bool exists;
+    bool is_mapped;
+    struct box box;
+};
+
+struct fake_x_crtc {
+    bool is_active;
+    struct box box;
+};
+
+struct fake_x_counters {
+    uint64_t requests;
+    uint64_t replies;
+    uint64_t errors;
+    uint64_t round_trips;
+    // Synchronizations of the benchmark itself, each one request, reply and round trip.
+    uint64_t syncs;
+    uint64_t opcodes[256];
+};
+
+struct fake_x {
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int fd;
+    // The client writes how many bytes it sent before each wait into wait_fds[1].
+    int wait_fds[2];
+    uint16_t sequence;
+    // Bytes of requests handled, where the held back output starts, and the wait being answered.
+    uint64_t handled;
+    uint64_t owed_since;
+    uint64_t waited;
+
+    uint8_t *input;
+    uint64_t input_len;
+    uint64_t input_capacity;
+    uint8_t *output;
+    uint64_t output_len;
+    uint64_t output_capacity;
+
+    struct fake_x_window *windows;
+    uint64_t windows_num;
+    uint64_t windows_capacity;
+    struct fake_x_crtc crtcs[FAKE_X_CRTCS_NUM];
+    char *atom_names[FAKE_X_ATOMS_MAX];
+    uint32_t atoms_num;
+
+    struct fake_x_counters counters;
+};
+
+static struct fake_x global_fake_x = {
+    .lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1, .wait_fds = {-1, -1}};
+
+// Core requests the client waits a reply for. Those the model doesn't know get an error instead,
+// which the client also accepts as an answer.
+static const bool global_fake_x_has_reply[128] = {
+    [XCB_GET_WINDOW_ATTRIBUTES] = true, [XCB_GET_GEOMETRY] = true,
+    [XCB_QUERY_TREE] = true,            [XCB_INTERN_ATOM] = true,
+    [XCB_GET_ATOM_NAME] = true,         [XCB_GET_PROPERTY] = true,
+    [XCB_LIST_PROPERTIES] = true,       [XCB_GET_SELECTION_OWNER] = true,
+    [XCB_GRAB_POINTER] = true,          [XCB_GRAB_KEYBOARD] = true,
+    [XCB_QUERY_POINTER] = true,         [XCB_GET_MOTION_EVENTS] = true,
+    [XCB_TRANSLATE_COORDINATES] = true, [XCB_GET_INPUT_FOCUS] = true,
+    [XCB_QUERY_KEYMAP] = true,          [XCB_QUERY_FONT] = true,
+    [XCB_QUERY_TEXT_EXTENTS] = true,    [XCB_LIST_FONTS] = true,
+    [XCB_LIST_FONTS_WITH_INFO] = true,  [XCB_GET_FONT_PATH] = true,
+    [XCB_GET_IMAGE] = true,             [XCB_LIST_INSTALLED_COLORMAPS] = true,
+    [XCB_ALLOC_COLOR] = true,           [XCB_ALLOC_NAMED_COLOR] = true,
+    [XCB_ALLOC_COLOR_CELLS] = true,     [XCB_ALLOC_COLOR_PLANES] = true,
+    [XCB_QUERY_COLORS] = true,          [XCB_LOOKUP_COLOR] = true,
+    [XCB_QUERY_BEST_SIZE] = true,       [XCB_QUERY_EXTENSION] = true,
+    [XCB_LIST_EXTENSIONS] = true,       [XCB_GET_KEYBOARD_MAPPING] = true,
+    [XCB_GET_KEYBOARD_CONTROL] = true,  [XCB_GET_POINTER_CONTROL] = true,
+    [XCB_GET_SCREEN_SAVER] = true,      [XCB_LIST_HOSTS] = true,
+    [XCB_SET_POINTER_MAPPING] = true,   [XCB_GET_POINTER_MAPPING] = true,
+    [XCB_SET_MODIFIER_MAPPING] = true,  [XCB_GET_MODIFIER_MAPPING] = true,
+};
+
+void fake_x_write(const void *data, uint64_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    if (global_fake_x.output_len + size > global_fake_x.output_capacity) {
+        uint64_t new_capacity = max(max(4096, global_fake_x.output_capacity * 2),
+                                    global_fake_x.output_len + size);
+        uint8_t *new_output = (uint8_t *)realloc(global_fake_x.output, new_capacity);
+        if (new_output == NULL) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        global_fake_x.output = new_output;
+        global_fake_x.output_capacity = new_capacity;
+    }
+    memcpy(global_fake_x.output + global_fake_x.output_len, data, size);
+    global_fake_x.output_len += size;
+}
+
+void fake_x_flush(void)
+{
+    uint64_t written = 0;
+    while (written < global_fake_x.output_len) {
+        ssize_t result = write(global_fake_x.fd, global_fake_x.output + written,
+                               global_fake_x.output_len - written);
+        if (result <= 0 && errno != EINTR) {
+            break;
+        }
+        written += result > 0 ? result : 0;
+    }
+    global_fake_x.output_len = 0;
+}
+
+// Replies shorter than 32 bytes are padded, longer ones carry the rest in their length.
+void fake_x_reply(void *reply, uint64_t size, const void *data, uint64_t data_size)
+{
+    static const uint8_t zeros[32] = {0};
+    uint64_t padded_data_size = (data_size + 3) & ~3;
+    xcb_generic_reply_t *header = (xcb_generic_reply_t *)reply;
+    header->response_type = 1;
+    header->sequence = global_fake_x.sequence;
+    header->length = (max(size, 32) - 32 + padded_data_size) / 4;
+    fake_x_write(reply, size);
+    fake_x_write(zeros, size < 32 ? 32 - size : 0);
+    fake_x_write(data, data_size);
+    fake_x_write(zeros, padded_data_size - data_size);
+    ++global_fake_x.counters.replies;
+}
+
+void fake_x_error(uint8_t error_code, uint32_t resource_id, uint8_t major_code, uint16_t minor_code)
+{
+    xcb_generic_error_t error = {.error_code = error_code,
+                                 .sequence = global_fake_x.sequence,
+                                 .resource_id = resource_id,
+                                 .minor_code = minor_code,
+                                 .major_code = major_code};
+    // Without the full sequence XCB adds on its side.
+    fake_x_write(&error, 32);
+    ++global_fake_x.counters.errors;
+}
+
+struct fake_x_window *fake_x_get_window(xcb_window_t window)
+{
+    uint64_t idx = (uint64_t)window - FAKE_X_WINDOW_BASE;
+    if (window < FAKE_X_WINDOW_BASE || idx >= global_fake_x.windows_num ||
+        global_fake_x.windows[idx].exists == false) {
+        return NULL;
+    }
+    return &global_fake_x.windows[idx];
+}
+
+xcb_atom_t fake_x_intern_atom(const char *const name, uint16_t name_len, bool only_if_exists)
+{
+    for (uint32_t i = 0; i < global_fake_x.atoms_num; ++i) {
+        if (strlen(global_fake_x.atom_names[i]) == name_len &&
+            memcmp(global_fake_x.atom_names[i], name, name_len) == 0) {
+            return XCB_ATOM_WM_TRANSIENT_FOR + 1 + i;
+        }
+    }
+    if (only_if_exists == true || global_fake_x.atoms_num == FAKE_X_ATOMS_MAX) {
+        return XCB_ATOM_NONE;
+    }
+    global_fake_x.atom_names[global_fake_x.atoms_num] = strndup(name, name_len);
+    if (global_fake_x.atom_names[global_fake_x.atoms_num] == NULL) {
+        return XCB_ATOM_NONE;
+    }
+    return XCB_ATOM_WM_TRANSIENT_FOR + 1 + global_fake_x.atoms_num++;
+}
+
+void fake_x_configure_window(const xcb_configure_window_request_t *const request)
+{
+    struct fake_x_window *window = fake_x_get_window(request->window);
+    if (window == NULL) {
+        if (request->window >= FAKE_X_WINDOW_BASE) {
+            fake_x_error(XCB_WINDOW, request->window, XCB_CONFIGURE_WINDOW, 0);
+        }
+        return;
+    }
+    const uint32_t *values = (const uint32_t *)(request + 1);
+    if (request->value_mask & XCB_CONFIG_WINDOW_X) {
+        window->box.x = (int16_t)*values++;
+    }
+    if (request->value_mask & XCB_CONFIG_WINDOW_Y) {
+        window->box.y = (int16_t)*values++;
+    }
+    if (request->value_mask & XCB_CONFIG_WINDOW_WIDTH) {
+        window->box.width = (uint16_t)*values++;
+    }
+    if (request->value_mask & XCB_CONFIG_WINDOW_HEIGHT) {
+        window->box.height = (uint16_t)*values++;
+    }
+}
+
+void fake_x_randr_request(const uint8_t *const request)
+{
+    const xcb_randr_mode_t mode = 0x45;
+    switch (request[1]) {
+    case XCB_RANDR_SELECT_INPUT:
+        break;
+    case XCB_RANDR_GET_OUTPUT_PRIMARY: {
+        xcb_randr_get_output_primary_reply_t reply = {.output = 0x41};
+        fake_x_reply(&reply, sizeof(reply), NULL, 0);
+        break;
+    }
+    case XCB_RANDR_GET_SCREEN_RESOURCES_CURRENT: {
+        const char mode_name[] = "1920x1080";
+        struct {
+            uint32_t crtcs[FAKE_X_CRTCS_NUM];
+            uint32_t outputs[FAKE_X_CRTCS_NUM];
+            xcb_randr_mode_info_t mode_info;
+            char name[sizeof(mode_name) - 1];
+        } data = {.mode_info = {.id = mode,
+                                .width = 1920,
+                                .height = 1080,
+                                .dot_clock = 148500000,
+                                .htotal = 2200,
+                                .vtotal = 1125,
+                                .name_len = sizeof(mode_name) - 1}};
+        for (uint32_t i = 0; i < FAKE_X_CRTCS_NUM; ++i) {
+            data.crtcs[i] = 0x3f + i;
+            data.outputs[i] = 0x41 + i;
+        }
+        memcpy(data.name, mode_name, sizeof(data.name));
+        xcb_randr_get_screen_resources_current_reply_t reply = {.num_crtcs = FAKE_X_CRTCS_NUM,
+                                                                .num_outputs = FAKE_X_CRTCS_NUM,
+                                                                .num_modes = 1,
+                                                                .names_len = sizeof(data.name)};
+        fake_x_reply(&reply, sizeof(reply), &data, sizeof(data));
+        break;
+    }
+    case XCB_RANDR_GET_CRTC_INFO: {
+        uint32_t idx = ((const xcb_randr_get_crtc_info_request_t *)request)->crtc - 0x3f;
+        if (idx >= FAKE_X_CRTCS_NUM) {
+            fake_x_error(FAKE_X_RANDR_FIRST_ERROR + XCB_RANDR_BAD_CRTC, idx + 0x3f,
+                         FAKE_X_RANDR_OPCODE, request[1]);
+            break;
+        }
+        const struct fake_x_crtc *crtc = &global_fake_x.crtcs[idx];
+        xcb_randr_get_crtc_info_reply_t reply = {.x = crtc->box.x,
+                                                 .y = crtc->box.y,
+                                                 .width = crtc->box.width,
+                                                 .height = crtc->box.height,
+                                                 .mode = crtc->is_active ? mode : XCB_NONE,
+                                                 .rotation = XCB_RANDR_ROTATION_ROTATE_0,
+                                                 .rotations = XCB_RANDR_ROTATION_ROTATE_0,
+                                                 .num_outputs = crtc->is_active ? 1 : 0};
+        uint32_t output = 0x41 + idx;
+        fake_x_reply(&reply, sizeof(reply), &output, crtc->is_active ? sizeof(output) : 0);
+        break;
+    }
+    default:
+        fake_x_error(XCB_REQUEST, 0, FAKE_X_RANDR_OPCODE, request[1]);
+        break;
+    }
+}
+
+void fake_x_request(const uint8_t *const request)
+{
+    uint8_t opcode = request[0];
+    ++global_fake_x.sequence;
+    ++global_fake_x.counters.requests;
+    ++global_fake_x.counters.opcodes[opcode];
+    switch (opcode) {
+    case XCB_GET_WINDOW_ATTRIBUTES: {
+        xcb_window_t id = ((const xcb_get_window_attributes_request_t *)request)->window;
+        const struct fake_x_window *window = fake_x_get_window(id);
+        if (window == NULL && id != FAKE_X_ROOT) {
+            fake_x_error(XCB_WINDOW, id, opcode, 0);
+            break;
+        }
+        xcb_get_window_attributes_reply_t reply = {
+            .visual = FAKE_X_VISUAL,
+            ._class = XCB_WINDOW_CLASS_INPUT_OUTPUT,
+            .map_state = window == NULL || window->is_mapped ? XCB_MAP_STATE_VIEWABLE
+                                                              : XCB_MAP_STATE_UNMAPPED};
+        fake_x_reply(&reply, sizeof(reply), NULL, 0);
+        break;
+    }
+    case XCB_GET_GEOMETRY: {
+        xcb_drawable_t id = ((const xcb_get_geometry_request_t *)request)->drawable;
+        const struct fake_x_window *window = fake_x_get_window(id);
+        if (window == NULL && id != FAKE_X_ROOT) {
+            fake_x_error(XCB_DRAWABLE, id, opcode, 0);
+            break;
+        }
+        struct box box = window != NULL ? window->box : (struct box){0, 0, 3840, 1080};
+        xcb_get_geometry_reply_t reply = {.depth = 24,
+                                          .root = FAKE_X_ROOT,
+                                          .x = box.x,
+                                          .y = box.y,
+                                          .width = box.width,
+                                          .height = box.height};
+        fake_x_reply(&reply, sizeof(reply), NULL, 0);
+        break;
+    }
+    case XCB_QUERY_TREE: {
+        xcb_window_t id = ((const xcb_query_tree_request_t *)request)->window;
+        uint32_t *children = (uint32_t *)calloc(global_fake_x.windows_num + 1, sizeof(uint32_t));
+        if (children == NULL) {
+            fprintf(stderr, "Out of memory!\n");
+            exit(1);
+        }
+        uint16_t children_len = 0;
+        for (uint64_t i = 0; id == FAKE_X_ROOT && i < global_fake_x.windows_num; ++i) {
+            if (global_fake_x.windows[i].exists == true) {
+                children[children_len++] = FAKE_X_WINDOW_BASE + i;
+            }
+        }
+        xcb_query_tree_reply_t reply = {.root = FAKE_X_ROOT, .children_len = children_len};
+        fake_x_reply(&reply, sizeof(reply), children, children_len * sizeof(uint32_t));
+        free(children);
+        break;
+    }
+    case XCB_INTERN_ATOM: {
+        const xcb_intern_atom_request_t *intern_atom = (const xcb_intern_atom_request_t *)request;
+        xcb_intern_atom_reply_t reply = {.atom = fake_x_intern_atom(
+                                             (const char *)(intern_atom + 1),
+                                             intern_atom->name_len, intern_atom->only_if_exists)};
+        fake_x_reply(&reply, sizeof(reply), NULL, 0);
+        break;
+    }
+    case XCB_GET_PROPERTY: {
+        // Every property of the model is unset.
+        xcb_window_t id = ((const xcb_get_property_request_t *)request)->window;
+        if (fake_x_get_window(id) == NULL && id != FAKE_X_ROOT) {
+            fake_x_error(XCB_WINDOW, id, opcode, 0);
+            break;
+        }
+        xcb_get_property_reply_t reply = {0};
+        fake_x_reply(&reply, sizeof(reply), NULL, 0);
+        break;
+    }
+    case XCB_QUERY_EXTENSION: {
+        const xcb_query_extension_request_t *query_extension =
+            (const xcb_query_extension_request_t *)request;
+        xcb_query_extension_reply_t reply = {0};
+        if (query_extension->name_len == strlen("RANDR") &&
+            memcmp(query_extension + 1, "RANDR", strlen("RANDR")) == 0) {
+            reply.present = 1;
+            reply.major_opcode = FAKE_X_RANDR_OPCODE;
+            reply.first_event = FAKE_X_RANDR_FIRST_EVENT;
+            reply.first_error = FAKE_X_RANDR_FIRST_ERROR;
+        }
+        fake_x_reply(&reply, sizeof(reply), NULL, 0);
+        break;
+    }
+    case XCB_QUERY_FONT: {
+        // A fixed width font, which sends no per-glyph metrics.
+        xcb_query_font_reply_t reply = {.min_bounds = {.character_width = 6, .ascent = 11},
+                                        .max_bounds = {.character_width = 6, .ascent = 11},
+                                        .max_char_or_byte2 = 255,
+                                        .font_ascent = 11,
+                                        .font_descent = 2};
+        fake_x_reply(&reply, sizeof(reply), NULL, 0);
+        break;
+    }
+    case XCB_GET_INPUT_FOCUS: {
+        xcb_get_input_focus_reply_t reply = {.revert_to = XCB_INPUT_FOCUS_POINTER_ROOT,
+                                             .focus = FAKE_X_ROOT};
+        fake_x_reply(&reply, sizeof(reply), NULL, 0);
+        break;
+    }
+    case XCB_CONFIGURE_WINDOW:
+        fake_x_configure_window((const xcb_configure_window_request_t *)request);
+        break;
+    case XCB_MAP_WINDOW:
+    case XCB_UNMAP_WINDOW: {
+        xcb_window_t id = ((const xcb_map_window_request_t *)request)->window;
+        struct fake_x_window *window = fake_x_get_window(id);
+        if (window != NULL) {
+            window->is_mapped = opcode == XCB_MAP_WINDOW;
+        } else if (id >= FAKE_X_WINDOW_BASE) {
+            fake_x_error(XCB_WINDOW, id, opcode, 0);
+        }
+        break;
+    }
+    case FAKE_X_RANDR_OPCODE:
+        fake_x_randr_request(request);
+        break;
+    default:
+        if (opcode >= 128 || global_fake_x_has_reply[opcode] == true) {
+            fake_x_error(opcode >= 128 ? XCB_REQUEST : XCB_IMPLEMENTATION, 0, opcode, 0);
+        }
+        break;
+    }
+}
+
+// The setup the client reads right after connecting: one screen with one TrueColor visual.
+void fake_x_setup(void)
+{
+    const char vendor[4] = "ewm";
+    xcb_format_t formats[] = {{.depth = 24, .bits_per_pixel = 32, .scanline_pad = 32},
+                              {.depth = 32, .bits_per_pixel = 32, .scanline_pad = 32}};
+    xcb_screen_t screen = {.root = FAKE_X_ROOT,
+                           .default_colormap = 0x20,
+                           .white_pixel = 0xffffff,
+                           .width_in_pixels = 3840,
+                           .height_in_pixels = 1080,
+                           .width_in_millimeters = 1016,
+                           .height_in_millimeters = 285,
+                           .min_installed_maps = 1,
+                           .max_installed_maps = 1,
+                           .root_visual = FAKE_X_VISUAL,
+                           .root_depth = 24,
+                           .allowed_depths_len = 1};
+    xcb_depth_t depth = {.depth = 24, .visuals_len = 1};
+    xcb_visualtype_t visual = {.visual_id = FAKE_X_VISUAL,
+                               ._class = XCB_VISUAL_CLASS_TRUE_COLOR,
+                               .bits_per_rgb_value = 8,
+                               .colormap_entries = 256,
+                               .red_mask = 0xff0000,
+                               .green_mask = 0xff00,
+                               .blue_mask = 0xff};
+    xcb_setup_t setup = {.status = 1,
+                         .protocol_major_version = 11,
+                         .protocol_minor_version = 0,
+                         .release_number = 12101000,
+                         .resource_id_base = 0x200000,
+                         .resource_id_mask = 0x1fffff,
+                         .motion_buffer_size = 256,
+                         .vendor_len = strlen(vendor),
+                         .maximum_request_length = UINT16_MAX,
+                         .roots_len = 1,
+                         .pixmap_formats_len = sizeof(formats) / sizeof(formats[0]),
+                         .image_byte_order = XCB_IMAGE_ORDER_LSB_FIRST,
+                         .bitmap_format_bit_order = XCB_IMAGE_ORDER_LSB_FIRST,
+                         .bitmap_format_scanline_unit = 32,
+                         .bitmap_format_scanline_pad = 32,
+                         .min_keycode = 8,
+                         .max_keycode = 255};
+    setup.length = (sizeof(setup) - 8 + sizeof(vendor) + sizeof(formats) + sizeof(screen) +
+                    sizeof(depth) + sizeof(visual)) /
+                   4;
+    fake_x_write(&setup, sizeof(setup));
+    fake_x_write(vendor, sizeof(vendor));
+    fake_x_write(formats, sizeof(formats));
+    fake_x_write(&screen, sizeof(screen));
+    fake_x_write(&depth, sizeof(depth));
+    fake_x_write(&visual, sizeof(visual));
+    fake_x_flush();
+}
+
+// Installed as global_x11_before_wait, runs on the client thread.
+void fake_x_before_wait(void)
+{
+    xcb_flush(global_xconnection);
+    uint64_t written = xcb_total_written(global_xconnection);
+    if (write(global_fake_x.wait_fds[1], &written, sizeof(written)) != sizeof(written)) {
+        fprintf(stderr, "Can't announce wait to fake X Server!\n");
+    }
+}
+
+// Once every request written before the announced wait is handled, sends what is held back if
+// any of it answers one of those requests. Waits on replies that already went out cost nothing.
+void fake_x_answer_wait(void)
+{
+    if (global_fake_x.waited == 0 || global_fake_x.handled < global_fake_x.waited) {
+        return;
+    }
+    if (global_fake_x.output_len > 0 && global_fake_x.owed_since < global_fake_x.waited) {
+        ++global_fake_x.counters.round_trips;
+        fake_x_flush();
+    }
+    global_fake_x.waited = 0;
+}
+
+void *fake_x_serve(void *argument)
+{
+    // The client authenticates with nothing over a socket pair.
+    xcb_setup_request_t setup_request;
+    if (read(global_fake_x.fd, &setup_request, sizeof(setup_request)) != sizeof(setup_request)) {
+        return NULL;
+    }
+    pthread_mutex_lock(&global_fake_x.lock);
+    global_fake_x.handled = sizeof(setup_request);
+    ++global_fake_x.counters.round_trips;
+    fake_x_setup();
+    pthread_mutex_unlock(&global_fake_x.lock);
+
+    while (true) {
+        pthread_mutex_lock(&global_fake_x.lock);
+        bool has_output = global_fake_x.output_len > 0;
+        pthread_mutex_unlock(&global_fake_x.lock);
+        // The next wait is read only once the previous one is answered.
+        struct pollfd pollfds[2] = {
+            {.fd = global_fake_x.fd, .events = POLLIN},
+            {.fd = global_fake_x.waited == 0 ? global_fake_x.wait_fds[0] : -1, .events = POLLIN}};
+        int ready = poll(pollfds, 2, has_output == true ? FAKE_X_UNANNOUNCED_WAIT_MS : -1);
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ready < 0) {
+            break;
+        }
+        if (ready == 0) {
+            // The client blocks somewhere it didn't announce. It gets its replies, only late.
+            pthread_mutex_lock(&global_fake_x.lock);
+            ++global_fake_x.counters.round_trips;
+            fake_x_flush();
+            pthread_mutex_unlock(&global_fake_x.lock);
+            continue;
+        }
+        if (pollfds[1].revents != 0) {
+            uint64_t written = 0;
+            if (read(global_fake_x.wait_fds[0], &written, sizeof(written)) != sizeof(written)) {
+                break;
+            }
+            global_fake_x.waited = written;
+        }
+        if (pollfds[0].revents == 0) {
+            pthread_mutex_lock(&global_fake_x.lock);
+            fake_x_answer_wait();
+            pthread_mutex_unlock(&global_fake_x.lock);
+            continue;
+        }
+
+        if (global_fake_x.input_capacity - global_fake_x.input_len < 4096) {
+            uint64_t new_capacity = max(65536, global_fake_x.input_capacity * 2);
+            uint8_t *new_input = (uint8_t *)realloc(global_fake_x.input, new_capacity);
+            if (new_input == NULL) {
+                fprintf(stderr, "Out of memory!\n");
+                exit(1);
+            }
+            global_fake_x.input = new_input;
+            global_fake_x.input_capacity = new_capacity;
+        }
+        ssize_t size = read(global_fake_x.fd, global_fake_x.input + global_fake_x.input_len,
+                            global_fake_x.input_capacity - global_fake_x.input_len);
+        if (size <= 0) {
+            break;
+        }
+        global_fake_x.input_len += size;
+
+        // BIG-REQUESTS isn't offered, so every request has its length in the header.
+        uint64_t offset = 0;
+        pthread_mutex_lock(&global_fake_x.lock);
+        while (global_fake_x.input_len - offset >= 4) {
+            const uint8_t *request = global_fake_x.input + offset;
+            uint64_t request_size = (uint64_t)((const uint16_t *)request)[1] * 4;
+            if (request_size == 0 || global_fake_x.input_len - offset < request_size) {
+                break;
+            }
+            if (global_fake_x.output_len == 0) {
+                global_fake_x.owed_since = global_fake_x.handled;
+            }
+            fake_x_request(request);
+            offset += request_size;
+            global_fake_x.handled += request_size;
+        }
+        fake_x_answer_wait();
+        pthread_mutex_unlock(&global_fake_x.lock);
+        memmove(global_fake_x.input, global_fake_x.input + offset,
+                global_fake_x.input_len - offset);
+        global_fake_x.input_len -= offset;
+    }
+    return NULL;
+}
+
+// Same signature as xcb_connect(), for global_x11_connect. Serves one connection at a time.
+xcb_connection_t *fake_x_connect(const char *display_name, int *screen_num)
+{
+    int fds[2] = {-1, -1};
+    if (global_fake_x.fd >= 0 || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0) {
+        return xcb_connect_to_fd(-1, NULL);
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, global_fake_x.wait_fds) != 0) {
+        goto ERROR;
+    }
+    global_fake_x.fd = fds[1];
+    if (pthread_create(&global_fake_x.thread, NULL, fake_x_serve, NULL) != 0) {
+        close(global_fake_x.wait_fds[0]);
+        close(global_fake_x.wait_fds[1]);
+        global_fake_x.fd = -1;
+        goto ERROR;
+    }
+    if (screen_num != NULL) {
+        *screen_num = 0;
+    }
+    return xcb_connect_to_fd(fds[0], NULL);
+
+ERROR:
+    close(fds[0]);
+    close(fds[1]);
+    return xcb_connect_to_fd(-1, NULL);
+}
+
+int fake_x_init(uint64_t windows_capacity)
+{
+    global_fake_x.windows =
+        (struct fake_x_window *)calloc(windows_capacity, sizeof(struct fake_x_window));
+    if (global_fake_x.windows == NULL) {
+        return 1;
+    }
+    global_fake_x.windows_capacity = windows_capacity;
+    for (uint32_t i = 0; i < FAKE_X_CRTCS_NUM; ++i) {
+        global_fake_x.crtcs[i].box = (struct box){1920 * i, 0, 1920, 1080};
+    }
+    global_fake_x.crtcs[0].is_active = true;
+    return 0;
+}
+
+xcb_window_t fake_x_create_window(struct box box, bool is_mapped)
+{
+    pthread_mutex_lock(&global_fake_x.lock);
+    xcb_window_t window = XCB_NONE;
+    if (global_fake_x.windows_num < global_fake_x.windows_capacity) {
+        global_fake_x.windows[global_fake_x.windows_num] =
+            (struct fake_x_window){.exists = true, .is_mapped = is_mapped, .box = box};
+        window = FAKE_X_WINDOW_BASE + global_fake_x.windows_num++;
+    }
+    pthread_mutex_unlock(&global_fake_x.lock);
+    return window;
+}
+
+void fake_x_destroy_window(xcb_window_t window)
+{
+    pthread_mutex_lock(&global_fake_x.lock);
+    struct fake_x_window *fake_window = fake_x_get_window(window);
+    if (fake_window != NULL) {
+        fake_window->exists = false;
+    }
+    pthread_mutex_unlock(&global_fake_x.lock);
+}
+
+void fake_x_set_crtc_active(uint32_t idx, bool is_active)
+{
+    pthread_mutex_lock(&global_fake_x.lock);
+    global_fake_x.crtcs[idx].is_active = is_active;
+    pthread_mutex_unlock(&global_fake_x.lock);
+}
+
+// Events follow the replies already owed, tagged with the last request handled. The batch must
+// fit into the socket buffer, since the caller is the one to read it.
+void fake_x_send_events(const xcb_generic_event_t *const events, uint64_t events_num)
+{
+    pthread_mutex_lock(&global_fake_x.lock);
+    for (uint64_t i = 0; i < events_num; ++i) {
+        xcb_generic_event_t event = events[i];
+        event.sequence = global_fake_x.sequence;
+        fake_x_write(&event, 32);
+    }
+    fake_x_flush();
+    pthread_mutex_unlock(&global_fake_x.lock);
+}
+
+// Returns once the server has handled every request sent so far.
+void fake_x_sync(void)
+{
+    pthread_mutex_lock(&global_fake_x.lock);
+    ++global_fake_x.counters.syncs;
+    pthread_mutex_unlock(&global_fake_x.lock);
+    xcb_get_input_focus_cookie_t cookie = xcb_get_input_focus(global_xconnection);
+    fake_x_before_wait();
+    free(xcb_get_input_focus_reply(global_xconnection, cookie, NULL));
+}
+
+struct fake_x_counters fake_x_get_counters(void)
+{
+    pthread_mutex_lock(&global_fake_x.lock);
+    struct fake_x_counters counters = global_fake_x.counters;
+    pthread_mutex_unlock(&global_fake_x.lock);
+    return counters;
+}
+
+// Upper bounds for one operation against the fake X Server. Requests may grow with the clients
+// of the affected monitors, round trips are per batch of events and must not grow at all.
+enum {
+    BENCH_X_SCAN,
+    BENCH_X_CONFIGURE_STORM,
+    BENCH_X_TAG_SWITCH,
+    BENCH_X_ARRANGE,
+    BENCH_X_HOT_PLUG,
+    BENCH_X_MAP,
+    BENCH_X_DESTROY,
+    BENCH_X_END
+};
+
+struct bench_x_budget {
+    const char *name;
+    double requests;
+    double requests_per_client;
+    double round_trips;
+};
+
+static const struct bench_x_budget global_bench_x_budgets[BENCH_X_END] = {
+    [BENCH_X_SCAN] = {"scan", 400, 24, 5},
+    [BENCH_X_CONFIGURE_STORM] = {"configure storm", 1, 0, 0},
+    [BENCH_X_TAG_SWITCH] = {"tag switch", 100, 1.5, 0},
+    [BENCH_X_ARRANGE] = {"arrange", 50, 1.5, 0},
+    [BENCH_X_HOT_PLUG] = {"hot-plug", 80, 0, 2},
+    [BENCH_X_MAP] = {"map", 30, 0, 1},
+    [BENCH_X_DESTROY] = {"destroy", 8, 0.001, 0},
+};
+
+#define BENCH_X_EVENTS_PER_BATCH 256
+
+struct bench_x_sample {
+    uint64_t start_ns;
+    uint32_t round_trips;
+    struct fake_x_counters counters;
+};
+
+static inline struct bench_x_sample bench_x_sample(void)
+{
+    return (struct bench_x_sample){monotonic_now_ns(), global_round_trips, fake_x_get_counters()};
+}
+
+// Runs batches until the replies the window manager didn't wait for are in and handled too.
+void bench_x_settle(void)
+{
+    do {
+        x11_drain_events();
+        fake_x_sync();
+    } while (global_property_fetches_num != 0);
+}
+
+uint64_t bench_x_dispatch(const xcb_generic_event_t *const events, uint64_t events_num)
+{
+    uint64_t batches_num = 0;
+    for (uint64_t i = 0; i < events_num; i += BENCH_X_EVENTS_PER_BATCH) {
+        fake_x_send_events(&events[i], min(BENCH_X_EVENTS_PER_BATCH, events_num - i));
+        bench_x_settle();
+        ++batches_num;
+    }
+    return batches_num;
+}
+
+// Prints one operation and returns 1 if it went over its budget. What the benchmark's own
+// synchronizations cost is taken out.
+int bench_x_report(uint8_t operation, uint64_t clients_num, uint64_t operations_num,
+                   uint64_t batches_num, const struct bench_x_sample *const before)
+{
+    struct bench_x_sample after = bench_x_sample();
+    uint64_t syncs_num = after.counters.syncs - before->counters.syncs;
+    double requests = (double)(after.counters.requests - before->counters.requests - syncs_num) /
+                      operations_num;
+    double round_trips =
+        (double)(after.counters.round_trips - before->counters.round_trips - syncs_num) /
+        batches_num;
+    const struct bench_x_budget *budget = &global_bench_x_budgets[operation];
+    double requests_budget = budget->requests + budget->requests_per_client * clients_num;
+    bool is_over_budget = requests > requests_budget || round_trips > budget->round_trips;
+    printf("fake x %5lu clients %-15s %9.3f ms, %9.1f requests/op, %4.2f round trips/batch "
+           "(%u counted by ewm), %lu errors%s\n",
+           clients_num, budget->name, (double)(after.start_ns - before->start_ns) / 1000000,
+           requests, round_trips, after.round_trips - before->round_trips,
+           after.counters.errors - before->counters.errors,
+           is_over_budget == true ? ", OVER BUDGET" : "");
+    if (is_over_budget == true) {
+        printf("fake x budget: %.1f requests/op, %.2f round trips/batch; requests by opcode:",
+               requests_budget, budget->round_trips);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint64_t requests_num = after.counters.opcodes[i] - before->counters.opcodes[i];
+            if (i == XCB_GET_INPUT_FOCUS) {
+                requests_num -= syncs_num;
+            }
+            if (requests_num != 0) {
+                printf(" %u:%lu", i, requests_num);
+            }
+        }
+        printf("\n");
+    }
+    return is_over_budget == true;
+}
+
+// One window manager against a fresh fake X Server, which starts with clients_num mapped windows.
+int bench_x_run(uint64_t clients_num)
+{
+    if (fake_x_init(2 * clients_num) != 0) {
+        fprintf(stderr, "Out of memory!\n");
+        return 1;
+    }
+    xcb_window_t *windows = (xcb_window_t *)calloc(2 * clients_num, sizeof(xcb_window_t));
+    xcb_generic_event_t *events =
+        (xcb_generic_event_t *)calloc(4 * clients_num, sizeof(xcb_generic_event_t));
+    if (windows == NULL || events == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        return 1;
+    }
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        windows[i] = fake_x_create_window((struct box){i % 40 * 20, i % 30 * 20, 640, 480}, true);
+    }
+    global_x11_connect = fake_x_connect;
+    global_x11_before_wait = fake_x_before_wait;
+    int result = 0;
+
+    struct bench_x_sample before = bench_x_sample();
+    if (x11_init() != 0) {
+        printf("fake x %5lu clients: x11_init failed\n", clients_num);
+        return 1;
+    }
+    bench_x_settle();
+    result |= bench_x_report(BENCH_X_SCAN, clients_num, 1, 1, &before);
+
+    // Every client asks four times for a new size within one batch.
+    for (uint64_t i = 0; i < 4 * clients_num; ++i) {
+        xcb_configure_request_event_t *event = (xcb_configure_request_event_t *)&events[i];
+        *event = (xcb_configure_request_event_t){
+            .response_type = XCB_CONFIGURE_REQUEST,
+            .parent = FAKE_X_ROOT,
+            .window = windows[i / 4],
+            .width = 400 + i % 4 * 10,
+            .height = 300 + i % 4 * 10,
+            .value_mask = XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT};
+    }
+    before = bench_x_sample();
+    uint64_t batches_num = bench_x_dispatch(events, 4 * clients_num);
+    result |= bench_x_report(BENCH_X_CONFIGURE_STORM, clients_num, 4 * clients_num, batches_num,
+                             &before);
+
+    const uint64_t switches_num = 8;
+    before = bench_x_sample();
+    for (uint64_t i = 0; i < switches_num; ++i) {
+        monitor_view(global_focused_monitor, i % 2 == 0 ? MASK_TAG2 : MASK_TAG1);
+        bench_x_settle();
+    }
+    result |= bench_x_report(BENCH_X_TAG_SWITCH, clients_num, switches_num, switches_num, &before);
+
+    before = bench_x_sample();
+    for (uint8_t i = 1; i <= LAYOUT_END; ++i) {
+        monitor_set_layout(global_focused_monitor, i % LAYOUT_END);
+        bench_x_settle();
+    }
+    result |= bench_x_report(BENCH_X_ARRANGE, clients_num, LAYOUT_END, LAYOUT_END, &before);
+
+    // The second output comes and goes, and the clients move along with its monitor.
+    const uint64_t plugs_num = 4;
+    before = bench_x_sample();
+    for (uint64_t i = 0; i < plugs_num; ++i) {
+        fake_x_set_crtc_active(1, i % 2 == 0);
+        xcb_randr_notify_event_t event = {.response_type =
+                                              FAKE_X_RANDR_FIRST_EVENT + XCB_RANDR_NOTIFY,
+                                          .subCode = XCB_RANDR_NOTIFY_CRTC_CHANGE};
+        bench_x_dispatch((const xcb_generic_event_t *)&event, 1);
+    }
+    result |= bench_x_report(BENCH_X_HOT_PLUG, clients_num, plugs_num, plugs_num, &before);
+
+    for (uint64_t i = clients_num; i < 2 * clients_num; ++i) {
+        windows[i] = fake_x_create_window((struct box){0, 0, 640, 480}, false);
+        xcb_map_request_event_t *event = (xcb_map_request_event_t *)&events[i - clients_num];
+        *event = (xcb_map_request_event_t){
+            .response_type = XCB_MAP_REQUEST, .parent = FAKE_X_ROOT, .window = windows[i]};
+    }
+    before = bench_x_sample();
+    batches_num = bench_x_dispatch(events, clients_num);
+    result |= bench_x_report(BENCH_X_MAP, clients_num, clients_num, batches_num, &before);
+
+    for (uint64_t i = 0; i < 2 * clients_num; ++i) {
+        xcb_destroy_notify_event_t *event = (xcb_destroy_notify_event_t *)&events[i];
+        *event = (xcb_destroy_notify_event_t){
+            .response_type = XCB_DESTROY_NOTIFY, .event = FAKE_X_ROOT, .window = windows[i]};
+    }
+    // Windows die batch by batch, the others still take requests meanwhile.
+    before = bench_x_sample();
+    batches_num = 0;
+    for (uint64_t i = 0; i < 2 * clients_num; i += BENCH_X_EVENTS_PER_BATCH) {
+        uint64_t events_num = min(BENCH_X_EVENTS_PER_BATCH, 2 * clients_num - i);
+        for (uint64_t j = i; j < i + events_num; ++j) {
+            fake_x_destroy_window(windows[j]);
+        }
+        batches_num += bench_x_dispatch(&events[i], events_num);
+    }
+    result |= bench_x_report(BENCH_X_DESTROY, clients_num, 2 * clients_num, batches_num, &before);
+
+    free(events);
+    free(windows);
+    return result;
+}
+
+// Each size runs in a child of its own, which keeps the window manager's globals apart. Returns 1
+// if any operation went over its budget.
+int bench_fake_x(void)
+{
+    const uint64_t clients_nums[] = {10, 100, 1000, 10000};
+    int result = 0;
+    for (uint64_t i = 0; i < sizeof(clients_nums) / sizeof(clients_nums[0]); ++i) {
+        fflush(stdout);
+        pid_t pid = fork();
+        if (pid < 0) {
+            fprintf(stderr, "Can't fork benchmark!\n");
+            return 1;
+        }
+        if (pid == 0) {
+            exit(bench_x_run(clients_nums[i]));
+        }
+        int status = 0;
+        if (waitpid(pid, &status, 0) != pid || WIFEXITED(status) == false ||
+            WEXITSTATUS(status) != 0) {
+            result = 1;
+        }
+    }
+    return result;
+}
+
+// Runs only on the spare display named by EWM_BENCH_DISPLAY, e.g. an Xvfb without a window
+// manager, never on the session's own. The benchmark becomes the window manager of that display,
+// so it must run last.
+void bench_startup_scan(void)
+{
+    const uint64_t windows_num = 500;
+    const char *display = getenv("EWM_BENCH_DISPLAY");
+    if (display == NULL || display[0] == '\0') {
+        printf("startup scan %lu windows: skipped, EWM_BENCH_DISPLAY not set\n", windows_num);
+        return;
+    }
+    // x11_init connects through $DISPLAY.
+    setenv("DISPLAY", display, 1);
+    xcb_connection_t *connection = xcb_connect(display, NULL);
+    if (xcb_connection_has_error(connection)) {
+        xcb_disconnect(connection);
+        printf("startup scan %lu windows: skipped, can't connect to X Server\n", windows_num);
+        return;
+    }
+    xcb_screen_t *screen = xcb_setup_roots_iterator(xcb_get_setup(connection)).data;
+    for (uint64_t i = 0; i < windows_num; ++i) {
+        xcb_window_t window = xcb_generate_id(connection);
+        xcb_create_window(connection, XCB_COPY_FROM_PARENT, window, screen->root, (i % 20) * 40,
+                          (i / 20) * 30, 200, 150, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                          screen->root_visual, 0, NULL);
+        xcb_map_window(connection, window);
+    }
+    free(xcb_get_input_focus_reply(connection, xcb_get_input_focus(connection), NULL));
+
+    uint64_t start = monotonic_now_ns();
+    int result = x11_init();
+    double init_ms = (double)(monotonic_now_ns() - start) / 1000000;
+    if (result != 0) {
+        printf("startup scan %lu windows: x11_init failed\n", windows_num);
+    } else {
+        printf("startup scan %lu windows: x11_init %.2f ms, %u round trips, %u clients adopted\n",
+               windows_num, init_ms, global_round_trips, global_client_table.size);
+    }
+
+    xcb_disconnect(global_xconnection);
+    xcb_disconnect(connection);
+}
+
+int main(int argc, char *argv[])
+{
+    // Benchmarks that don't need an X server write their requests into an errored connection, on
+    // which XCB drops them.
+    global_xconnection = xcb_connect_to_fd(-1, NULL);
+    global_ewmh_connection = (xcb_ewmh_connection_t *)calloc(1, sizeof(xcb_ewmh_connection_t));
+    if (global_ewmh_connection == NULL) {
+        fprintf(stderr, "Out of memory!\n");
+        return 1;
+    }
+    global_ewmh_connection->connection = global_xconnection;
+    xcb_screen_t screen = {.root_depth = 24};
+    global_screen = &screen;
+    bench_client_lookup();
+    bench_arrange_damage();
+    bench_arrange_store();
+    bench_configure_storm();
+    bench_property_storm();
+    bench_client_list();
+    bench_tag_switch();
+    bench_ipc_batch();
+    bench_motion();
+    bench_drag();
+    bench_sync_resize();
+    bench_session_restart();
+    bench_error_routing();
+    bench_size_hints();
+    bench_metadata_worker();
+    bench_bar();
+    bench_focus();
+    bench_layouts();
+    int result = bench_fake_x();
+    bench_startup_scan();
+    return result;
+}
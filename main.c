@@ -1,13 +1,35 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ipc.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
 #include <xcb/randr.h>
+#include <xcb/shm.h>
+#include <xcb/sync.h>
 #include <xcb/xcb.h>
 #include <xcb/xcb_event.h>
 #include <xcb/xcb_ewmh.h>
 #include <xcb/xcb_icccm.h>
+#include <xcb/xcbext.h>
 
 #define MASK_TAG0 (0)
 #define MASK_TAG1 (1)
@@ -19,6 +41,13 @@
 #define MASK_TAG7 (64)
 #define MASK_TAG8 (128)
 #define MASK_TAG9 (256)
+#define TAGS_NUM (9)
+#define TAGS_MASK ((1 << TAGS_NUM) - 1)
+
+// Bounds of the main area, for the IPC commands and the session alike.
+#define MAIN_AREA_FRACTION_MIN (0.05f)
+#define MAIN_AREA_FRACTION_MAX (0.95f)
+#define MAIN_AREA_WIN_NUM_MAX (16)
 
 #define container_of(Pointer, ContainerType, MemberName)                                        \
     ({                                                                                          \
@@ -48,36 +77,98 @@ static inline bool box_compare(const struct box a, const struct box b)
     return a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height;
 }
 
-struct client {
-    char name[256];
-    uint8_t tags;
+static inline bool box_contains(const struct box box, int16_t x, int16_t y)
+{
+    return x >= box.x && x < box.x + box.width && y >= box.y && y < box.y + box.height;
+}
 
-    float min_aspect_ratio;
-    float max_aspect_ratio;
+static inline bool box_intersects(const struct box a, const struct box b)
+{
+    return a.x < b.x + b.width && b.x < a.x + a.width && a.y < b.y + b.height &&
+           b.y < a.y + a.height;
+}
 
-    int32_t max_width;
-    int32_t max_height;
-    int32_t min_width;
-    int32_t min_height;
+struct box_index_entry {
+    struct box box;
+    void *item;
+};
+
+// Point location over boxes that don't overlap. The x edges of all boxes cut the plane into
+// vertical slabs, and each slab keeps the boxes spanning it sorted by y, so a lookup is two binary
+// searches. Slab i covers [xs[i], xs[i + 1]) and its boxes are entries from slab_offsets[i] up to
+// slab_offsets[i + 1]. Building it checks every box against every slab, which is fine for the
+// handful of monitors it indexes. Clients aren't hit tested, the X server already reports the
+// window under the pointer with EnterNotify.
+struct box_index {
+    int32_t *xs;
+    uint32_t *slab_offsets;
+    struct box_index_entry *entries;
+    uint32_t xs_num;
+    uint32_t xs_capacity;
+    uint32_t entries_num;
+    uint32_t entries_capacity;
+};
 
+// WM_NORMAL_HINTS reduced once per property change to what the solver needs. Every field is 0 when
+// its hint is unset, so a zeroed client has no constraints. base and min stand in for each other as
+// ICCCM asks. Aspect bounds are width over height of the size without aspect_base, in 16.16 fixed
+// point. Only a real base size counts there, min never stands in for it.
+struct size_constraints {
     int32_t base_width;
     int32_t base_height;
+    int32_t aspect_base_width;
+    int32_t aspect_base_height;
+    int32_t min_width;
+    int32_t min_height;
+    int32_t max_width;
+    int32_t max_height;
     int32_t width_inc;
     int32_t height_inc;
+    float inverse_width_inc;
+    float inverse_height_inc;
+    int64_t min_aspect;
+    int64_t inverse_min_aspect;
+    int64_t max_aspect;
+};
 
+// Fields read by every arrange and lookup come first. Cold data such as the name lives next to the
+// slab slot instead, see client_name().
+struct client {
+    xcb_window_t window;
+    uint32_t handle;
     struct box box;
     uint16_t border_width;
+    uint16_t tags;
 
     bool is_fixed;
     bool is_floating;
     bool is_fullscreen;
     bool is_urgent;
+    bool is_hidden;
     bool never_focus;
+    bool supports_take_focus;
+    uint16_t dirty_properties;
+    uint16_t fetching_properties;
 
     struct monitor *monitor;
-    xcb_window_t window;
-
     struct list_node list_node;
+    struct list_node focus_node;
+
+    struct size_constraints size_constraints;
+    // The state to go back to when the client leaves fullscreen.
+    struct box unfullscreen_box;
+    bool was_floating;
+
+    // _NET_WM_SYNC_REQUEST state, see client_sync_request(). held_box is the latest geometry asked
+    // for while waiting and goes out once the client has repainted.
+    xcb_sync_counter_t sync_counter;
+    xcb_sync_alarm_t sync_alarm;
+    uint64_t sync_value;
+    uint64_t sync_deadline_ns;
+    bool supports_sync_request;
+    bool is_waiting_sync;
+    bool has_held_box;
+    struct box held_box;
 };
 
 static inline int16_t client_width(const struct client *const client)
@@ -90,14 +181,63 @@ static inline int16_t client_height(const struct client *const client)
     return client->box.height + 2 * client->border_width;
 }
 
+// A layout only computes geometry. It fills boxes[i] with the outer box of the i-th tiled client
+// and monitor_arrange() decides which of those actually need to reach the X server.
 struct layout {
     char name[32];
-    void (*arrange)(const struct monitor *const);
+    void (*arrange)(const struct monitor *const, uint64_t clients_num, struct box *const boxes);
+};
+
+enum {
+    LAYOUT_TILE,
+    LAYOUT_MONOCLE,
+    LAYOUT_GRID,
+    LAYOUT_CENTERED_MASTER,
+    LAYOUT_SPIRAL,
+    LAYOUT_DWINDLE,
+    LAYOUT_VSTACK,
+    LAYOUT_HSTACK,
+    LAYOUT_END
+};
+
+#define BAR_TEXT_SIZE (256)
+
+// Parts of the bar from left to right, except that the title takes what the others leave.
+enum {
+    BAR_SEGMENT_TAGS,
+    BAR_SEGMENT_LAYOUT,
+    BAR_SEGMENT_TITLE,
+    BAR_SEGMENT_STATUS,
+    BAR_SEGMENT_CLOCK,
+    BAR_SEGMENT_END
+};
+
+// What a segment showed and where when it was last drawn. text is Latin-1 for the core font and
+// state packs whatever else the segment shows.
+struct bar_segment {
+    int16_t x;
+    uint16_t width;
+    uint64_t state;
+    uint8_t text_len;
+    char text[BAR_TEXT_SIZE];
+};
+
+// The bar is drawn into pixmap one segment at a time and copied to window, so Expose never redraws.
+// Icons go through the shared memory at shm_pixels, which isn't written again until the server has
+// reported the previous put complete.
+struct bar {
+    xcb_window_t window;
+    xcb_pixmap_t pixmap;
+    struct box box;
+    xcb_shm_seg_t shm_seg;
+    uint32_t *shm_pixels;
+    bool is_shm_busy;
+    struct bar_segment segments[BAR_SEGMENT_END];
 };
 
 struct monitor {
     xcb_randr_output_t output;
-    uint8_t enabled_tags;
+    uint16_t enabled_tags;
 
     float main_area_fraction;
     uint8_t main_area_win_num;
@@ -113,754 +253,5579 @@ struct monitor {
     uint64_t clients_num;
     list_head_t clients;
     struct client *focused_client;
+    // Every client of the monitor, most recently focused first, so focus can fall back in O(1).
+    list_head_t focus_stack;
 
-    struct layout layouts[1];
+    struct layout layouts[LAYOUT_END];
     uint8_t current_layout_idx;
+    uint8_t tag_layout_idxs[TAGS_NUM];
+    bool needs_arrange;
+    bool is_stale;
+    // Frame period of the CRTC mode, used to pace interactive moves and resizes.
+    uint64_t refresh_interval_ns;
+
+    struct bar bar;
 
     struct list_node list_node;
 };
 
 static xcb_connection_t *global_xconnection = NULL;
+// Opens every connection to the X Server. The benchmarks point it at an in-process fake server.
+static xcb_connection_t *(*global_x11_connect)(const char *, int *) = xcb_connect;
+// Told right before the main connection blocks on the X Server, which lets the benchmarks' fake
+// server hold its replies back until they are really waited for.
+static void (*global_x11_before_wait)(void) = NULL;
 
 enum { WM_PROTOCOLS, WM_DELETE_WINDOW, WM_STATE, WM_TAKE_FOCUS, WM_END };
 
 static xcb_ewmh_connection_t *global_ewmh_connection = NULL;
 static xcb_atom_t global_wm_atoms[WM_END];
+static const char *const global_wm_atom_names[WM_END] = {"WM_PROTOCOLS", "WM_DELETE_WINDOW",
+                                                         "WM_STATE", "WM_TAKE_FOCUS"};
+
+// Counted by x11_count_round_trip() at every wait on the X Server. Reported by the --startup-time
+// mode.
+static uint32_t global_round_trips = 0;
+static uint64_t global_round_trips_written = 0;
 
 static xcb_screen_t *global_screen = NULL;
 static uint16_t global_screen_width = 0;
 static uint16_t global_screen_height = 0;
 
 static list_head_t global_monitors = NULL;
+static uint8_t global_randr_first_event = 0;
+// Zero when the X server has no SYNC extension, then clients are resized without waiting.
+static uint8_t global_sync_first_event = 0;
+// Without MIT-SHM, or once attaching a segment failed, icons are sent over the socket.
+static bool global_has_shm = false;
+static uint8_t global_shm_first_event = 0;
+static bool global_monitors_outdated = false;
 static struct monitor *global_focused_monitor = NULL;
+// Indexed by CRTC box, so that the pointer over a gap still belongs to its monitor.
+static struct box_index global_monitor_index = {0};
+static bool global_monitor_index_outdated = true;
+static struct box_index_entry *global_hit_index_items = NULL;
+static uint64_t global_hit_index_items_capacity = 0;
 
 const static uint32_t global_client_border_width = 8;
-const static uint32_t global_client_unfocus_pixel = 0x000000;
-const static uint32_t global_client_focus_pixel = 0x000000;
+const static uint32_t global_client_unfocus_pixel = 0x444444;
+const static uint32_t global_client_focus_pixel = 0x005577;
+
+// Core font of the bar, every X server has "fixed".
+const static char global_bar_font_name[] = "fixed";
+const static char global_bar_clock_format[] = "%a %d %b %H:%M";
+const static uint16_t global_bar_padding = 4;
+const static uint32_t global_bar_background_pixel = 0x222222;
+const static uint32_t global_bar_foreground_pixel = 0xbbbbbb;
+const static uint32_t global_bar_selected_background_pixel = 0x005577;
+const static uint32_t global_bar_selected_foreground_pixel = 0xeeeeee;
+const static uint32_t global_bar_urgent_background_pixel = 0xbb2222;
+
+// Filled in by bar_init() from the font metrics. Without a font the height stays 0 and there is no
+// bar.
+static uint16_t global_bar_height = 0;
+static int16_t global_bar_baseline = 0;
+static uint16_t global_bar_tag_width = 0;
+static uint8_t global_bar_glyph_widths[256] = {0};
+static xcb_font_t global_bar_font = XCB_NONE;
+static xcb_gcontext_t global_bar_gc = XCB_NONE;
+// Icons are only drawn when the root depth is stored as 32-bit pixels in our byte order.
+static bool global_bar_has_icons = false;
+static char global_bar_status[BAR_TEXT_SIZE] = "";
+static char global_bar_clock[64] = "";
 
 const static bool should_respect_size_hints = true;
+// How long a client gets to repaint after a sync request before it is resized regardless.
+const static uint64_t global_sync_timeout_ns = 100000000;
+const static uint16_t global_drag_modifier = XCB_MOD_MASK_4;
+// Distance in pixels at which a moved window sticks to the edges of its monitor.
+const static int16_t global_snap_distance = 16;
+// Used when the mode of a CRTC doesn't tell its refresh rate.
+const static uint64_t global_default_refresh_interval_ns = 16666667;
+
+struct configure_counters {
+    uint64_t sent;
+    uint64_t skipped;
+    uint64_t requests_received;
+    uint64_t requests_applied;
+    uint64_t held;
+};
+
+static struct configure_counters global_configure_counters = {0};
+
+// Errors of unchecked requests arrive as events. Requests whose errors need handling register their
+// sequence here and handle_error() finds the route by the sequence of the error, so nothing ever
+// waits for a check. Only the latest routes are kept, a burst of more requests in flight loses the
+// older ones. BadWindow doesn't need its route, the error names the window itself.
+#define ERROR_ROUTES_NUM (1024)
+
+enum { ERROR_ROUTE_NONE, ERROR_ROUTE_CLIENT, ERROR_ROUTE_SYNC_ALARM, ERROR_ROUTE_BAR_SHM };
+
+struct error_route {
+    uint32_t sequence;
+    uint8_t type;
+    xcb_window_t window;
+};
+
+struct error_counters {
+    uint64_t received;
+    uint64_t routed;
+    uint64_t clients_dropped;
+    uint64_t codes[256];
+};
+
+static struct error_route global_error_routes[ERROR_ROUTES_NUM] = {0};
+static uint64_t global_error_routes_head = 0;
+static struct error_counters global_error_counters = {0};
+
+static inline void error_route(unsigned int sequence, uint8_t type, xcb_window_t window)
+{
+    struct error_route *route =
+        &global_error_routes[global_error_routes_head++ & (ERROR_ROUTES_NUM - 1)];
+    route->sequence = sequence;
+    route->type = type;
+    route->window = window;
+}
+
+struct motion_counters {
+    uint64_t received;
+    uint64_t handled;
+};
+
+static struct motion_counters global_motion_counters = {0};
+// Only the latest MotionNotify of a batch is handled, the ones before it are already stale.
+static xcb_motion_notify_event_t global_pending_motion;
+static bool global_has_pending_motion = false;
+
+enum { DRAG_NONE, DRAG_MOVE, DRAG_RESIZE };
+
+// A pointer drag only updates target, which is committed at most once per refresh interval of the
+// monitor, paced by the event loop timer. client is cleared if the client goes away mid-drag.
+struct drag {
+    uint8_t mode;
+    bool has_target;
+    bool is_timer_armed;
+    struct client *client;
+    int16_t pointer_x;
+    int16_t pointer_y;
+    struct box box;
+    struct box target;
+};
 
+static struct drag global_drag = {0};
+
+// Scratch space for monitor_arrange(), grown on demand and reused by every arrange.
+static struct client **global_arrange_clients = NULL;
+static struct box *global_arrange_boxes = NULL;
+static struct size_constraints *global_arrange_constraints = NULL;
+static uint64_t global_arrange_capacity = 0;
+// Set when the pending arrange hides or shows clients because tags changed.
+static bool global_tags_changed = false;
+
+// IPC connections are registered with EVENT_SOURCE_END plus their index in global_ipc_connections.
+enum {
+    EVENT_SOURCE_X11,
+    EVENT_SOURCE_SIGNAL,
+    EVENT_SOURCE_TIMER,
+    EVENT_SOURCE_IPC,
+    EVENT_SOURCE_METADATA,
+    EVENT_SOURCE_CLOCK,
+    EVENT_SOURCE_END
+};
+
+static int global_epoll_fd = -1;
+static int global_signal_fd = -1;
+static int global_timer_fd = -1;
+static int global_clock_timer_fd = -1;
+static bool global_running = true;
+// Set by the restart command, main() then saves the session and executes ewm again.
+static bool global_should_restart = false;
+
+#define IPC_CONNECTIONS_MAX (16)
+#define IPC_INPUT_SIZE (4096)
+#define IPC_OUTPUT_SIZE (65536)
+
+// Output is only buffered here and sent by ipc_flush() once per event loop iteration. A listener
+// that lets IPC_OUTPUT_SIZE bytes pile up is disconnected rather than stalling the window manager.
+struct ipc_connection {
+    int fd;
+    bool is_subscribed;
+    bool is_waiting_writable;
+    uint32_t input_len;
+    uint32_t output_len;
+    char input[IPC_INPUT_SIZE];
+    char output[IPC_OUTPUT_SIZE];
+};
+
+static int global_ipc_fd = -1;
+static struct sockaddr_un global_ipc_address = {0};
+static struct ipc_connection global_ipc_connections[IPC_CONNECTIONS_MAX] = {
+    [0 ... IPC_CONNECTIONS_MAX - 1] = {.fd = -1}};
+
+// The head's prev points to the tail and the tail's next is NULL, so lists can be walked forward
+// until NULL and the last node is reachable in O(1).
 void list_append(list_head_t *head, struct list_node *const node)
 {
-    if (head == NULL) {
+    node->next = NULL;
+    if (*head == NULL) {
         *head = node;
-        node->prev = *head;
-        node->next = *head;
+        node->prev = node;
         return;
     }
-    struct list_node *cursor = NULL;
-    while (cursor->next != NULL) {
-        cursor = cursor->next;
-    }
-    node->prev = cursor;
-    cursor->next = node;
-    node->next = *head;
-    return;
+    struct list_node *tail = (*head)->prev;
+    tail->next = node;
+    node->prev = tail;
+    (*head)->prev = node;
 }
 
 void list_remove(list_head_t *head, struct list_node *const node)
 {
-    node->prev->next = node->next;
-    node->next->prev = node->prev;
+    if (node == *head) {
+        *head = node->next;
+        if (*head != NULL) {
+            (*head)->prev = node->prev;
+        }
+    } else {
+        node->prev->next = node->next;
+        if (node->next != NULL) {
+            node->next->prev = node->prev;
+        } else {
+            (*head)->prev = node->prev;
+        }
+    }
+    node->prev = NULL;
+    node->next = NULL;
 }
 
-int client_set_size_hints(struct client *const client)
+void list_prepend(list_head_t *head, struct list_node *const node)
 {
-    xcb_size_hints_t size_hints;
-    if (xcb_icccm_get_wm_normal_hints_reply(
-            global_xconnection, xcb_icccm_get_wm_normal_hints(global_xconnection, client->window),
-            &size_hints, NULL) != 0) {
-        return 1;
-    }
-    if (size_hints.flags & XCB_ICCCM_SIZE_HINT_BASE_SIZE) {
-        client->base_width = size_hints.base_width;
-        client->base_height = size_hints.base_height;
+    if (*head == NULL) {
+        list_append(head, node);
+        return;
     }
-    if (size_hints.flags & XCB_ICCCM_SIZE_HINT_P_MIN_SIZE) {
-        client->min_width = size_hints.min_width;
-        client->min_height = size_hints.min_height;
+    node->prev = (*head)->prev;
+    node->next = *head;
+    (*head)->prev = node;
+    *head = node;
+}
+
+static int compare_int32(const void *a, const void *b)
+{
+    int32_t left = *(const int32_t *)a;
+    int32_t right = *(const int32_t *)b;
+    return (left > right) - (left < right);
+}
+
+static int compare_box_index_entries_by_y(const void *a, const void *b)
+{
+    return ((const struct box_index_entry *)a)->box.y - ((const struct box_index_entry *)b)->box.y;
+}
+
+int box_index_reserve_entries(struct box_index *const index, uint32_t entries_num)
+{
+    if (entries_num <= index->entries_capacity) {
+        return 0;
     }
-    if (size_hints.flags & XCB_ICCCM_SIZE_HINT_P_ASPECT) {
-        client->min_aspect_ratio = (float)size_hints.min_aspect_num / size_hints.min_aspect_den;
-        client->max_aspect_ratio = (float)size_hints.max_aspect_num / size_hints.max_aspect_den;
+    uint32_t new_capacity = max(entries_num, index->entries_capacity * 2);
+    struct box_index_entry *new_entries = (struct box_index_entry *)realloc(
+        index->entries, new_capacity * sizeof(struct box_index_entry));
+    if (new_entries == NULL) {
+        return 1;
     }
+    index->entries = new_entries;
+    index->entries_capacity = new_capacity;
     return 0;
 }
 
-struct box get_box_with_size_hints(const struct client *const client, const struct box box)
+int box_index_build(struct box_index *const index, const struct box_index_entry *const items,
+                    uint32_t items_num)
 {
-    struct box new_box = box;
-    struct monitor *monitor = client->monitor;
-    if (new_box.x >= monitor->box.x + monitor->box.width) {
-        new_box.x = monitor->box.x + monitor->box.width - client->box.width;
-    }
-    if (new_box.y >= monitor->box.y + monitor->box.height) {
-        new_box.y = monitor->box.y + monitor->box.height - client->box.height;
-    }
-    if (new_box.x + new_box.width < monitor->box.x) {
-        new_box.x = monitor->box.x;
-    }
-    if (new_box.y + new_box.height < monitor->box.y) {
-        new_box.y = monitor->box.y;
-    }
-    if (should_respect_size_hints == false && client->is_floating == false) {
-        return new_box;
-    }
-    if (client->min_aspect_ratio <= 0 || client->max_aspect_ratio <= 0) {
-        goto IGNORE_ASPECT_RATIO;
-    }
-    // Window managers that honor aspect ratios should take into account the base size in
-    // determining the preferred window size. If a base size is provided along with the aspect ratio
-    // fields, the base size should be subtracted from the window size prior to checking that the
-    // aspect ratio falls in range. If a base size is not provided, nothing should be subtracted
-    // from the window size. (The minimum size is not to be used in place of the base size for this
-    // purpose.)
-    if (client->base_width > 0 && client->base_height > 0) {
-        new_box.width -= client->base_width;
-        new_box.height -= client->base_height;
-    }
-    if ((float)new_box.width / new_box.height > client->max_aspect_ratio) {
-        new_box.height = new_box.width / client->max_aspect_ratio;
+    index->xs_num = 0;
+    index->entries_num = 0;
+    if (2 * items_num > index->xs_capacity) {
+        uint32_t new_capacity = max(2 * items_num, index->xs_capacity * 2);
+        int32_t *new_xs = (int32_t *)realloc(index->xs, new_capacity * sizeof(int32_t));
+        if (new_xs == NULL) {
+            return 1;
+        }
+        index->xs = new_xs;
+        uint32_t *new_slab_offsets =
+            (uint32_t *)realloc(index->slab_offsets, new_capacity * sizeof(uint32_t));
+        if (new_slab_offsets == NULL) {
+            return 1;
+        }
+        index->slab_offsets = new_slab_offsets;
+        index->xs_capacity = new_capacity;
     }
-    if ((float)new_box.width / new_box.height < client->min_aspect_ratio) {
-        new_box.height = new_box.width / client->min_aspect_ratio;
+    if (items_num == 0) {
+        return 0;
     }
-IGNORE_ASPECT_RATIO:
-    if (client->base_width <= 0 && client->base_height <= 0) {
-        new_box.width -= client->base_width;
-        new_box.height -= client->base_height;
+
+    uint32_t xs_num = 0;
+    for (uint32_t i = 0; i < items_num; ++i) {
+        index->xs[xs_num++] = items[i].box.x;
+        index->xs[xs_num++] = items[i].box.x + items[i].box.width;
     }
-    if (client->width_inc != 0) {
-        new_box.width -= new_box.width % client->width_inc;
+    qsort(index->xs, xs_num, sizeof(int32_t), compare_int32);
+    index->xs_num = 1;
+    for (uint32_t i = 1; i < xs_num; ++i) {
+        if (index->xs[i] != index->xs[index->xs_num - 1]) {
+            index->xs[index->xs_num++] = index->xs[i];
+        }
     }
-    if (client->height_inc != 0) {
-        new_box.height -= new_box.height % client->height_inc;
+
+    for (uint32_t slab = 0; slab + 1 < index->xs_num; ++slab) {
+        index->slab_offsets[slab] = index->entries_num;
+        for (uint32_t i = 0; i < items_num; ++i) {
+            const struct box box = items[i].box;
+            if (box.x > index->xs[slab] || box.x + box.width < index->xs[slab + 1]) {
+                continue;
+            }
+            if (box_index_reserve_entries(index, index->entries_num + 1) != 0) {
+                index->xs_num = 0;
+                return 1;
+            }
+            index->entries[index->entries_num++] = items[i];
+        }
+        qsort(&index->entries[index->slab_offsets[slab]],
+              index->entries_num - index->slab_offsets[slab], sizeof(struct box_index_entry),
+              compare_box_index_entries_by_y);
     }
-    new_box.width = max(new_box.width + client->base_width, client->min_width);
-    new_box.height = max(new_box.height + client->base_height, client->min_height);
-    return new_box;
+    index->slab_offsets[index->xs_num - 1] = index->entries_num;
+    return 0;
 }
 
-struct client *client_create(struct monitor *monitor, xcb_window_t window, int16_t x, int16_t y,
-                             uint16_t width, uint16_t height, int16_t border_width, uint8_t tags)
+void *box_index_find(const struct box_index *const index, int16_t x, int16_t y)
 {
-    struct client *new_client = (struct client *)calloc(1, sizeof(struct client));
-    if (new_client == NULL) {
+    if (index->xs_num < 2 || x < index->xs[0] || x >= index->xs[index->xs_num - 1]) {
         return NULL;
     }
-    new_client->monitor = monitor;
-    new_client->window = window;
-    if (client_set_size_hints(new_client) != 0) {
-        free(new_client);
+    // The last slab starting at or before x.
+    uint32_t low = 0;
+    uint32_t high = index->xs_num - 1;
+    while (high - low > 1) {
+        uint32_t middle = (low + high) / 2;
+        if (index->xs[middle] <= x) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    // The last box in the slab starting at or above y.
+    uint32_t first = index->slab_offsets[low];
+    uint32_t end = index->slab_offsets[low + 1];
+    while (first < end) {
+        uint32_t middle = (first + end) / 2;
+        if (index->entries[middle].box.y <= y) {
+            first = middle + 1;
+        } else {
+            end = middle;
+        }
+    }
+    if (first == index->slab_offsets[low]) {
         return NULL;
     }
-    struct box box = {x, y, width, height};
-    new_client->box = box;
-    new_client->border_width = border_width;
-    new_client->tags = tags;
-    return new_client;
+    const struct box_index_entry *entry = &index->entries[first - 1];
+    return y < entry->box.y + entry->box.height ? entry->item : NULL;
 }
 
-void client_configure(const struct client *const client)
+void box_index_free(struct box_index *const index)
 {
-    xcb_configure_notify_event_t notify_event;
+    free(index->xs);
+    free(index->slab_offsets);
+    free(index->entries);
+    memset(index, 0, sizeof(struct box_index));
+}
 
-    notify_event.response_type = XCB_CONFIGURE_NOTIFY;
-    notify_event.event = client->window;
-    notify_event.window = client->window;
-    notify_event.above_sibling = XCB_NONE;
-    notify_event.x = client->box.x;
-    notify_event.y = client->box.y;
-    notify_event.width = client->box.width;
-    notify_event.height = client->box.height;
-    notify_event.border_width = client->border_width;
-    notify_event.override_redirect = false;
+static uint64_t monotonic_now_ns(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+}
 
-    xcb_send_event(global_xconnection, false, client->window, XCB_EVENT_MASK_STRUCTURE_NOTIFY,
-                   (char *)&notify_event);
+// Timer and event fds transfer their 8-byte counter whole or not at all. Returns 0 once it is read.
+static int counter_fd_read(int fd, uint64_t *const value)
+{
+    ssize_t size = 0;
+    do {
+        size = read(fd, value, sizeof(*value));
+    } while (size < 0 && errno == EINTR);
+    return size != sizeof(*value);
 }
 
-void client_move_resize(struct client *client, int16_t x, int16_t y, uint16_t width,
-                        uint16_t height)
+static int counter_fd_add(int fd, uint64_t value)
 {
-    struct box box = {x, y, width, height};
-    struct box new_box = get_box_with_size_hints(client, box);
-    if (box_compare(new_box, box) == true) {
-        return;
-    }
-    uint32_t values[] = {new_box.x, new_box.y, new_box.width, new_box.height};
-    xcb_configure_window(global_xconnection, client->window,
-                         XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
-                             XCB_CONFIG_WINDOW_HEIGHT,
-                         values);
+    ssize_t size = 0;
+    do {
+        size = write(fd, &value, sizeof(value));
+    } while (size < 0 && errno == EINTR);
+    return size != sizeof(value);
 }
 
-void monitor_tile(const struct monitor *const monitor)
+// Per-user files live in $XDG_RUNTIME_DIR, which only its owner can enter. /tmp is the fallback,
+// where anyone may have put something at the path first.
+static const char *runtime_dir(void)
 {
-    uint16_t main_area_width = monitor->clients_num <= monitor->main_area_win_num
-                                   ? monitor->box.width
-                                   : monitor->box.width * monitor->main_area_fraction;
-    uint16_t main_win_height = monitor->box.height / monitor->main_area_win_num;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    return dir != NULL && dir[0] == '/' ? dir : "/tmp";
+}
 
-    uint64_t clients_idx = 0;
-    struct list_node *clients_cursor = monitor->clients;
-    while (clients_cursor != NULL && clients_idx < monitor->main_area_win_num) {
-        struct client *client = container_of(clients_cursor, struct client, list_node);
-        client_move_resize(client, monitor->box.x, monitor->box.y + main_win_height * clients_idx,
-                           main_area_width, main_win_height);
-        clients_cursor = clients_cursor->next;
-        ++clients_idx;
-    }
+// Instrumentation built with -DEWM_TRACE: per-event latency histograms and a ring of timestamped
+// spans, written as Chrome/Perfetto trace JSON on SIGUSR1 or the IPC trace command. Without it the
+// TRACE_* macros expand to nothing.
+#ifdef EWM_TRACE
+#define TRACE_SPANS_NUM (1 << 14)
+#define TRACE_BUCKETS_NUM (32)
+#define TRACE_EVENT_TYPES_NUM (128)
 
-    uint64_t clients_left_num = monitor->clients_num - clients_idx;
-    clients_idx = 0;
-    uint16_t sub_area_width = monitor->box.width - main_area_width;
-    uint16_t sub_win_height = monitor->box.height / clients_left_num;
-    while (clients_cursor != NULL) {
-        struct client *client = container_of(clients_cursor, struct client, list_node);
-        client_move_resize(client, monitor->box.x + main_area_width,
-                           monitor->box.y + sub_win_height * clients_idx, sub_area_width,
-                           sub_win_height);
-        clients_cursor = clients_cursor->next;
-    }
+struct trace_span {
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+};
+
+// Bucket i counts durations in [2^i, 2^(i+1)) nanoseconds, the last one everything above.
+struct trace_histogram {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[TRACE_BUCKETS_NUM];
+};
+
+struct trace_scope {
+    const char *name;
+    uint64_t start_ns;
+};
+
+static const char *const global_trace_event_names[TRACE_EVENT_TYPES_NUM] = {
+    [0] = "Error",
+    [XCB_KEY_PRESS] = "KeyPress",
+    [XCB_KEY_RELEASE] = "KeyRelease",
+    [XCB_BUTTON_PRESS] = "ButtonPress",
+    [XCB_BUTTON_RELEASE] = "ButtonRelease",
+    [XCB_MOTION_NOTIFY] = "MotionNotify",
+    [XCB_ENTER_NOTIFY] = "EnterNotify",
+    [XCB_LEAVE_NOTIFY] = "LeaveNotify",
+    [XCB_FOCUS_IN] = "FocusIn",
+    [XCB_FOCUS_OUT] = "FocusOut",
+    [XCB_EXPOSE] = "Expose",
+    [XCB_CREATE_NOTIFY] = "CreateNotify",
+    [XCB_DESTROY_NOTIFY] = "DestroyNotify",
+    [XCB_UNMAP_NOTIFY] = "UnmapNotify",
+    [XCB_MAP_NOTIFY] = "MapNotify",
+    [XCB_MAP_REQUEST] = "MapRequest",
+    [XCB_REPARENT_NOTIFY] = "ReparentNotify",
+    [XCB_CONFIGURE_NOTIFY] = "ConfigureNotify",
+    [XCB_CONFIGURE_REQUEST] = "ConfigureRequest",
+    [XCB_PROPERTY_NOTIFY] = "PropertyNotify",
+    [XCB_CLIENT_MESSAGE] = "ClientMessage",
+    [XCB_MAPPING_NOTIFY] = "MappingNotify",
+};
+
+// Writers claim a slot with an atomic increment and never wait, the oldest spans are overwritten.
+static struct trace_span global_trace_spans[TRACE_SPANS_NUM];
+static uint64_t global_trace_spans_head = 0;
+static struct trace_histogram global_trace_histograms[TRACE_EVENT_TYPES_NUM];
+
+void trace_record(const char *const name, uint64_t start_ns, uint64_t duration_ns)
+{
+    uint64_t index = __atomic_fetch_add(&global_trace_spans_head, 1, __ATOMIC_RELAXED);
+    struct trace_span *span = &global_trace_spans[index & (TRACE_SPANS_NUM - 1)];
+    span->name = name;
+    span->start_ns = start_ns;
+    span->duration_ns = duration_ns;
 }
 
-struct monitor *monitor_create(xcb_randr_output_t output, int16_t crtc_x, int16_t crtc_y,
-                               size_t crtc_width, size_t crtc_height)
+static inline struct trace_scope trace_scope_begin(const char *const name)
 {
-    struct monitor *new_monitor = (struct monitor *)calloc(1, sizeof(struct monitor));
-    if (new_monitor == NULL) {
-        return NULL;
-    }
-    new_monitor->output = output;
-    new_monitor->main_area_fraction = 0.6;
-    new_monitor->main_area_win_num = 1;
-    struct box crtc_box = {crtc_x, crtc_y, crtc_width, crtc_height};
-    new_monitor->crtc_box = crtc_box;
-    new_monitor->gap_top = 8;
-    new_monitor->gap_bottom = 8;
-    new_monitor->gap_left = 8;
-    new_monitor->gap_right = 8;
-    struct box box = {new_monitor->crtc_box.x + new_monitor->gap_left,
-                      new_monitor->crtc_box.y + new_monitor->gap_top,
-                      new_monitor->crtc_box.width - new_monitor->gap_right,
-                      new_monitor->crtc_box.height - new_monitor->gap_bottom};
-    new_monitor->box = box;
-    struct layout layout_tile = {.name = "tile", .arrange = monitor_tile};
-    new_monitor->layouts[0] = layout_tile;
-    new_monitor->current_layout_idx = 0;
-    return new_monitor;
+    struct trace_scope scope = {name, monotonic_now_ns()};
+    return scope;
 }
 
-void monitor_append_client(struct monitor *monitor, struct client *client)
+static inline void trace_scope_end(const struct trace_scope *const scope)
 {
-    list_append(&monitor->clients, &client->list_node);
-    ++monitor->clients_num;
+    trace_record(scope->name, scope->start_ns, monotonic_now_ns() - scope->start_ns);
 }
 
-void client_unfocus(const struct client *const client)
+void trace_event_end(uint8_t type, uint64_t start_ns)
 {
-    uint32_t values[] = {global_client_border_width, global_client_unfocus_pixel};
-    xcb_configure_window(global_xconnection, client->window,
-                         XCB_CONFIG_WINDOW_BORDER_WIDTH | XCB_CW_BORDER_PIXEL, values);
+    uint64_t duration_ns = monotonic_now_ns() - start_ns;
+    struct trace_histogram *histogram = &global_trace_histograms[type];
+    ++histogram->count;
+    histogram->total_ns += duration_ns;
+    histogram->max_ns = max(histogram->max_ns, duration_ns);
+    ++histogram->buckets[min(63 - __builtin_clzll(duration_ns | 1), TRACE_BUCKETS_NUM - 1)];
+    trace_record(global_trace_event_names[type] != NULL ? global_trace_event_names[type]
+                                                        : "ExtensionEvent",
+                 start_ns, duration_ns);
 }
 
-void client_focus(const struct client *const client)
+#define TRACE_SCOPE(Name)                                                         \
+    struct trace_scope trace_scope __attribute__((cleanup(trace_scope_end))) = \
+        trace_scope_begin(Name)
+#define TRACE_EVENT_BEGIN() uint64_t trace_event_start_ns = monotonic_now_ns()
+#define TRACE_EVENT_END(Type) trace_event_end(Type, trace_event_start_ns)
+#else
+#define TRACE_SCOPE(Name)
+#define TRACE_EVENT_BEGIN()
+#define TRACE_EVENT_END(Type)
+#endif
+
+void ipc_connection_close(struct ipc_connection *const connection)
 {
-    uint32_t values[] = {global_client_border_width, global_client_focus_pixel};
-    xcb_configure_window(global_xconnection, client->window,
-                         XCB_CONFIG_WINDOW_BORDER_WIDTH | XCB_CW_BORDER_PIXEL, values);
+    if (connection->fd >= 0) {
+        close(connection->fd);
+    }
+    connection->fd = -1;
 }
 
-void monitor_remove_client(struct monitor *monitor, struct client *client)
+void ipc_write(struct ipc_connection *const connection, const char *const format, ...)
 {
-    list_remove(&monitor->clients, &client->list_node);
-    --monitor->clients_num;
-    if (monitor->clients == NULL || client != monitor->focused_client) {
+    if (connection->fd < 0) {
         return;
     }
-    monitor->focused_client = container_of(monitor->clients->prev, struct client, list_node);
-    client_focus(monitor->focused_client);
+    va_list arguments;
+    va_start(arguments, format);
+    int length = vsnprintf(&connection->output[connection->output_len],
+                           IPC_OUTPUT_SIZE - connection->output_len, format, arguments);
+    va_end(arguments);
+    if (length < 0 || length >= IPC_OUTPUT_SIZE - connection->output_len) {
+        fprintf(stderr, "Dropping IPC connection that doesn't read its output!\n");
+        ipc_connection_close(connection);
+        return;
+    }
+    connection->output_len += length;
 }
 
-struct client *get_client_by_win(xcb_window_t window)
+// Streams a state change to every subscribed connection.
+void ipc_broadcast(const char *const format, ...)
 {
-    for (struct list_node *monitor_cursor = global_monitors; monitor_cursor != NULL;
-         monitor_cursor = monitor_cursor->next) {
-        struct monitor *monitor = container_of(monitor_cursor, struct monitor, list_node);
-        for (struct list_node *client_cursor = monitor->clients; client_cursor != NULL;
-             client_cursor = client_cursor->next) {
-            struct client *client = container_of(client_cursor, struct client, list_node);
-            if (client->window == window) {
-                return client;
-            }
+    for (uint64_t i = 0; i < IPC_CONNECTIONS_MAX; ++i) {
+        struct ipc_connection *connection = &global_ipc_connections[i];
+        if (connection->fd < 0 || connection->is_subscribed == false) {
+            continue;
         }
+        va_list arguments;
+        va_start(arguments, format);
+        char line[512];
+        vsnprintf(line, sizeof(line), format, arguments);
+        va_end(arguments);
+        ipc_write(connection, "event %s\n", line);
     }
-    return NULL;
 }
 
-void client_enable_fullscreen(struct client *const client)
+// Open-addressing hash table from window to client with linear probing. XCB_NONE marks an empty
+// slot, which is safe because the X server never hands out a window with ID 0.
+struct client_table_slot {
+    xcb_window_t window;
+    struct client *client;
+};
+
+struct client_table {
+    struct client_table_slot *slots;
+    uint32_t capacity;
+    uint32_t capacity_shift;
+    uint32_t size;
+};
+
+static struct client_table global_client_table = {0};
+
+static inline uint32_t client_table_index(const struct client_table *const table,
+                                          xcb_window_t window)
 {
-    struct monitor *monitor = client->monitor;
-    client->is_fullscreen = true;
-    client->is_floating = true;
-    client_move_resize(client, monitor->box.x, monitor->box.y, monitor->box.width,
-                       monitor->box.height);
+    // Fibonacci hashing: the top bits of the product mix in every bit of the resource ID, where the
+    // bottom bits would only see the low per-connection counter.
+    return (uint32_t)(window * 2654435769u) >> table->capacity_shift;
 }
 
-bool check_unique_crtc(xcb_randr_get_crtc_info_reply_t *crtc_info_reply)
+int client_table_grow(struct client_table *table)
 {
-    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
-        struct monitor *monitor = container_of(cursor, struct monitor, list_node);
-        if (monitor->crtc_box.width == crtc_info_reply->width &&
-            monitor->crtc_box.height == crtc_info_reply->height &&
-            monitor->crtc_box.x == crtc_info_reply->x &&
-            monitor->crtc_box.y == crtc_info_reply->y) {
-            return false;
+    uint32_t new_capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+    uint32_t new_capacity_shift = table->capacity == 0 ? 32 - 6 : table->capacity_shift - 1;
+    struct client_table_slot *new_slots =
+        (struct client_table_slot *)calloc(new_capacity, sizeof(struct client_table_slot));
+    if (new_slots == NULL) {
+        return 1;
+    }
+    struct client_table old_table = *table;
+    table->slots = new_slots;
+    table->capacity = new_capacity;
+    table->capacity_shift = new_capacity_shift;
+    for (uint32_t i = 0; i < old_table.capacity; ++i) {
+        if (old_table.slots[i].window == XCB_NONE) {
+            continue;
         }
+        uint32_t idx = client_table_index(table, old_table.slots[i].window);
+        while (table->slots[idx].window != XCB_NONE) {
+            idx = (idx + 1) & (table->capacity - 1);
+        }
+        table->slots[idx] = old_table.slots[i];
     }
-    return true;
+    free(old_table.slots);
+    return 0;
 }
 
-int update_monitors(void)
+struct client *client_table_find(const struct client_table *const table, xcb_window_t window)
 {
-    xcb_randr_get_screen_resources_reply_t *screen_resources_reply =
-        xcb_randr_get_screen_resources_reply(
-            global_xconnection,
-            xcb_randr_get_screen_resources(global_xconnection, global_screen->root), NULL);
-    if (screen_resources_reply == NULL) {
-        fprintf(stderr, "Can't get screen resources from X Server!\n");
-        return 1;
+    if (table->size == 0) {
+        return NULL;
     }
+    for (uint32_t idx = client_table_index(table, window); table->slots[idx].window != XCB_NONE;
+         idx = (idx + 1) & (table->capacity - 1)) {
+        if (table->slots[idx].window == window) {
+            return table->slots[idx].client;
+        }
+    }
+    return NULL;
+}
 
-    size_t outputs_len = xcb_randr_get_screen_resources_outputs_length(screen_resources_reply);
-    xcb_randr_output_t *outputs = xcb_randr_get_screen_resources_outputs(screen_resources_reply);
-    xcb_randr_get_output_info_cookie_t *output_info_cookies =
-        (xcb_randr_get_output_info_cookie_t *)calloc(outputs_len,
-                                                     sizeof(xcb_randr_get_output_info_cookie_t));
-    if (output_info_cookies == NULL) {
+int client_table_insert(struct client_table *table, xcb_window_t window, struct client *client)
+{
+    // Keep the load factor at or below one half so probe sequences stay short.
+    if ((table->size + 1) * 2 > table->capacity && client_table_grow(table) != 0) {
         return 1;
     }
-
-    for (uint64_t i = 0; i < outputs_len; ++i) {
-        output_info_cookies[i] =
-            xcb_randr_get_output_info(global_xconnection, outputs[i], XCB_CURRENT_TIME);
+    uint32_t idx = client_table_index(table, window);
+    while (table->slots[idx].window != XCB_NONE && table->slots[idx].window != window) {
+        idx = (idx + 1) & (table->capacity - 1);
     }
+    if (table->slots[idx].window == XCB_NONE) {
+        ++table->size;
+    }
+    table->slots[idx].window = window;
+    table->slots[idx].client = client;
+    return 0;
+}
 
-    for (uint64_t i = 0; i < outputs_len; ++i) {
-        xcb_randr_get_output_info_reply_t *output_info_reply =
-            xcb_randr_get_output_info_reply(global_xconnection, output_info_cookies[i], NULL);
-        if (output_info_reply == NULL) {
-            continue;
+void client_table_remove(struct client_table *table, xcb_window_t window)
+{
+    if (table->size == 0) {
+        return;
+    }
+    uint32_t mask = table->capacity - 1;
+    uint32_t idx = client_table_index(table, window);
+    while (table->slots[idx].window != window) {
+        if (table->slots[idx].window == XCB_NONE) {
+            return;
         }
-
-        xcb_randr_get_crtc_info_reply_t *crtc_info_reply = xcb_randr_get_crtc_info_reply(
-            global_xconnection,
-            xcb_randr_get_crtc_info(global_xconnection, output_info_reply->crtc, XCB_CURRENT_TIME),
-            NULL);
-        if (crtc_info_reply == NULL || check_unique_crtc(crtc_info_reply) == false) {
-            goto LOOP_CLEANUP;
+        idx = (idx + 1) & mask;
+    }
+    // Backward-shift deletion: pull later members of the probe run into the hole so that lookups
+    // never need tombstones.
+    uint32_t hole = idx;
+    for (uint32_t next = (hole + 1) & mask; table->slots[next].window != XCB_NONE;
+         next = (next + 1) & mask) {
+        uint32_t home = client_table_index(table, table->slots[next].window);
+        if (((next - home) & mask) >= ((next - hole) & mask)) {
+            table->slots[hole] = table->slots[next];
+            hole = next;
         }
+    }
+    table->slots[hole].window = XCB_NONE;
+    table->slots[hole].client = NULL;
+    --table->size;
+}
 
-        list_append(&global_monitors,
-                    &monitor_create(outputs[i], crtc_info_reply->x, crtc_info_reply->y,
-                                    crtc_info_reply->width, crtc_info_reply->height)
-                         ->list_node);
+// Clients are carved out of fixed-size slabs that are never moved, so pointers to them stay valid,
+// and freed slots are reused before a new slab is allocated. A client's handle is its slot index
+// across all slabs.
+#define CLIENT_SLAB_SIZE (256)
 
-    LOOP_CLEANUP:
-        free(crtc_info_reply);
-        free(output_info_reply);
-    }
+#define ICON_SIZE (16)
+// Longest _NET_WM_ICON read, in 32-bit units. Covers the usual sizes up to 256 by 256.
+#define ICON_PROPERTY_LENGTH_MAX (262144)
 
-    free(output_info_cookies);
-    free(screen_resources_reply);
+// Cached copies of the client's metadata, kept up to date by client_properties_refresh(). The icon
+// is _NET_WM_ICON scaled down to ICON_SIZE squared ARGB pixels.
+struct client_properties {
+    char name[256];
+    char instance_name[64];
+    char class_name[64];
+    bool has_net_wm_name;
+    bool has_icon;
+    // Bumped whenever the icon is refreshed, so the bar can tell that it changed.
+    uint16_t icon_serial;
+    uint32_t pid;
+    uint32_t icon[ICON_SIZE * ICON_SIZE];
+};
 
-    // TODO: Update contents of each monitors.
+struct client_slab {
+    struct client clients[CLIENT_SLAB_SIZE];
+    struct client_properties properties[CLIENT_SLAB_SIZE];
+};
 
-    return 0;
-}
+static struct client_slab **global_client_slabs = NULL;
+static uint32_t global_client_slabs_num = 0;
+static uint32_t *global_client_free_handles = NULL;
+static uint32_t global_client_free_handles_num = 0;
 
-int x11_randr_init(void)
+int client_slab_grow(void)
 {
-    xcb_randr_get_output_primary_reply_t *primary_output_reply = xcb_randr_get_output_primary_reply(
-        global_xconnection, xcb_randr_get_output_primary(global_xconnection, global_screen->root),
-        NULL);
-    // TODO: Return primary output to caller! (primary_output_reply->output).
-    if (primary_output_reply == NULL) {
-        fprintf(stderr, "Can't get primary output info from X Server!\n");
+    struct client_slab **new_slabs = (struct client_slab **)realloc(
+        global_client_slabs, (global_client_slabs_num + 1) * sizeof(struct client_slab *));
+    if (new_slabs == NULL) {
         return 1;
     }
+    global_client_slabs = new_slabs;
+    uint32_t *new_free_handles =
+        (uint32_t *)realloc(global_client_free_handles,
+                            (global_client_slabs_num + 1) * CLIENT_SLAB_SIZE * sizeof(uint32_t));
+    if (new_free_handles == NULL) {
+        return 1;
+    }
+    global_client_free_handles = new_free_handles;
+    struct client_slab *new_slab = (struct client_slab *)malloc(sizeof(struct client_slab));
+    if (new_slab == NULL) {
+        return 1;
+    }
+    global_client_slabs[global_client_slabs_num] = new_slab;
+    // Pushed in reverse so that the lowest handles of the new slab are handed out first.
+    for (uint32_t i = CLIENT_SLAB_SIZE; i > 0; --i) {
+        global_client_free_handles[global_client_free_handles_num++] =
+            global_client_slabs_num * CLIENT_SLAB_SIZE + i - 1;
+    }
+    ++global_client_slabs_num;
+    return 0;
+}
 
-    update_monitors();
+struct client *client_alloc(void)
+{
+    if (global_client_free_handles_num == 0 && client_slab_grow() != 0) {
+        return NULL;
+    }
+    uint32_t handle = global_client_free_handles[--global_client_free_handles_num];
+    struct client_slab *slab = global_client_slabs[handle / CLIENT_SLAB_SIZE];
+    struct client *client = &slab->clients[handle % CLIENT_SLAB_SIZE];
+    memset(client, 0, sizeof(struct client));
+    memset(&slab->properties[handle % CLIENT_SLAB_SIZE], 0, sizeof(struct client_properties));
+    client->handle = handle;
+    return client;
+}
 
-    free(primary_output_reply);
+void client_free(struct client *const client)
+{
+    if (client->sync_alarm != XCB_NONE) {
+        xcb_sync_destroy_alarm(global_xconnection, client->sync_alarm);
+    }
+    if (global_drag.client == client) {
+        global_drag.client = NULL;
+    }
+    global_client_free_handles[global_client_free_handles_num++] = client->handle;
+}
 
-    xcb_randr_select_input(global_xconnection, global_screen->root,
-                           XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE);
-    xcb_set_input_focus(global_xconnection, XCB_INPUT_FOCUS_POINTER_ROOT, global_screen->root,
-                        XCB_CURRENT_TIME);
+static inline struct client_properties *client_properties(const struct client *const client)
+{
+    return &global_client_slabs[client->handle / CLIENT_SLAB_SIZE]
+                ->properties[client->handle % CLIENT_SLAB_SIZE];
+}
+
+static inline char *client_name(const struct client *const client)
+{
+    return client_properties(client)->name;
+}
+
+// Hints missing from a refreshed WM_NORMAL_HINTS are reset rather than kept.
+void client_set_size_hints(struct client *const client, const xcb_size_hints_t *const size_hints)
+{
+    struct size_constraints constraints = {0};
+    bool has_base = size_hints->flags & XCB_ICCCM_SIZE_HINT_BASE_SIZE;
+    bool has_min = size_hints->flags & XCB_ICCCM_SIZE_HINT_P_MIN_SIZE;
+    bool has_max = size_hints->flags & XCB_ICCCM_SIZE_HINT_P_MAX_SIZE;
+    if (has_base == true) {
+        constraints.base_width = max(size_hints->base_width, 0);
+        constraints.base_height = max(size_hints->base_height, 0);
+        constraints.aspect_base_width = constraints.base_width;
+        constraints.aspect_base_height = constraints.base_height;
+    } else if (has_min == true) {
+        constraints.base_width = max(size_hints->min_width, 0);
+        constraints.base_height = max(size_hints->min_height, 0);
+    }
+    if (has_min == true) {
+        constraints.min_width = max(size_hints->min_width, 0);
+        constraints.min_height = max(size_hints->min_height, 0);
+    } else if (has_base == true) {
+        constraints.min_width = max(size_hints->base_width, 0);
+        constraints.min_height = max(size_hints->base_height, 0);
+    }
+    if (has_max == true && size_hints->max_width > 0 && size_hints->max_height > 0) {
+        constraints.max_width = min(max(size_hints->max_width, constraints.min_width), UINT16_MAX);
+        constraints.max_height =
+            min(max(size_hints->max_height, constraints.min_height), UINT16_MAX);
+    }
+    if ((size_hints->flags & XCB_ICCCM_SIZE_HINT_P_RESIZE_INC) && size_hints->width_inc > 0 &&
+        size_hints->height_inc > 0) {
+        constraints.width_inc = size_hints->width_inc;
+        constraints.height_inc = size_hints->height_inc;
+        constraints.inverse_width_inc = 1.0f / constraints.width_inc;
+        constraints.inverse_height_inc = 1.0f / constraints.height_inc;
+    }
+    if ((size_hints->flags & XCB_ICCCM_SIZE_HINT_P_ASPECT) && size_hints->min_aspect_num > 0 &&
+        size_hints->min_aspect_den > 0 && size_hints->max_aspect_num > 0 &&
+        size_hints->max_aspect_den > 0) {
+        constraints.min_aspect =
+            ((int64_t)size_hints->min_aspect_num << 16) / size_hints->min_aspect_den;
+        constraints.inverse_min_aspect =
+            ((int64_t)size_hints->min_aspect_den << 16) / size_hints->min_aspect_num;
+        constraints.max_aspect =
+            ((int64_t)size_hints->max_aspect_num << 16) / size_hints->max_aspect_den;
+    }
+    client->size_constraints = constraints;
+    client->is_fixed = has_max == true && has_min == true &&
+                       constraints.max_width == constraints.min_width &&
+                       constraints.max_height == constraints.min_height;
+}
+
+// Applies each box's constraints in one pass of selects instead of branches, which keeps the loop
+// open to vectorization. The increment remainder comes from a float quotient that is at most one
+// off and then corrected, since integer division doesn't vectorize.
+void size_constraints_apply(const struct size_constraints *const constraints,
+                            struct box *const boxes, uint64_t boxes_num)
+{
+    for (uint64_t i = 0; i < boxes_num; ++i) {
+        const struct size_constraints *c = &constraints[i];
+        int32_t width = max((int32_t)boxes[i].width - c->aspect_base_width, 0);
+        int32_t height = max((int32_t)boxes[i].height - c->aspect_base_height, 0);
+
+        // Too wide narrows the box, too tall shortens it, as the tile is an upper bound.
+        int64_t aspect_width = height * c->max_aspect >> 16;
+        width = (c->max_aspect > 0) & (width > aspect_width) ? aspect_width : width;
+        int64_t aspect_height = width * c->inverse_min_aspect >> 16;
+        height = (c->min_aspect > 0) & ((int64_t)width << 16 < height * c->min_aspect)
+                     ? aspect_height
+                     : height;
+
+        // Increments count from base, which min stands in for.
+        width = max(width + c->aspect_base_width - c->base_width, 0);
+        height = max(height + c->aspect_base_height - c->base_height, 0);
+
+        // Without an increment every size is a multiple of 1.
+        int32_t width_inc = max(c->width_inc, 1);
+        float inverse_width_inc = c->width_inc > 0 ? c->inverse_width_inc : 1;
+        int32_t width_remainder = width - (int32_t)(width * inverse_width_inc) * width_inc;
+        width_remainder += width_remainder < 0 ? width_inc : 0;
+        width_remainder -= width_remainder >= width_inc ? width_inc : 0;
+        int32_t height_inc = max(c->height_inc, 1);
+        float inverse_height_inc = c->height_inc > 0 ? c->inverse_height_inc : 1;
+        int32_t height_remainder = height - (int32_t)(height * inverse_height_inc) * height_inc;
+        height_remainder += height_remainder < 0 ? height_inc : 0;
+        height_remainder -= height_remainder >= height_inc ? height_inc : 0;
+
+        int32_t max_width = c->max_width > 0 ? c->max_width : UINT16_MAX;
+        int32_t max_height = c->max_height > 0 ? c->max_height : UINT16_MAX;
+        width = min(max(width - width_remainder + c->base_width, max(c->min_width, 1)), max_width);
+        height =
+            min(max(height - height_remainder + c->base_height, max(c->min_height, 1)), max_height);
+        boxes[i].width = width;
+        boxes[i].height = height;
+    }
+}
+
+struct box get_box_with_size_hints(const struct client *const client, const struct box box)
+{
+    struct box new_box = box;
+    struct monitor *monitor = client->monitor;
+    if (new_box.x >= monitor->box.x + monitor->box.width) {
+        new_box.x = monitor->box.x + monitor->box.width - client->box.width;
+    }
+    if (new_box.y >= monitor->box.y + monitor->box.height) {
+        new_box.y = monitor->box.y + monitor->box.height - client->box.height;
+    }
+    if (new_box.x + new_box.width < monitor->box.x) {
+        new_box.x = monitor->box.x;
+    }
+    if (new_box.y + new_box.height < monitor->box.y) {
+        new_box.y = monitor->box.y;
+    }
+    if (should_respect_size_hints == false && client->is_floating == false) {
+        return new_box;
+    }
+    size_constraints_apply(&client->size_constraints, &new_box, 1);
+    return new_box;
+}
+
+struct client *client_create(struct monitor *monitor, xcb_window_t window, int16_t x, int16_t y,
+                             uint16_t width, uint16_t height, int16_t border_width, uint16_t tags)
+{
+    struct client *new_client = client_alloc();
+    if (new_client == NULL) {
+        return NULL;
+    }
+    new_client->monitor = monitor;
+    new_client->window = window;
+    struct box box = {x, y, width, height};
+    new_client->box = box;
+    new_client->border_width = border_width;
+    new_client->tags = tags;
+    return new_client;
+}
+
+void client_configure(const struct client *const client)
+{
+    xcb_configure_notify_event_t notify_event;
 
+    notify_event.response_type = XCB_CONFIGURE_NOTIFY;
+    notify_event.event = client->window;
+    notify_event.window = client->window;
+    notify_event.above_sibling = XCB_NONE;
+    notify_event.x = client->box.x;
+    notify_event.y = client->box.y;
+    notify_event.width = client->box.width;
+    notify_event.height = client->box.height;
+    notify_event.border_width = client->border_width;
+    notify_event.override_redirect = false;
+
+    xcb_void_cookie_t cookie =
+        xcb_send_event(global_xconnection, false, client->window, XCB_EVENT_MASK_STRUCTURE_NOTIFY,
+                       (char *)&notify_event);
+    error_route(cookie.sequence, ERROR_ROUTE_CLIENT, client->window);
+}
+
+// Clients waiting for their counter to reach sync_value, in no particular order.
+static xcb_window_t *global_sync_waits = NULL;
+static uint64_t global_sync_waits_num = 0;
+static uint64_t global_sync_waits_capacity = 0;
+
+// Asks the client to set its counter to the next sync_value once it has repainted after the
+// ConfigureWindow that follows, and moves the alarm to fire at that value.
+int client_sync_request(struct client *const client)
+{
+    if (global_sync_waits_num == global_sync_waits_capacity) {
+        uint64_t new_capacity =
+            global_sync_waits_capacity == 0 ? 16 : global_sync_waits_capacity * 2;
+        xcb_window_t *new_sync_waits =
+            (xcb_window_t *)realloc(global_sync_waits, new_capacity * sizeof(xcb_window_t));
+        if (new_sync_waits == NULL) {
+            fprintf(stderr, "Can't wait for client repaint!\n");
+            return 1;
+        }
+        global_sync_waits = new_sync_waits;
+        global_sync_waits_capacity = new_capacity;
+    }
+    ++client->sync_value;
+    xcb_client_message_event_t event = {0};
+    event.response_type = XCB_CLIENT_MESSAGE;
+    event.format = 32;
+    event.window = client->window;
+    event.type = global_wm_atoms[WM_PROTOCOLS];
+    event.data.data32[0] = global_ewmh_connection->_NET_WM_SYNC_REQUEST;
+    event.data.data32[1] = XCB_CURRENT_TIME;
+    event.data.data32[2] = client->sync_value & 0xffffffff;
+    event.data.data32[3] = client->sync_value >> 32;
+    xcb_void_cookie_t cookie = xcb_send_event(global_xconnection, false, client->window,
+                                              XCB_EVENT_MASK_NO_EVENT, (char *)&event);
+    error_route(cookie.sequence, ERROR_ROUTE_CLIENT, client->window);
+    xcb_sync_change_alarm_value_list_t alarm_values = {0};
+    alarm_values.value.hi = client->sync_value >> 32;
+    alarm_values.value.lo = client->sync_value & 0xffffffff;
+    xcb_sync_change_alarm_aux(global_xconnection, client->sync_alarm, XCB_SYNC_CA_VALUE,
+                              &alarm_values);
+    client->is_waiting_sync = true;
+    client->sync_deadline_ns = monotonic_now_ns() + global_sync_timeout_ns;
+    global_sync_waits[global_sync_waits_num++] = client->window;
     return 0;
 }
 
-xcb_atom_t get_atom(const char *const name)
+// new_box must already satisfy the client's size hints. A resize while the client is still
+// repainting the previous one is held back, and only the latest held box is sent once it is done,
+// see client_sync_done(). Moves alone need no repaint.
+void client_set_box(struct client *client, const struct box new_box)
 {
-    xcb_intern_atom_reply_t *intern_atom_reply = xcb_intern_atom_reply(
-        global_xconnection, xcb_intern_atom(global_xconnection, 0, strlen(name), name), NULL);
-    if (intern_atom_reply == NULL) {
-        return XCB_ATOM_NONE;
+    if (client->is_hidden == true) {
+        // The whole box goes out at once when client_show() brings the client back.
+        client->box = new_box;
+        client->has_held_box = false;
+        ++global_configure_counters.skipped;
+        return;
     }
-    xcb_atom_t result = intern_atom_reply->atom;
-    free(intern_atom_reply);
-    return result;
+    if (client->is_waiting_sync == true &&
+        (new_box.width != client->box.width || new_box.height != client->box.height)) {
+        client->held_box = new_box;
+        client->has_held_box = true;
+        ++global_configure_counters.held;
+        return;
+    }
+    client->has_held_box = false;
+
+    // client->box is the geometry last committed to the X server, so only send what differs.
+    uint16_t value_mask = 0;
+    uint32_t values[4];
+    uint8_t values_num = 0;
+    if (new_box.x != client->box.x) {
+        value_mask |= XCB_CONFIG_WINDOW_X;
+        values[values_num++] = new_box.x;
+    }
+    if (new_box.y != client->box.y) {
+        value_mask |= XCB_CONFIG_WINDOW_Y;
+        values[values_num++] = new_box.y;
+    }
+    if (new_box.width != client->box.width) {
+        value_mask |= XCB_CONFIG_WINDOW_WIDTH;
+        values[values_num++] = new_box.width;
+    }
+    if (new_box.height != client->box.height) {
+        value_mask |= XCB_CONFIG_WINDOW_HEIGHT;
+        values[values_num++] = new_box.height;
+    }
+    if (value_mask == 0) {
+        ++global_configure_counters.skipped;
+        return;
+    }
+    if ((value_mask & (XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT)) != 0 &&
+        client->sync_alarm != XCB_NONE) {
+        client_sync_request(client);
+    }
+    xcb_void_cookie_t cookie =
+        xcb_configure_window(global_xconnection, client->window, value_mask, values);
+    error_route(cookie.sequence, ERROR_ROUTE_CLIENT, client->window);
+    client->box = new_box;
+    ++global_configure_counters.sent;
 }
 
-int x11_init(void)
+void client_move_resize(struct client *client, int16_t x, int16_t y, uint16_t width,
+                        uint16_t height)
 {
-    int32_t screen_num = 0;
-    global_xconnection = xcb_connect(NULL, &screen_num);
-    if (xcb_connection_has_error(global_xconnection)) {
-        fprintf(stderr, "Can't connect to X Server!\n");
-        return 1;
+    struct box box = {x, y, width, height};
+    client_set_box(client, get_box_with_size_hints(client, box));
+}
+
+void client_sync_done(struct client *const client)
+{
+    client->is_waiting_sync = false;
+    if (client->has_held_box == true) {
+        client->has_held_box = false;
+        // Already constrained when it was held.
+        client_set_box(client, client->held_box);
     }
+}
 
-    global_ewmh_connection = (xcb_ewmh_connection_t *)malloc(sizeof(xcb_ewmh_connection_t));
-    if (xcb_ewmh_init_atoms_replies(global_ewmh_connection,
-                                    xcb_ewmh_init_atoms(global_xconnection, global_ewmh_connection),
-                                    NULL) != 0) {
-        fprintf(stderr, "Can't initialize EWMH atoms!\n");
-        return 1;
+// Called when WM_PROTOCOLS or the counter changed. A wait on the old alarm is given up.
+void client_update_sync(struct client *const client)
+{
+    if (client->sync_alarm != XCB_NONE) {
+        xcb_sync_destroy_alarm(global_xconnection, client->sync_alarm);
+        client->sync_alarm = XCB_NONE;
+    }
+    if (client->is_waiting_sync == true) {
+        client_sync_done(client);
+    }
+    if (global_sync_first_event == 0 || client->supports_sync_request == false ||
+        client->sync_counter == XCB_NONE) {
+        return;
     }
+    xcb_sync_create_alarm_value_list_t alarm_values = {0};
+    alarm_values.counter = client->sync_counter;
+    alarm_values.valueType = XCB_SYNC_VALUETYPE_ABSOLUTE;
+    alarm_values.value.hi = client->sync_value >> 32;
+    alarm_values.value.lo = client->sync_value & 0xffffffff;
+    alarm_values.testType = XCB_SYNC_TESTTYPE_POSITIVE_COMPARISON;
+    alarm_values.events = 1;
+    client->sync_alarm = xcb_generate_id(global_xconnection);
+    // The counter may be bogus or already gone, see handle_error().
+    xcb_void_cookie_t cookie = xcb_sync_create_alarm_aux(
+        global_xconnection, client->sync_alarm,
+        XCB_SYNC_CA_COUNTER | XCB_SYNC_CA_VALUE_TYPE | XCB_SYNC_CA_VALUE | XCB_SYNC_CA_TEST_TYPE |
+            XCB_SYNC_CA_DELTA | XCB_SYNC_CA_EVENTS,
+        &alarm_values);
+    error_route(cookie.sequence, ERROR_ROUTE_SYNC_ALARM, client->window);
+}
 
-    global_wm_atoms[WM_PROTOCOLS] = get_atom("WM_PROTOCOLS");
-    global_wm_atoms[WM_DELETE_WINDOW] = get_atom("WM_DELETE_WINDOW");
-    global_wm_atoms[WM_STATE] = get_atom("WM_STATE");
-    global_wm_atoms[WM_TAKE_FOCUS] = get_atom("WM_TAKE_FOCUS");
+// The geometry kernel shared by every layout. It returns the i-th of n equal stripes cut along one
+// axis of area, handing the leftover pixels to the first stripes so they cover area exactly.
+static inline struct box layout_stripe(const struct box area, uint64_t n, uint64_t i,
+                                       bool is_vertical)
+{
+    uint16_t length = is_vertical ? area.height : area.width;
+    uint64_t base = length / n;
+    uint64_t remainder = length % n;
+    struct box box = area;
+    if (is_vertical) {
+        box.y = area.y + i * base + min(i, remainder);
+        box.height = base + (i < remainder);
+    } else {
+        box.x = area.x + i * base + min(i, remainder);
+        box.width = base + (i < remainder);
+    }
+    return box;
+}
 
-    xcb_screen_iterator_t iterator = xcb_setup_roots_iterator(xcb_get_setup(global_xconnection));
-    for (uint64_t i = 0; i < screen_num; ++i) {
-        xcb_screen_next(&iterator);
+static inline void layout_split(const struct box area, uint64_t n, bool is_vertical,
+                                struct box *const boxes)
+{
+    if (n == 0) {
+        return;
     }
-    global_screen = iterator.data;
+    uint16_t length = is_vertical ? area.height : area.width;
+    uint64_t base = length / n;
+    uint64_t remainder = length % n;
+    int32_t offset = is_vertical ? area.y : area.x;
+    for (uint64_t i = 0; i < n; ++i) {
+        uint16_t size = base + (i < remainder);
+        struct box box = area;
+        if (is_vertical) {
+            box.y = offset;
+            box.height = size;
+        } else {
+            box.x = offset;
+            box.width = size;
+        }
+        boxes[i] = box;
+        offset += size;
+    }
+}
 
-    uint32_t event_mask[] = {(XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT |
-                              XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY | XCB_EVENT_MASK_STRUCTURE_NOTIFY |
-                              XCB_EVENT_MASK_BUTTON_PRESS)};
-    xcb_generic_error_t *error = xcb_request_check(
-        global_xconnection,
-        xcb_change_window_attributes_checked(global_xconnection, global_screen->root,
-                                             XCB_CW_EVENT_MASK, event_mask));
-    if (error != NULL) {
-        free(error);
-        fprintf(stderr, "Can't register to X Server for reparenting!\n");
-        fprintf(stderr, "Maybe there's another window manager already running?\n");
-        return 1;
+// Hidden clients are moved out of sight instead of being unmapped, so there is no UnmapNotify or
+// WM_STATE to keep track of, and hiding or showing a client is a single configure.
+void client_hide(struct client *const client)
+{
+    uint32_t values[] = {-2 * client_width(client)};
+    xcb_void_cookie_t cookie =
+        xcb_configure_window(global_xconnection, client->window, XCB_CONFIG_WINDOW_X, values);
+    error_route(cookie.sequence, ERROR_ROUTE_CLIENT, client->window);
+    client->is_hidden = true;
+    ++global_configure_counters.sent;
+}
+
+void client_show(struct client *const client)
+{
+    uint32_t values[] = {client->box.x, client->box.y, client->box.width, client->box.height};
+    xcb_void_cookie_t cookie = xcb_configure_window(
+        global_xconnection, client->window,
+        XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
+            XCB_CONFIG_WINDOW_HEIGHT,
+        values);
+    error_route(cookie.sequence, ERROR_ROUTE_CLIENT, client->window);
+    client->is_hidden = false;
+    ++global_configure_counters.sent;
+}
+
+static inline bool client_is_visible(const struct client *const client)
+{
+    return client->tags & client->monitor->enabled_tags;
+}
+
+void monitor_tile(const struct monitor *const monitor, uint64_t clients_num,
+                  struct box *const boxes)
+{
+    uint64_t main_clients_num = min(clients_num, monitor->main_area_win_num);
+    struct box main_area = monitor->box;
+    struct box sub_area = monitor->box;
+    if (main_clients_num > 0 && main_clients_num < clients_num) {
+        main_area.width = monitor->box.width * monitor->main_area_fraction;
+        sub_area.x += main_area.width;
+        sub_area.width -= main_area.width;
     }
+    layout_split(main_area, main_clients_num, true, boxes);
+    layout_split(sub_area, clients_num - main_clients_num, true, boxes + main_clients_num);
+}
 
-    if (xcb_get_extension_data(global_xconnection, &xcb_randr_id)->present == 0) {
-        fprintf(stderr, "Failed to get RandR extension!\n");
+void monitor_monocle(const struct monitor *const monitor, uint64_t clients_num,
+                     struct box *const boxes)
+{
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        boxes[i] = monitor->box;
+    }
+}
+
+void monitor_grid(const struct monitor *const monitor, uint64_t clients_num,
+                  struct box *const boxes)
+{
+    if (clients_num == 0) {
+        return;
+    }
+    uint64_t columns_num = 1;
+    while (columns_num * columns_num < clients_num) {
+        ++columns_num;
+    }
+    uint64_t clients_idx = 0;
+    for (uint64_t i = 0; i < columns_num; ++i) {
+        uint64_t rows_num = clients_num / columns_num + (i < clients_num % columns_num);
+        layout_split(layout_stripe(monitor->box, columns_num, i, false), rows_num, true,
+                     boxes + clients_idx);
+        clients_idx += rows_num;
+    }
+}
+
+// The main area sits in the middle. The right stack takes the first half of the remaining clients
+// and the left stack the rest.
+void monitor_centered_master(const struct monitor *const monitor, uint64_t clients_num,
+                             struct box *const boxes)
+{
+    uint64_t main_clients_num = min(clients_num, monitor->main_area_win_num);
+    uint64_t sub_clients_num = clients_num - main_clients_num;
+    if (main_clients_num == 0 || sub_clients_num <= 1) {
+        monitor_tile(monitor, clients_num, boxes);
+        return;
+    }
+    uint64_t right_clients_num = (sub_clients_num + 1) / 2;
+    struct box main_area = monitor->box;
+    main_area.width = monitor->box.width * monitor->main_area_fraction;
+    struct box left_area = monitor->box;
+    left_area.width = (monitor->box.width - main_area.width) / 2;
+    main_area.x += left_area.width;
+    struct box right_area = monitor->box;
+    right_area.x = main_area.x + main_area.width;
+    right_area.width = monitor->box.width - main_area.width - left_area.width;
+    layout_split(main_area, main_clients_num, true, boxes);
+    layout_split(right_area, right_clients_num, true, boxes + main_clients_num);
+    layout_split(left_area, sub_clients_num - right_clients_num, true,
+                 boxes + main_clients_num + right_clients_num);
+}
+
+// Every client but the last takes half of the area left by the previous ones. Dwindle always takes
+// the left or top half, spiral goes round left, top, right and bottom.
+static inline void layout_fibonacci(const struct monitor *const monitor, uint64_t clients_num,
+                                    struct box *const boxes, bool is_spiral)
+{
+    struct box area = monitor->box;
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        struct box box = area;
+        uint64_t direction = is_spiral ? i % 4 : i % 2;
+        if (i + 1 == clients_num) {
+            boxes[i] = box;
+            break;
+        }
+        if (direction == 0 || direction == 2) {
+            box.width = area.width / 2;
+            area.width -= box.width;
+            if (direction == 0) {
+                area.x += box.width;
+            } else {
+                box.x = area.x + area.width;
+            }
+        } else {
+            box.height = area.height / 2;
+            area.height -= box.height;
+            if (direction == 1) {
+                area.y += box.height;
+            } else {
+                box.y = area.y + area.height;
+            }
+        }
+        boxes[i] = box;
+    }
+}
+
+void monitor_spiral(const struct monitor *const monitor, uint64_t clients_num,
+                    struct box *const boxes)
+{
+    layout_fibonacci(monitor, clients_num, boxes, true);
+}
+
+void monitor_dwindle(const struct monitor *const monitor, uint64_t clients_num,
+                     struct box *const boxes)
+{
+    layout_fibonacci(monitor, clients_num, boxes, false);
+}
+
+void monitor_vstack(const struct monitor *const monitor, uint64_t clients_num,
+                    struct box *const boxes)
+{
+    layout_split(monitor->box, clients_num, true, boxes);
+}
+
+void monitor_hstack(const struct monitor *const monitor, uint64_t clients_num,
+                    struct box *const boxes)
+{
+    layout_split(monitor->box, clients_num, false, boxes);
+}
+
+static const struct layout global_layouts[LAYOUT_END] = {
+    [LAYOUT_TILE] = {.name = "tile", .arrange = monitor_tile},
+    [LAYOUT_MONOCLE] = {.name = "monocle", .arrange = monitor_monocle},
+    [LAYOUT_GRID] = {.name = "grid", .arrange = monitor_grid},
+    [LAYOUT_CENTERED_MASTER] = {.name = "centeredmaster", .arrange = monitor_centered_master},
+    [LAYOUT_SPIRAL] = {.name = "spiral", .arrange = monitor_spiral},
+    [LAYOUT_DWINDLE] = {.name = "dwindle", .arrange = monitor_dwindle},
+    [LAYOUT_VSTACK] = {.name = "vstack", .arrange = monitor_vstack},
+    [LAYOUT_HSTACK] = {.name = "hstack", .arrange = monitor_hstack},
+};
+
+void monitor_set_crtc_box(struct monitor *const monitor, const struct box crtc_box)
+{
+    monitor->crtc_box = crtc_box;
+    struct box box = {crtc_box.x + monitor->gap_left, crtc_box.y + monitor->gap_top,
+                      crtc_box.width - monitor->gap_left - monitor->gap_right,
+                      crtc_box.height - monitor->gap_top - monitor->gap_bottom};
+    monitor->box = box;
+}
+
+struct monitor *monitor_create(xcb_randr_output_t output, int16_t crtc_x, int16_t crtc_y,
+                               size_t crtc_width, size_t crtc_height)
+{
+    struct monitor *new_monitor = (struct monitor *)calloc(1, sizeof(struct monitor));
+    if (new_monitor == NULL) {
+        return NULL;
+    }
+    new_monitor->output = output;
+    new_monitor->enabled_tags = MASK_TAG1;
+    new_monitor->main_area_fraction = 0.6;
+    new_monitor->main_area_win_num = 1;
+    new_monitor->gap_top = global_bar_height + 8;
+    new_monitor->gap_bottom = 8;
+    new_monitor->gap_left = 8;
+    new_monitor->gap_right = 8;
+    struct box crtc_box = {crtc_x, crtc_y, crtc_width, crtc_height};
+    monitor_set_crtc_box(new_monitor, crtc_box);
+    memcpy(new_monitor->layouts, global_layouts, sizeof(global_layouts));
+    new_monitor->current_layout_idx = LAYOUT_TILE;
+    memset(new_monitor->tag_layout_idxs, LAYOUT_TILE, sizeof(new_monitor->tag_layout_idxs));
+    new_monitor->refresh_interval_ns = global_default_refresh_interval_ns;
+    return new_monitor;
+}
+
+void bar_destroy(struct bar *const bar)
+{
+    if (bar->window == XCB_NONE) {
+        return;
+    }
+    xcb_destroy_window(global_xconnection, bar->window);
+    xcb_free_pixmap(global_xconnection, bar->pixmap);
+    if (bar->shm_seg != XCB_NONE) {
+        xcb_shm_detach(global_xconnection, bar->shm_seg);
+    }
+    if (bar->shm_pixels != NULL) {
+        shmdt(bar->shm_pixels);
+    }
+    memset(bar, 0, sizeof(struct bar));
+}
+
+void monitor_free(struct monitor *const monitor)
+{
+    bar_destroy(&monitor->bar);
+    free(monitor);
+}
+
+int arrange_buffer_reserve(uint64_t clients_num)
+{
+    if (clients_num <= global_arrange_capacity) {
+        return 0;
+    }
+    uint64_t new_capacity = max(clients_num, global_arrange_capacity * 2);
+    struct client **new_clients =
+        (struct client **)realloc(global_arrange_clients, new_capacity * sizeof(struct client *));
+    if (new_clients == NULL) {
+        return 1;
+    }
+    global_arrange_clients = new_clients;
+    struct box *new_boxes =
+        (struct box *)realloc(global_arrange_boxes, new_capacity * sizeof(struct box));
+    if (new_boxes == NULL) {
+        return 1;
+    }
+    global_arrange_boxes = new_boxes;
+    struct size_constraints *new_constraints = (struct size_constraints *)realloc(
+        global_arrange_constraints, new_capacity * sizeof(struct size_constraints));
+    if (new_constraints == NULL) {
         return 1;
     }
+    global_arrange_constraints = new_constraints;
+    global_arrange_capacity = new_capacity;
+    return 0;
+}
+
+void monitor_arrange(struct monitor *const monitor)
+{
+    TRACE_SCOPE("monitor_arrange");
+    monitor->needs_arrange = false;
+    if (arrange_buffer_reserve(monitor->clients_num) != 0) {
+        fprintf(stderr, "Can't allocate memory to arrange monitor!\n");
+        return;
+    }
+
+    uint64_t clients_num = 0;
+    for (struct list_node *cursor = monitor->clients; cursor != NULL; cursor = cursor->next) {
+        struct client *client = container_of(cursor, struct client, list_node);
+        if (client->is_floating == false && client_is_visible(client) == true) {
+            global_arrange_constraints[clients_num] = client->size_constraints;
+            global_arrange_clients[clients_num++] = client;
+        }
+    }
+    monitor->layouts[monitor->current_layout_idx].arrange(monitor, clients_num,
+                                                          global_arrange_boxes);
+
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        struct box *box = &global_arrange_boxes[i];
+        uint16_t borders = 2 * global_arrange_clients[i]->border_width;
+        box->width = box->width > borders ? box->width - borders : 1;
+        box->height = box->height > borders ? box->height - borders : 1;
+    }
+    // The whole layout goes through the size hints at once, and the tiles are on the monitor
+    // already, so each client only commits its box.
+    if (should_respect_size_hints == true) {
+        size_constraints_apply(global_arrange_constraints, global_arrange_boxes, clients_num);
+    }
+    for (uint64_t i = 0; i < clients_num; ++i) {
+        client_set_box(global_arrange_clients[i], global_arrange_boxes[i]);
+    }
+
+    // Runs after the layout so that a client coming back into view is configured only once.
+    for (struct list_node *cursor = monitor->clients; cursor != NULL; cursor = cursor->next) {
+        struct client *client = container_of(cursor, struct client, list_node);
+        bool is_visible = client_is_visible(client);
+        if (is_visible == true && client->is_hidden == true) {
+            client_show(client);
+        } else if (is_visible == false && client->is_hidden == false) {
+            client_hide(client);
+        }
+    }
+}
+
+// Tag changes are arranged inside a server grab, so that no intermediate state of the windows being
+// hidden and shown is ever drawn. The requests go out with the flush at the end of the event batch.
+void monitors_arrange_pending(void)
+{
+    bool should_grab = global_tags_changed;
+    if (should_grab == true) {
+        xcb_grab_server(global_xconnection);
+    }
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        struct monitor *monitor = container_of(cursor, struct monitor, list_node);
+        if (monitor->needs_arrange == true) {
+            monitor_arrange(monitor);
+        }
+    }
+    if (should_grab == true) {
+        xcb_ungrab_server(global_xconnection);
+        global_tags_changed = false;
+    }
+}
+
+void monitor_set_layout(struct monitor *const monitor, uint8_t layout_idx)
+{
+    if (layout_idx >= LAYOUT_END) {
+        return;
+    }
+    // Remembered for every tag in view, so that viewing them again brings the layout back. This
+    // holds even when the layout doesn't change, the tags in view may have remembered another one.
+    for (uint8_t i = 0; i < TAGS_NUM; ++i) {
+        if (monitor->enabled_tags & (1 << i)) {
+            monitor->tag_layout_idxs[i] = layout_idx;
+        }
+    }
+    if (layout_idx == monitor->current_layout_idx) {
+        return;
+    }
+    monitor->current_layout_idx = layout_idx;
+    monitor->needs_arrange = true;
+    ipc_broadcast("layout 0x%x %s", monitor->output, monitor->layouts[layout_idx].name);
+}
+
+// The most recently focused client still in view. Clients out of view are rare near the top of the
+// stack, so this usually stops at the first node.
+struct client *monitor_focus_fallback(const struct monitor *const monitor)
+{
+    for (struct list_node *node = monitor->focus_stack; node != NULL; node = node->next) {
+        struct client *client = container_of(node, struct client, focus_node);
+        if (client_is_visible(client) == true) {
+            return client;
+        }
+    }
+    return NULL;
+}
+
+// Only marks the monitor, so that any number of tag changes in one batch, from X events or an IPC
+// command batch, cost a single arrange and grab in monitors_arrange_pending().
+void monitor_update_tags(struct monitor *const monitor)
+{
+    if (monitor->focused_client == NULL || client_is_visible(monitor->focused_client) == false) {
+        monitor->focused_client = monitor_focus_fallback(monitor);
+    }
+    monitor->needs_arrange = true;
+    global_tags_changed = true;
+}
+
+void monitor_view(struct monitor *const monitor, uint16_t tags)
+{
+    tags &= TAGS_MASK;
+    if (tags == 0 || tags == monitor->enabled_tags) {
+        return;
+    }
+    monitor->enabled_tags = tags;
+    monitor->current_layout_idx = monitor->tag_layout_idxs[__builtin_ctz(tags)];
+    monitor_update_tags(monitor);
+    ipc_broadcast("view 0x%x %u", monitor->output, tags);
+}
+
+void monitor_toggle_view(struct monitor *const monitor, uint16_t tags)
+{
+    monitor_view(monitor, monitor->enabled_tags ^ tags);
+}
+
+// Desktops are tags, a client is on the desktop of its lowest tag. Read back when the window is
+// adopted again, so tags survive a restart even without a session.
+void client_publish_desktop(const struct client *const client)
+{
+    uint32_t desktop = __builtin_ctz(client->tags);
+    xcb_change_property(global_xconnection, XCB_PROP_MODE_REPLACE, client->window,
+                        global_ewmh_connection->_NET_WM_DESKTOP, XCB_ATOM_CARDINAL, 32, 1,
+                        &desktop);
+}
+
+void client_tag(struct client *const client, uint16_t tags)
+{
+    tags &= TAGS_MASK;
+    if (tags == 0 || tags == client->tags) {
+        return;
+    }
+    bool is_desktop_changed = __builtin_ctz(tags) != __builtin_ctz(client->tags);
+    client->tags = tags;
+    if (is_desktop_changed == true) {
+        client_publish_desktop(client);
+    }
+    monitor_update_tags(client->monitor);
+    ipc_broadcast("tag 0x%x %u", client->window, tags);
+}
+
+void client_toggle_tag(struct client *const client, uint16_t tags)
+{
+    client_tag(client, client->tags ^ tags);
+}
+
+int monitor_append_client(struct monitor *monitor, struct client *client)
+{
+    if (client_table_insert(&global_client_table, client->window, client) != 0) {
+        return 1;
+    }
+    list_append(&monitor->clients, &client->list_node);
+    list_append(&monitor->focus_stack, &client->focus_node);
+    ++monitor->clients_num;
+    client->monitor = monitor;
+    return 0;
+}
+
+// Focus only changes state here, focus_publish() tells the X server once per batch. Focusing a
+// client is what clears its urgency.
+void monitor_focus_client(struct monitor *const monitor, struct client *const client)
+{
+    monitor->focused_client = client;
+    client->is_urgent = false;
+    if (monitor->focus_stack != &client->focus_node) {
+        list_remove(&monitor->focus_stack, &client->focus_node);
+        list_prepend(&monitor->focus_stack, &client->focus_node);
+    }
+}
+
+void monitor_focus(struct monitor *const monitor)
+{
+    global_focused_monitor = monitor;
+}
+
+void monitor_remove_client(struct monitor *monitor, struct client *client)
+{
+    list_remove(&monitor->clients, &client->list_node);
+    list_remove(&monitor->focus_stack, &client->focus_node);
+    --monitor->clients_num;
+    client_table_remove(&global_client_table, client->window);
+    if (client == monitor->focused_client) {
+        monitor->focused_client = monitor_focus_fallback(monitor);
+    }
+}
+
+struct client *get_client_by_win(xcb_window_t window)
+{
+    return client_table_find(&global_client_table, window);
+}
+
+void sync_waits_remove(uint64_t idx)
+{
+    global_sync_waits[idx] = global_sync_waits[--global_sync_waits_num];
+}
+
+// Clients that haven't repainted in time are resized regardless, so a hung client can't hold its
+// geometry forever.
+void sync_waits_expire(uint64_t now_ns)
+{
+    // client_sync_done() may append new waits, which the loop then just keeps.
+    uint64_t i = 0;
+    while (i < global_sync_waits_num) {
+        struct client *client = get_client_by_win(global_sync_waits[i]);
+        if (client == NULL || client->is_waiting_sync == false) {
+            sync_waits_remove(i);
+            continue;
+        }
+        if (client->sync_deadline_ns > now_ns) {
+            ++i;
+            continue;
+        }
+        sync_waits_remove(i);
+        client_sync_done(client);
+    }
+}
+
+// The epoll timeout until the first sync deadline, or -1 if nothing is waiting.
+int sync_waits_timeout_ms(void)
+{
+    if (global_sync_waits_num == 0) {
+        return -1;
+    }
+    uint64_t now_ns = monotonic_now_ns();
+    uint64_t deadline_ns = UINT64_MAX;
+    for (uint64_t i = 0; i < global_sync_waits_num; ++i) {
+        struct client *client = get_client_by_win(global_sync_waits[i]);
+        if (client != NULL && client->is_waiting_sync == true) {
+            deadline_ns = min(deadline_ns, client->sync_deadline_ns);
+        }
+    }
+    if (deadline_ns <= now_ns) {
+        return 0;
+    }
+    return deadline_ns == UINT64_MAX ? 0 : (deadline_ns - now_ns + 999999) / 1000000;
+}
+
+void client_enable_fullscreen(struct client *const client)
+{
+    struct monitor *monitor = client->monitor;
+    if (client->is_fullscreen == false) {
+        client->unfullscreen_box = client->box;
+        client->was_floating = client->is_floating;
+    }
+    client->is_fullscreen = true;
+    client->is_floating = true;
+    client_move_resize(client, monitor->box.x, monitor->box.y, monitor->box.width,
+                       monitor->box.height);
+}
+
+// Floating clients go back to where they were, tiled ones take their place in the next arrange.
+void client_disable_fullscreen(struct client *const client)
+{
+    client->is_fullscreen = false;
+    client->is_floating = client->was_floating;
+    if (client->is_floating == true) {
+        client_set_box(client, client->unfullscreen_box);
+    } else {
+        client->monitor->needs_arrange = true;
+    }
+}
+
+// Properties the WM caches per client. A PropertyNotify only marks its property dirty and every
+// dirty property is refetched once at the end of the event batch, so a client that retitles itself
+// a thousand times per batch still costs a single GetProperty. Replies are polled, never waited on.
+enum {
+    PROPERTY_NET_WM_NAME = 1 << 0,
+    PROPERTY_WM_NAME = 1 << 1,
+    PROPERTY_WM_CLASS = 1 << 2,
+    PROPERTY_WM_HINTS = 1 << 3,
+    PROPERTY_WM_NORMAL_HINTS = 1 << 4,
+    PROPERTY_WM_PROTOCOLS = 1 << 5,
+    PROPERTY_SYNC_REQUEST_COUNTER = 1 << 6,
+    PROPERTY_NET_WM_PID = 1 << 7,
+    PROPERTY_NET_WM_ICON = 1 << 8,
+    PROPERTY_END = 1 << 9
+};
+
+#define PROPERTY_NAMES (PROPERTY_NET_WM_NAME | PROPERTY_WM_NAME)
+// Properties nothing but IPC and the bar reads, fetched by the metadata worker when it runs.
+#define PROPERTY_METADATA \
+    (PROPERTY_NAMES | PROPERTY_WM_CLASS | PROPERTY_NET_WM_PID | PROPERTY_NET_WM_ICON)
+
+struct property_fetch {
+    xcb_window_t window;
+    uint16_t property;
+    xcb_get_property_cookie_t cookie;
+};
+
+struct property_counters {
+    uint64_t notifies;
+    uint64_t fetches_sent;
+};
+
+static struct property_counters global_property_counters = {0};
+
+// A client is listed here exactly while its dirty_properties is non-zero.
+static xcb_window_t *global_dirty_windows = NULL;
+static uint64_t global_dirty_windows_num = 0;
+static uint64_t global_dirty_windows_capacity = 0;
+
+// Fetches in request order, global_property_fetches_head is the oldest one without a reply yet.
+static struct property_fetch *global_property_fetches = NULL;
+static uint64_t global_property_fetches_head = 0;
+static uint64_t global_property_fetches_num = 0;
+static uint64_t global_property_fetches_capacity = 0;
+
+void client_mark_properties(struct client *const client, uint16_t properties)
+{
+    if (client->dirty_properties == 0) {
+        if (global_dirty_windows_num == global_dirty_windows_capacity) {
+            uint64_t new_capacity =
+                global_dirty_windows_capacity == 0 ? 16 : global_dirty_windows_capacity * 2;
+            xcb_window_t *new_dirty_windows = (xcb_window_t *)realloc(
+                global_dirty_windows, new_capacity * sizeof(xcb_window_t));
+            if (new_dirty_windows == NULL) {
+                fprintf(stderr, "Can't queue property refresh!\n");
+                return;
+            }
+            global_dirty_windows = new_dirty_windows;
+            global_dirty_windows_capacity = new_capacity;
+        }
+        global_dirty_windows[global_dirty_windows_num++] = client->window;
+    }
+    client->dirty_properties |= properties;
+}
+
+int property_fetch_send(xcb_window_t window, uint16_t property)
+{
+    if (global_property_fetches_num == global_property_fetches_capacity) {
+        uint64_t new_capacity =
+            global_property_fetches_capacity == 0 ? 16 : global_property_fetches_capacity * 2;
+        struct property_fetch *new_property_fetches = (struct property_fetch *)realloc(
+            global_property_fetches, new_capacity * sizeof(struct property_fetch));
+        if (new_property_fetches == NULL) {
+            fprintf(stderr, "Can't queue property fetch!\n");
+            return 1;
+        }
+        global_property_fetches = new_property_fetches;
+        global_property_fetches_capacity = new_capacity;
+    }
+    struct property_fetch *fetch = &global_property_fetches[global_property_fetches_num++];
+    fetch->window = window;
+    fetch->property = property;
+    switch (property) {
+    case PROPERTY_NET_WM_NAME:
+        fetch->cookie = xcb_ewmh_get_wm_name(global_ewmh_connection, window);
+        break;
+    case PROPERTY_WM_NAME:
+        fetch->cookie = xcb_icccm_get_wm_name(global_xconnection, window);
+        break;
+    case PROPERTY_WM_CLASS:
+        fetch->cookie = xcb_icccm_get_wm_class(global_xconnection, window);
+        break;
+    case PROPERTY_WM_HINTS:
+        fetch->cookie = xcb_icccm_get_wm_hints(global_xconnection, window);
+        break;
+    case PROPERTY_WM_NORMAL_HINTS:
+        fetch->cookie = xcb_icccm_get_wm_normal_hints(global_xconnection, window);
+        break;
+    case PROPERTY_WM_PROTOCOLS:
+        fetch->cookie =
+            xcb_icccm_get_wm_protocols(global_xconnection, window, global_wm_atoms[WM_PROTOCOLS]);
+        break;
+    case PROPERTY_SYNC_REQUEST_COUNTER:
+        fetch->cookie = xcb_get_property(global_xconnection, 0, window,
+                                         global_ewmh_connection->_NET_WM_SYNC_REQUEST_COUNTER,
+                                         XCB_ATOM_CARDINAL, 0, 1);
+        break;
+    case PROPERTY_NET_WM_PID:
+        fetch->cookie = xcb_get_property(global_xconnection, 0, window,
+                                         global_ewmh_connection->_NET_WM_PID, XCB_ATOM_CARDINAL, 0,
+                                         1);
+        break;
+    case PROPERTY_NET_WM_ICON:
+        fetch->cookie = xcb_get_property(global_xconnection, 0, window,
+                                         global_ewmh_connection->_NET_WM_ICON, XCB_ATOM_CARDINAL, 0,
+                                         ICON_PROPERTY_LENGTH_MAX);
+        break;
+    }
+    ++global_property_counters.fetches_sent;
+    return 0;
+}
+
+void copy_property_string(char *const destination, uint64_t size,
+                          const xcb_get_property_reply_t *const reply)
+{
+    uint64_t length = 0;
+    if (reply != NULL) {
+        length = min((uint64_t)xcb_get_property_value_length(reply), size - 1);
+        memcpy(destination, xcb_get_property_value(reply), length);
+    }
+    destination[length] = '\0';
+}
+
+// Picks the smallest icon that is at least ICON_SIZE wide and tall, or the largest one if all are
+// smaller, and scales it to ICON_SIZE squared by nearest neighbour.
+void copy_property_icon(struct client_properties *const properties,
+                        const xcb_get_property_reply_t *const reply)
+{
+    properties->has_icon = false;
+    if (reply == NULL || reply->format != 32) {
+        return;
+    }
+    const uint32_t *data = (const uint32_t *)xcb_get_property_value(reply);
+    uint64_t data_num = xcb_get_property_value_length(reply) / sizeof(uint32_t);
+    const uint32_t *best = NULL;
+    uint64_t best_area = 0;
+    for (uint64_t i = 0; i + 2 <= data_num;) {
+        uint64_t width = data[i];
+        uint64_t height = data[i + 1];
+        uint64_t area = width * height;
+        if (width == 0 || height == 0 || area > data_num - i - 2) {
+            break;
+        }
+        bool is_large = width >= ICON_SIZE && height >= ICON_SIZE;
+        bool is_best_large = best != NULL && best[0] >= ICON_SIZE && best[1] >= ICON_SIZE;
+        if (best == NULL || (is_large == true && (is_best_large == false || area < best_area)) ||
+            (is_large == false && is_best_large == false && area > best_area)) {
+            best = &data[i];
+            best_area = area;
+        }
+        i += 2 + area;
+    }
+    if (best == NULL) {
+        return;
+    }
+    for (uint32_t y = 0; y < ICON_SIZE; ++y) {
+        for (uint32_t x = 0; x < ICON_SIZE; ++x) {
+            properties->icon[y * ICON_SIZE + x] =
+                best[2 + (uint64_t)y * best[1] / ICON_SIZE * best[0] + x * best[0] / ICON_SIZE];
+        }
+    }
+    properties->has_icon = true;
+}
+
+// Parses the metadata properties that don't depend on other state, shared by the main connection
+// and the metadata worker.
+void copy_property_metadata(struct client_properties *const properties, uint16_t property,
+                            xcb_get_property_reply_t *const reply)
+{
+    switch (property) {
+    case PROPERTY_WM_CLASS: {
+        xcb_icccm_get_wm_class_reply_t wm_class;
+        properties->instance_name[0] = '\0';
+        properties->class_name[0] = '\0';
+        // The parsed class points into the reply, which the caller frees.
+        if (reply != NULL && xcb_icccm_get_wm_class_from_reply(&wm_class, reply) != 0) {
+            snprintf(properties->instance_name, sizeof(properties->instance_name), "%s",
+                     wm_class.instance_name);
+            snprintf(properties->class_name, sizeof(properties->class_name), "%s",
+                     wm_class.class_name);
+        }
+        break;
+    }
+    case PROPERTY_NET_WM_PID:
+        properties->pid = 0;
+        if (reply != NULL && reply->type == XCB_ATOM_CARDINAL && reply->format == 32 &&
+            xcb_get_property_value_length(reply) >= sizeof(uint32_t)) {
+            properties->pid = *(uint32_t *)xcb_get_property_value(reply);
+        }
+        break;
+    case PROPERTY_NET_WM_ICON:
+        copy_property_icon(properties, reply);
+        break;
+    }
+}
+
+// An empty reply means the property was deleted, so the cached value is reset.
+void client_apply_property(struct client *const client, uint16_t property,
+                           xcb_get_property_reply_t *const reply)
+{
+    struct client_properties *properties = client_properties(client);
+    switch (property) {
+    case PROPERTY_NET_WM_NAME:
+        properties->has_net_wm_name = reply != NULL && xcb_get_property_value_length(reply) > 0;
+        if (properties->has_net_wm_name == false) {
+            client_mark_properties(client, PROPERTY_WM_NAME);
+            break;
+        }
+        copy_property_string(properties->name, sizeof(properties->name), reply);
+        break;
+    case PROPERTY_WM_NAME:
+        if (properties->has_net_wm_name == false) {
+            copy_property_string(properties->name, sizeof(properties->name), reply);
+        }
+        break;
+    case PROPERTY_WM_CLASS:
+    case PROPERTY_NET_WM_PID:
+        copy_property_metadata(properties, property, reply);
+        break;
+    case PROPERTY_NET_WM_ICON:
+        copy_property_metadata(properties, property, reply);
+        ++properties->icon_serial;
+        break;
+    case PROPERTY_WM_HINTS: {
+        xcb_icccm_wm_hints_t wm_hints = {0};
+        if (reply != NULL) {
+            xcb_icccm_get_wm_hints_from_reply(&wm_hints, reply);
+        }
+        client->is_urgent = wm_hints.flags & XCB_ICCCM_WM_HINT_X_URGENCY;
+        client->never_focus = (wm_hints.flags & XCB_ICCCM_WM_HINT_INPUT) && wm_hints.input == 0;
+        break;
+    }
+    case PROPERTY_WM_NORMAL_HINTS: {
+        xcb_size_hints_t size_hints = {0};
+        if (reply != NULL) {
+            xcb_icccm_get_wm_size_hints_from_reply(&size_hints, reply);
+        }
+        client_set_size_hints(client, &size_hints);
+        client->monitor->needs_arrange = true;
+        break;
+    }
+    case PROPERTY_WM_PROTOCOLS: {
+        xcb_icccm_get_wm_protocols_reply_t protocols;
+        bool supports_sync_request = false;
+        client->supports_take_focus = false;
+        // The parsed protocols point into the reply, which the caller frees.
+        if (reply != NULL && xcb_icccm_get_wm_protocols_from_reply(reply, &protocols) != 0) {
+            for (uint32_t i = 0; i < protocols.atoms_len; ++i) {
+                if (protocols.atoms[i] == global_ewmh_connection->_NET_WM_SYNC_REQUEST) {
+                    supports_sync_request = true;
+                }
+                if (protocols.atoms[i] == global_wm_atoms[WM_TAKE_FOCUS]) {
+                    client->supports_take_focus = true;
+                }
+            }
+        }
+        if (supports_sync_request != client->supports_sync_request) {
+            client->supports_sync_request = supports_sync_request;
+            client_update_sync(client);
+        }
+        break;
+    }
+    case PROPERTY_SYNC_REQUEST_COUNTER: {
+        xcb_sync_counter_t sync_counter = XCB_NONE;
+        if (reply != NULL && reply->type == XCB_ATOM_CARDINAL && reply->format == 32 &&
+            xcb_get_property_value_length(reply) >= sizeof(uint32_t)) {
+            sync_counter = *(uint32_t *)xcb_get_property_value(reply);
+        }
+        if (sync_counter != client->sync_counter) {
+            client->sync_counter = sync_counter;
+            client_update_sync(client);
+        }
+        break;
+    }
+    }
+}
+
+// Ring indices for one producer and one consumer thread. Only the producer writes tail and only the
+// consumer writes head, each on its own cache line, so neither side takes a lock. Slots live in a
+// separate array of mask + 1 elements, which must be a power of two.
+struct spsc_ring {
+    _Alignas(64) _Atomic uint32_t head;
+    _Alignas(64) _Atomic uint32_t tail;
+    uint32_t mask;
+};
+
+static inline bool spsc_ring_reserve(struct spsc_ring *const ring, uint32_t *const slot)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail - atomic_load_explicit(&ring->head, memory_order_acquire) > ring->mask) {
+        return false;
+    }
+    *slot = tail & ring->mask;
+    return true;
+}
+
+static inline void spsc_ring_push(struct spsc_ring *const ring)
+{
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+static inline bool spsc_ring_peek(struct spsc_ring *const ring, uint32_t *const slot)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head == atomic_load_explicit(&ring->tail, memory_order_acquire)) {
+        return false;
+    }
+    *slot = head & ring->mask;
+    return true;
+}
+
+static inline void spsc_ring_pop(struct spsc_ring *const ring)
+{
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+#define METADATA_REQUESTS_NUM (1024)
+#define METADATA_RECORDS_NUM (128)
+#define METADATA_BATCH_SIZE (64)
+
+struct metadata_request {
+    xcb_window_t window;
+    uint16_t properties;
+};
+
+// requested is cleared from the client's fetching_properties, values are only copied for the
+// properties in fetched. They differ when the worker lost its connection.
+struct metadata_record {
+    xcb_window_t window;
+    uint16_t requested;
+    uint16_t fetched;
+    struct client_properties values;
+};
+
+struct metadata_counters {
+    uint64_t requests;
+    uint64_t requests_deferred;
+    uint64_t records;
+    uint64_t batches;
+};
+
+static struct metadata_counters global_metadata_counters = {0};
+
+// Metadata is fetched by a worker thread over a connection of its own, so a slow reply such as a
+// large _NET_WM_ICON over a remote display never holds up events on global_xconnection. Requests go
+// to the worker through one ring and records come back through another. The worker sleeps on
+// global_metadata_request_fd and wakes the event loop through global_metadata_record_fd once per
+// batch. Without a worker global_metadata_properties is 0 and everything goes through
+// property_fetch_send().
+static struct metadata_request global_metadata_requests[METADATA_REQUESTS_NUM];
+static struct spsc_ring global_metadata_request_ring = {.mask = METADATA_REQUESTS_NUM - 1};
+static struct metadata_record global_metadata_records[METADATA_RECORDS_NUM];
+static struct spsc_ring global_metadata_record_ring = {.mask = METADATA_RECORDS_NUM - 1};
+static xcb_connection_t *global_metadata_connection = NULL;
+static pthread_t global_metadata_thread;
+static int global_metadata_request_fd = -1;
+static int global_metadata_record_fd = -1;
+static atomic_bool global_metadata_worker_running = false;
+static uint16_t global_metadata_properties = 0;
+static bool global_has_metadata_requests = false;
+
+int metadata_request_send(xcb_window_t window, uint16_t properties)
+{
+    uint32_t slot = 0;
+    if (spsc_ring_reserve(&global_metadata_request_ring, &slot) == false) {
+        // The properties stay dirty and are asked for again once records have come back.
+        ++global_metadata_counters.requests_deferred;
+        return 1;
+    }
+    global_metadata_requests[slot] = (struct metadata_request){window, properties};
+    spsc_ring_push(&global_metadata_request_ring);
+    ++global_metadata_counters.requests;
+    global_has_metadata_requests = true;
+    return 0;
+}
+
+void metadata_worker_wake(void)
+{
+    // On failure the requests stay flagged and the next batch tries again.
+    if (global_has_metadata_requests == true &&
+        counter_fd_add(global_metadata_request_fd, 1) == 0) {
+        global_has_metadata_requests = false;
+    }
+}
+
+// Waits for a free record slot, waking the event loop so it drains the ring in the meantime.
+bool metadata_worker_reserve(uint32_t *const slot)
+{
+    while (spsc_ring_reserve(&global_metadata_record_ring, slot) == false) {
+        if (atomic_load(&global_metadata_worker_running) == false) {
+            return false;
+        }
+        // Best effort, a missed wakeup only costs another millisecond of waiting.
+        counter_fd_add(global_metadata_record_fd, 1);
+        struct timespec pause = {.tv_sec = 0, .tv_nsec = 1000000};
+        nanosleep(&pause, NULL);
+    }
+    return true;
+}
+
+// Sends the requests of a whole batch before waiting on any reply, so the batch costs one round
+// trip. Replies are waited on here, which is the point of having a thread for them.
+void metadata_worker_fetch(const struct metadata_request *const requests, uint32_t requests_num)
+{
+    xcb_connection_t *connection = global_metadata_connection;
+    xcb_get_property_cookie_t cookies[METADATA_BATCH_SIZE][5];
+    enum { NET_WM_NAME, WM_NAME, WM_CLASS, NET_WM_PID, NET_WM_ICON };
+    for (uint32_t i = 0; i < requests_num; ++i) {
+        xcb_window_t window = requests[i].window;
+        uint16_t properties = requests[i].properties;
+        memset(cookies[i], 0, sizeof(cookies[i]));
+        if (properties & PROPERTY_NAMES) {
+            cookies[i][NET_WM_NAME] =
+                xcb_get_property(connection, 0, window, global_ewmh_connection->_NET_WM_NAME,
+                                 global_ewmh_connection->UTF8_STRING, 0, 64);
+            cookies[i][WM_NAME] = xcb_get_property(connection, 0, window, XCB_ATOM_WM_NAME,
+                                                   XCB_GET_PROPERTY_TYPE_ANY, 0, 64);
+        }
+        if (properties & PROPERTY_WM_CLASS) {
+            cookies[i][WM_CLASS] = xcb_icccm_get_wm_class(connection, window);
+        }
+        if (properties & PROPERTY_NET_WM_PID) {
+            cookies[i][NET_WM_PID] =
+                xcb_get_property(connection, 0, window, global_ewmh_connection->_NET_WM_PID,
+                                 XCB_ATOM_CARDINAL, 0, 1);
+        }
+        if (properties & PROPERTY_NET_WM_ICON) {
+            cookies[i][NET_WM_ICON] =
+                xcb_get_property(connection, 0, window, global_ewmh_connection->_NET_WM_ICON,
+                                 XCB_ATOM_CARDINAL, 0, ICON_PROPERTY_LENGTH_MAX);
+        }
+    }
+    xcb_flush(connection);
+
+    for (uint32_t i = 0; i < requests_num; ++i) {
+        uint32_t slot = 0;
+        if (metadata_worker_reserve(&slot) == false) {
+            return;
+        }
+        struct metadata_record *record = &global_metadata_records[slot];
+        record->window = requests[i].window;
+        record->requested = requests[i].properties;
+        record->fetched = xcb_connection_has_error(connection) ? 0 : requests[i].properties;
+        for (uint32_t j = 0; j < 5; ++j) {
+            if (cookies[i][j].sequence == 0) {
+                continue;
+            }
+            // A window destroyed in the meantime yields an error and no reply, which resets the
+            // values just like a deleted property.
+            xcb_get_property_reply_t *reply =
+                xcb_get_property_reply(connection, cookies[i][j], NULL);
+            switch (j) {
+            case NET_WM_NAME:
+                record->values.has_net_wm_name =
+                    reply != NULL && xcb_get_property_value_length(reply) > 0;
+                copy_property_string(record->values.name, sizeof(record->values.name), reply);
+                break;
+            case WM_NAME:
+                if (record->values.has_net_wm_name == false) {
+                    copy_property_string(record->values.name, sizeof(record->values.name), reply);
+                }
+                break;
+            case WM_CLASS:
+                copy_property_metadata(&record->values, PROPERTY_WM_CLASS, reply);
+                break;
+            case NET_WM_PID:
+                copy_property_metadata(&record->values, PROPERTY_NET_WM_PID, reply);
+                break;
+            case NET_WM_ICON:
+                copy_property_metadata(&record->values, PROPERTY_NET_WM_ICON, reply);
+                break;
+            }
+            free(reply);
+        }
+        spsc_ring_push(&global_metadata_record_ring);
+    }
+}
+
+void *metadata_worker_run(void *argument)
+{
+    struct metadata_request requests[METADATA_BATCH_SIZE];
+    bool has_reported_error = false;
+    while (atomic_load(&global_metadata_worker_running) == true) {
+        uint64_t value = 0;
+        if (counter_fd_read(global_metadata_request_fd, &value) != 0) {
+            fprintf(stderr, "Can't wait for metadata requests!\n");
+            break;
+        }
+        uint32_t requests_num = 0;
+        uint32_t slot = 0;
+        while (atomic_load(&global_metadata_worker_running) == true) {
+            bool has_request = spsc_ring_peek(&global_metadata_request_ring, &slot);
+            if (has_request == true) {
+                requests[requests_num++] = global_metadata_requests[slot];
+                spsc_ring_pop(&global_metadata_request_ring);
+            }
+            if (requests_num == 0) {
+                break;
+            }
+            if (has_request == true && requests_num < METADATA_BATCH_SIZE) {
+                continue;
+            }
+            metadata_worker_fetch(requests, requests_num);
+            requests_num = 0;
+            if (counter_fd_add(global_metadata_record_fd, 1) != 0) {
+                fprintf(stderr, "Can't wake the event loop for metadata records!\n");
+            }
+        }
+        if (xcb_connection_has_error(global_metadata_connection) && has_reported_error == false) {
+            has_reported_error = true;
+            fprintf(stderr, "Lost metadata connection to X Server!\n");
+        }
+    }
+    return NULL;
+}
+
+int metadata_worker_start(void)
+{
+    global_metadata_connection = global_x11_connect(NULL, NULL);
+    if (xcb_connection_has_error(global_metadata_connection)) {
+        fprintf(stderr, "Can't open metadata connection to X Server!\n");
+        goto ERROR;
+    }
+    global_metadata_request_fd = eventfd(0, EFD_CLOEXEC);
+    global_metadata_record_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (global_metadata_request_fd < 0 || global_metadata_record_fd < 0) {
+        fprintf(stderr, "Can't create metadata eventfd!\n");
+        goto ERROR;
+    }
+    atomic_store(&global_metadata_worker_running, true);
+    if (pthread_create(&global_metadata_thread, NULL, metadata_worker_run, NULL) != 0) {
+        fprintf(stderr, "Can't start metadata worker!\n");
+        atomic_store(&global_metadata_worker_running, false);
+        goto ERROR;
+    }
+    global_metadata_properties = PROPERTY_METADATA;
+    return 0;
+
+ERROR:
+    xcb_disconnect(global_metadata_connection);
+    global_metadata_connection = NULL;
+    return 1;
+}
+
+void metadata_worker_stop(void)
+{
+    if (global_metadata_properties != 0) {
+        global_metadata_properties = 0;
+        atomic_store(&global_metadata_worker_running, false);
+        if (counter_fd_add(global_metadata_request_fd, 1) != 0) {
+            fprintf(stderr, "Can't wake metadata worker, waiting for it anyway!\n");
+        }
+        pthread_join(global_metadata_thread, NULL);
+        xcb_disconnect(global_metadata_connection);
+        global_metadata_connection = NULL;
+    }
+    if (global_metadata_request_fd >= 0) {
+        close(global_metadata_request_fd);
+        global_metadata_request_fd = -1;
+    }
+    if (global_metadata_record_fd >= 0) {
+        close(global_metadata_record_fd);
+        global_metadata_record_fd = -1;
+    }
+}
+
+void client_apply_metadata(struct client *const client, const struct metadata_record *const record)
+{
+    struct client_properties *properties = client_properties(client);
+    if (record->fetched & PROPERTY_NAMES) {
+        properties->has_net_wm_name = record->values.has_net_wm_name;
+        memcpy(properties->name, record->values.name, sizeof(properties->name));
+    }
+    if (record->fetched & PROPERTY_WM_CLASS) {
+        memcpy(properties->instance_name, record->values.instance_name,
+               sizeof(properties->instance_name));
+        memcpy(properties->class_name, record->values.class_name, sizeof(properties->class_name));
+    }
+    if (record->fetched & PROPERTY_NET_WM_PID) {
+        properties->pid = record->values.pid;
+    }
+    if (record->fetched & PROPERTY_NET_WM_ICON) {
+        properties->has_icon = record->values.has_icon;
+        memcpy(properties->icon, record->values.icon, sizeof(properties->icon));
+        ++properties->icon_serial;
+    }
+}
+
+// The worker lost its connection, so metadata goes through the main connection from now on. Both
+// rings are dropped after the worker is joined, and whatever was still being fetched is marked
+// dirty again.
+void metadata_worker_fall_back(void)
+{
+    uint16_t metadata = global_metadata_properties;
+    metadata_worker_stop();
+    uint32_t slot = 0;
+    while (spsc_ring_peek(&global_metadata_request_ring, &slot) == true) {
+        spsc_ring_pop(&global_metadata_request_ring);
+    }
+    while (spsc_ring_peek(&global_metadata_record_ring, &slot) == true) {
+        spsc_ring_pop(&global_metadata_record_ring);
+    }
+    global_has_metadata_requests = false;
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        struct monitor *monitor = container_of(cursor, struct monitor, list_node);
+        for (struct list_node *node = monitor->clients; node != NULL; node = node->next) {
+            struct client *client = container_of(node, struct client, list_node);
+            uint16_t fetching = client->fetching_properties & metadata;
+            if (fetching != 0) {
+                client->fetching_properties &= ~fetching;
+                client_mark_properties(client, fetching);
+            }
+        }
+    }
+}
+
+// Applies every record the worker has finished since the last wakeup.
+void handle_metadata_records(void)
+{
+    TRACE_SCOPE("handle_metadata_records");
+    // Records pushed after an earlier drain have no wakeup of their own left, so the ring is
+    // drained even when there's nothing to read.
+    uint64_t value = 0;
+    if (counter_fd_read(global_metadata_record_fd, &value) != 0 && errno != EAGAIN) {
+        fprintf(stderr, "Can't read metadata wakeup!\n");
+    }
+    bool has_failed = false;
+    uint32_t slot = 0;
+    while (spsc_ring_peek(&global_metadata_record_ring, &slot) == true) {
+        const struct metadata_record *record = &global_metadata_records[slot];
+        // The window may have been destroyed while the request was with the worker.
+        struct client *client = get_client_by_win(record->window);
+        if (client != NULL) {
+            client->fetching_properties &= ~record->requested;
+            client_apply_metadata(client, record);
+            if (record->fetched != record->requested) {
+                client_mark_properties(client, record->requested & ~record->fetched);
+            }
+        }
+        has_failed |= record->fetched != record->requested;
+        spsc_ring_pop(&global_metadata_record_ring);
+        ++global_metadata_counters.records;
+    }
+    ++global_metadata_counters.batches;
+    if (global_metadata_properties != 0 &&
+        (has_failed == true || xcb_connection_has_error(global_metadata_connection))) {
+        fprintf(stderr, "Fetching metadata on the main connection from now on!\n");
+        metadata_worker_fall_back();
+    }
+}
+
+// Replies arrive in request order, so polling stops at the first fetch still in flight.
+void property_fetches_poll(void)
+{
+    TRACE_SCOPE("property_fetches_poll");
+    while (global_property_fetches_head < global_property_fetches_num) {
+        struct property_fetch *fetch = &global_property_fetches[global_property_fetches_head];
+        xcb_get_property_reply_t *reply = NULL;
+        xcb_generic_error_t *error = NULL;
+        if (xcb_poll_for_reply(global_xconnection, fetch->cookie.sequence, (void **)&reply,
+                               &error) == 0) {
+            break;
+        }
+        ++global_property_fetches_head;
+        free(error);
+        // The window may have been destroyed while the fetch was in flight.
+        struct client *client = get_client_by_win(fetch->window);
+        if (client != NULL) {
+            client->fetching_properties &= ~fetch->property;
+            client_apply_property(client, fetch->property, reply);
+        }
+        free(reply);
+    }
+    if (global_property_fetches_head == global_property_fetches_num) {
+        global_property_fetches_head = 0;
+        global_property_fetches_num = 0;
+    }
+}
+
+// Sends one fetch per dirty property. A property whose previous fetch is still in flight stays
+// dirty until that reply is in, so a busy client never has more than one fetch per property queued.
+void client_properties_refresh(void)
+{
+    TRACE_SCOPE("client_properties_refresh");
+    uint64_t kept_num = 0;
+    for (uint64_t i = 0; i < global_dirty_windows_num; ++i) {
+        struct client *client = get_client_by_win(global_dirty_windows[i]);
+        if (client == NULL || client->dirty_properties == 0) {
+            continue;
+        }
+        uint16_t properties = client->dirty_properties & ~client->fetching_properties;
+        uint16_t metadata = properties & global_metadata_properties;
+        if (metadata != 0) {
+            // The worker resolves both names at once, so one dirty name refetches the other.
+            metadata |= (metadata & PROPERTY_NAMES) != 0 ? PROPERTY_NAMES : 0;
+            if (metadata_request_send(client->window, metadata) != 0) {
+                metadata = 0;
+            }
+            properties = (properties & ~global_metadata_properties) | metadata;
+        }
+        for (uint16_t property = 1; property < PROPERTY_END; property <<= 1) {
+            if ((properties & property) == 0 || (property & global_metadata_properties) != 0) {
+                continue;
+            }
+            if (property_fetch_send(client->window, property) != 0) {
+                properties &= ~property;
+            }
+        }
+        client->fetching_properties |= properties;
+        client->dirty_properties &= ~properties;
+        if (client->dirty_properties != 0) {
+            global_dirty_windows[kept_num++] = client->window;
+        }
+    }
+    global_dirty_windows_num = kept_num;
+    metadata_worker_wake();
+}
+
+// Mirrors of the EWMH root properties. The client list is in mapping order, the stacking list
+// from bottom to top, and both hold the same windows. Windows mapped during a batch go on top and
+// are appended to the root properties, a removal rewrites both and a raise only the stacking list.
+// Either happens at most once per batch in ewmh_publish().
+static xcb_window_t *global_client_list = NULL;
+static xcb_window_t *global_client_stacking = NULL;
+static uint64_t global_client_list_num = 0;
+static uint64_t global_client_list_capacity = 0;
+static uint64_t global_client_list_published_num = 0;
+static bool global_client_list_outdated = false;
+static bool global_client_stacking_outdated = false;
+static xcb_window_t global_published_active_window = XCB_NONE;
+// The client with the focused border and the input focus, as far as the X server was told.
+static xcb_window_t global_published_focus = XCB_NONE;
+static uint32_t global_published_current_desktop = UINT32_MAX;
+static xcb_window_t global_supporting_window = XCB_NONE;
+
+struct ewmh_counters {
+    uint64_t appends;
+    uint64_t rewrites;
+    uint64_t restacks;
+    uint64_t windows_written;
+};
+
+static struct ewmh_counters global_ewmh_counters = {0};
+
+int client_list_add(xcb_window_t window)
+{
+    if (global_client_list_num == global_client_list_capacity) {
+        uint64_t new_capacity =
+            global_client_list_capacity == 0 ? 64 : global_client_list_capacity * 2;
+        xcb_window_t *new_client_list =
+            (xcb_window_t *)realloc(global_client_list, new_capacity * sizeof(xcb_window_t));
+        if (new_client_list != NULL) {
+            global_client_list = new_client_list;
+        }
+        xcb_window_t *new_client_stacking =
+            (xcb_window_t *)realloc(global_client_stacking, new_capacity * sizeof(xcb_window_t));
+        if (new_client_stacking != NULL) {
+            global_client_stacking = new_client_stacking;
+        }
+        if (new_client_list == NULL || new_client_stacking == NULL) {
+            fprintf(stderr, "Can't grow client list!\n");
+            return 1;
+        }
+        global_client_list_capacity = new_capacity;
+    }
+    global_client_stacking[global_client_list_num] = window;
+    global_client_list[global_client_list_num++] = window;
+    ipc_broadcast("manage 0x%x", window);
+    return 0;
+}
+
+// Returns the index of window in windows, or windows_num if it isn't there.
+static inline uint64_t window_find(const xcb_window_t *const windows, uint64_t windows_num,
+                                   xcb_window_t window)
+{
+    uint64_t i = 0;
+    while (i < windows_num && windows[i] != window) {
+        ++i;
+    }
+    return i;
+}
+
+void client_list_remove(xcb_window_t window)
+{
+    uint64_t i = window_find(global_client_list, global_client_list_num, window);
+    if (i == global_client_list_num) {
+        return;
+    }
+    memmove(&global_client_list[i], &global_client_list[i + 1],
+            (global_client_list_num - i - 1) * sizeof(xcb_window_t));
+    i = window_find(global_client_stacking, global_client_list_num, window);
+    memmove(&global_client_stacking[i], &global_client_stacking[i + 1],
+            (global_client_list_num - i - 1) * sizeof(xcb_window_t));
+    --global_client_list_num;
+    global_client_list_outdated = true;
+    global_client_stacking_outdated = true;
+    ipc_broadcast("unmanage 0x%x", window);
+}
+
+// Called for every ConfigureWindow that puts a managed window above all others.
+void client_list_raise(xcb_window_t window)
+{
+    uint64_t i = window_find(global_client_stacking, global_client_list_num, window);
+    if (i + 1 >= global_client_list_num) {
+        return;
+    }
+    memmove(&global_client_stacking[i], &global_client_stacking[i + 1],
+            (global_client_list_num - i - 1) * sizeof(xcb_window_t));
+    global_client_stacking[global_client_list_num - 1] = window;
+    global_client_stacking_outdated = true;
+}
+
+void client_list_publish(xcb_atom_t atom, uint8_t mode, const xcb_window_t *const windows,
+                         uint64_t windows_num)
+{
+    xcb_change_property(global_xconnection, mode, global_screen->root, atom, XCB_ATOM_WINDOW, 32,
+                        windows_num, windows);
+    global_ewmh_counters.windows_written += windows_num;
+}
+
+// Brings the root properties up to date with everything the batch changed.
+struct focus_counters {
+    uint64_t changes;
+    uint64_t enters_handled;
+    uint64_t enters_suppressed;
+};
+
+static struct focus_counters global_focus_counters = {0};
+
+// EnterNotify carries the sequence number of the last request the server had processed. A
+// NoOperation sent after every batch that configured windows splits crossings caused by those
+// configures, which come before it, from the pointer moving afterwards, without a round trip.
+static uint32_t global_focus_barrier_sequence = 0;
+static uint64_t global_focus_barrier_configures = 0;
+
+void focus_barrier_update(void)
+{
+    if (global_configure_counters.sent != global_focus_barrier_configures) {
+        global_focus_barrier_configures = global_configure_counters.sent;
+        global_focus_barrier_sequence = xcb_no_operation(global_xconnection).sequence;
+    }
+}
+
+// Sends whatever the focus changes of the batch came down to: at most two border colours, the
+// input focus or WM_TAKE_FOCUS, and through ewmh_publish() _NET_ACTIVE_WINDOW.
+void focus_publish(void)
+{
+    struct client *client =
+        global_focused_monitor != NULL ? global_focused_monitor->focused_client : NULL;
+    xcb_window_t window = client != NULL ? client->window : XCB_NONE;
+    if (window == global_published_focus) {
+        return;
+    }
+    ++global_focus_counters.changes;
+    struct client *previous = get_client_by_win(global_published_focus);
+    if (previous != NULL) {
+        xcb_change_window_attributes(global_xconnection, previous->window, XCB_CW_BORDER_PIXEL,
+                                     &global_client_unfocus_pixel);
+    }
+    global_published_focus = window;
+    if (client == NULL) {
+        xcb_set_input_focus(global_xconnection, XCB_INPUT_FOCUS_POINTER_ROOT,
+                            XCB_INPUT_FOCUS_POINTER_ROOT, XCB_CURRENT_TIME);
+        return;
+    }
+    xcb_void_cookie_t cookie = xcb_change_window_attributes(
+        global_xconnection, client->window, XCB_CW_BORDER_PIXEL, &global_client_focus_pixel);
+    error_route(cookie.sequence, ERROR_ROUTE_CLIENT, client->window);
+    if (client->never_focus == false) {
+        cookie = xcb_set_input_focus(global_xconnection, XCB_INPUT_FOCUS_POINTER_ROOT,
+                                     client->window, XCB_CURRENT_TIME);
+        error_route(cookie.sequence, ERROR_ROUTE_CLIENT, client->window);
+    }
+    if (client->supports_take_focus == true) {
+        xcb_client_message_event_t event = {0};
+        event.response_type = XCB_CLIENT_MESSAGE;
+        event.format = 32;
+        event.window = client->window;
+        event.type = global_wm_atoms[WM_PROTOCOLS];
+        event.data.data32[0] = global_wm_atoms[WM_TAKE_FOCUS];
+        event.data.data32[1] = XCB_CURRENT_TIME;
+        cookie = xcb_send_event(global_xconnection, false, client->window, XCB_EVENT_MASK_NO_EVENT,
+                                (char *)&event);
+        error_route(cookie.sequence, ERROR_ROUTE_CLIENT, client->window);
+    }
+}
+
+void ewmh_publish(void)
+{
+    TRACE_SCOPE("ewmh_publish");
+    xcb_atom_t client_list = global_ewmh_connection->_NET_CLIENT_LIST;
+    xcb_atom_t client_list_stacking = global_ewmh_connection->_NET_CLIENT_LIST_STACKING;
+    uint64_t appended_num = global_client_list_num - global_client_list_published_num;
+    if (global_client_list_outdated == true) {
+        client_list_publish(client_list, XCB_PROP_MODE_REPLACE, global_client_list,
+                            global_client_list_num);
+        ++global_ewmh_counters.rewrites;
+    } else if (global_client_list_published_num < global_client_list_num) {
+        client_list_publish(client_list, XCB_PROP_MODE_APPEND,
+                            &global_client_list[global_client_list_published_num], appended_num);
+        ++global_ewmh_counters.appends;
+    }
+    // Without a removal or raise, the windows mapped since are the top of the stacking list.
+    if (global_client_stacking_outdated == true) {
+        client_list_publish(client_list_stacking, XCB_PROP_MODE_REPLACE, global_client_stacking,
+                            global_client_list_num);
+        global_ewmh_counters.restacks += global_client_list_outdated == false;
+    } else if (global_client_list_published_num < global_client_list_num) {
+        client_list_publish(client_list_stacking, XCB_PROP_MODE_APPEND,
+                            &global_client_stacking[global_client_list_published_num],
+                            appended_num);
+    }
+    global_client_list_outdated = false;
+    global_client_stacking_outdated = false;
+    global_client_list_published_num = global_client_list_num;
+
+    if (global_focused_monitor == NULL) {
+        return;
+    }
+    xcb_window_t active_window = global_focused_monitor->focused_client != NULL
+                                     ? global_focused_monitor->focused_client->window
+                                     : XCB_NONE;
+    if (active_window != global_published_active_window) {
+        xcb_change_property(global_xconnection, XCB_PROP_MODE_REPLACE, global_screen->root,
+                            global_ewmh_connection->_NET_ACTIVE_WINDOW, XCB_ATOM_WINDOW, 32, 1,
+                            &active_window);
+        global_published_active_window = active_window;
+        ipc_broadcast("focus 0x%x", active_window);
+    }
+    // Desktops are tags, the lowest tag in view of the focused monitor is the current one.
+    uint32_t current_desktop = global_focused_monitor->enabled_tags != 0
+                                   ? __builtin_ctz(global_focused_monitor->enabled_tags)
+                                   : 0;
+    if (current_desktop != global_published_current_desktop) {
+        xcb_change_property(global_xconnection, XCB_PROP_MODE_REPLACE, global_screen->root,
+                            global_ewmh_connection->_NET_CURRENT_DESKTOP, XCB_ATOM_CARDINAL, 32, 1,
+                            &current_desktop);
+        global_published_current_desktop = current_desktop;
+    }
+}
+
+struct bar_counters {
+    uint64_t segments_drawn;
+    uint64_t segments_unchanged;
+    uint64_t icons_deferred;
+};
+
+static struct bar_counters global_bar_counters = {0};
+
+// Takes the glyph widths from the font so that text is measured without asking the server.
+int bar_init(const xcb_query_font_reply_t *const reply)
+{
+    if (reply == NULL) {
+        return 1;
+    }
+    const xcb_charinfo_t *char_infos = xcb_query_font_char_infos(reply);
+    int32_t char_infos_num = xcb_query_font_char_infos_length(reply);
+    for (uint32_t c = 0; c < 256; ++c) {
+        // Fonts whose glyphs are all alike may send no per-glyph metrics at all.
+        uint16_t width = reply->max_bounds.character_width;
+        if (char_infos_num > 0 && reply->min_byte1 == 0) {
+            int32_t i = (int32_t)c - reply->min_char_or_byte2;
+            width = i >= 0 && i < char_infos_num ? char_infos[i].character_width : 0;
+        }
+        global_bar_glyph_widths[c] = min(width, UINT8_MAX);
+    }
+    for (char c = '1'; c <= '9'; ++c) {
+        global_bar_tag_width = max(global_bar_tag_width, global_bar_glyph_widths[(uint8_t)c]);
+    }
+    global_bar_tag_width += 2 * global_bar_padding;
+    global_bar_height = reply->font_ascent + reply->font_descent + global_bar_padding;
+    global_bar_baseline = global_bar_padding / 2 + reply->font_ascent;
+
+    const xcb_setup_t *setup = xcb_get_setup(global_xconnection);
+    for (xcb_format_iterator_t iterator = xcb_setup_pixmap_formats_iterator(setup);
+         iterator.rem > 0; xcb_format_next(&iterator)) {
+        if (iterator.data->depth == global_screen->root_depth) {
+            global_bar_has_icons = iterator.data->bits_per_pixel == 32 &&
+                                   setup->image_byte_order == XCB_IMAGE_ORDER_LSB_FIRST &&
+                                   global_bar_height >= ICON_SIZE;
+        }
+    }
+
+    global_bar_gc = xcb_generate_id(global_xconnection);
+    uint32_t values[] = {global_bar_font, 0};
+    xcb_create_gc(global_xconnection, global_bar_gc, global_screen->root,
+                  XCB_GC_FONT | XCB_GC_GRAPHICS_EXPOSURES, values);
+    return 0;
+}
+
+void bar_clock_update(void)
+{
+    time_t now = time(NULL);
+    struct tm local;
+    if (localtime_r(&now, &local) == NULL ||
+        strftime(global_bar_clock, sizeof(global_bar_clock), global_bar_clock_format, &local) ==
+            0) {
+        global_bar_clock[0] = '\0';
+    }
+}
+
+// Wakes the event loop at the start of the next minute, which is when the clock text changes.
+int bar_clock_arm(void)
+{
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = time(NULL) / 60 * 60 + 60;
+    return timerfd_settime(global_clock_timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) != 0;
+}
+
+void handle_clock_timer(void)
+{
+    uint64_t expirations = 0;
+    if (counter_fd_read(global_clock_timer_fd, &expirations) != 0) {
+        return;
+    }
+    bar_clock_update();
+    bar_clock_arm();
+}
+
+// Moves the bar over box and starts a pixmap of its size, which every segment is drawn into anew.
+void bar_place(struct bar *const bar, const struct box box)
+{
+    if (bar->pixmap != XCB_NONE) {
+        xcb_free_pixmap(global_xconnection, bar->pixmap);
+    }
+    bar->pixmap = xcb_generate_id(global_xconnection);
+    xcb_create_pixmap(global_xconnection, global_screen->root_depth, bar->pixmap,
+                      global_screen->root, box.width, box.height);
+    uint32_t values[] = {box.x, box.y, box.width, box.height};
+    xcb_configure_window(global_xconnection, bar->window,
+                         XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y | XCB_CONFIG_WINDOW_WIDTH |
+                             XCB_CONFIG_WINDOW_HEIGHT,
+                         values);
+    bar->box = box;
+    for (uint8_t i = 0; i < BAR_SEGMENT_END; ++i) {
+        bar->segments[i].width = 0;
+        bar->segments[i].state = UINT64_MAX;
+    }
+}
+
+void bar_create(struct bar *const bar, const struct box box)
+{
+    bar->window = xcb_generate_id(global_xconnection);
+    uint32_t values[] = {true, XCB_EVENT_MASK_EXPOSURE};
+    xcb_create_window(global_xconnection, XCB_COPY_FROM_PARENT, bar->window, global_screen->root,
+                      box.x, box.y, box.width, box.height, 0, XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                      global_screen->root_visual, XCB_CW_OVERRIDE_REDIRECT | XCB_CW_EVENT_MASK,
+                      values);
+    bar_place(bar, box);
+    if (global_has_shm == true && global_bar_has_icons == true) {
+        int shm_id =
+            shmget(IPC_PRIVATE, ICON_SIZE * ICON_SIZE * sizeof(uint32_t), IPC_CREAT | 0600);
+        void *pixels = shm_id >= 0 ? shmat(shm_id, NULL, 0) : (void *)-1;
+        if (pixels != (void *)-1) {
+            bar->shm_pixels = (uint32_t *)pixels;
+            bar->shm_seg = xcb_generate_id(global_xconnection);
+            xcb_void_cookie_t cookie =
+                xcb_shm_attach(global_xconnection, bar->shm_seg, shm_id, false);
+            error_route(cookie.sequence, ERROR_ROUTE_BAR_SHM, bar->window);
+        }
+        // Linux lets the X server attach a segment already marked for removal, so it is removed
+        // right away and can't outlive ewm.
+        if (shm_id >= 0) {
+            shmctl(shm_id, IPC_RMID, NULL);
+        }
+    }
+    xcb_map_window(global_xconnection, bar->window);
+}
+
+// Called when an attach or put failed, typically because the X server is on another machine.
+void bars_disable_shm(void)
+{
+    if (global_has_shm == true) {
+        fprintf(stderr, "Can't share memory with X Server, sending bar icons over the socket!\n");
+    }
+    global_has_shm = false;
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        struct bar *bar = &container_of(cursor, struct monitor, list_node)->bar;
+        if (bar->shm_pixels != NULL) {
+            shmdt(bar->shm_pixels);
+        }
+        bar->shm_pixels = NULL;
+        bar->shm_seg = XCB_NONE;
+        bar->is_shm_busy = false;
+        bar->segments[BAR_SEGMENT_TITLE].state = UINT64_MAX;
+    }
+}
+
+// Converts UTF-8 to the Latin-1 of the core font, with '?' for what it can't show, and stops before
+// the text gets wider than max_width.
+void bar_text(struct bar_segment *const segment, const char *const text, uint16_t max_width,
+              uint16_t *const width)
+{
+    const uint8_t *source = (const uint8_t *)text;
+    uint8_t length = 0;
+    *width = 0;
+    while (*source != '\0' && length < BAR_TEXT_SIZE - 1) {
+        uint32_t c = *source++;
+        if (c >= 0x80) {
+            uint32_t continuations_num = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+            c &= 0x3f >> continuations_num;
+            for (; continuations_num > 0 && (*source & 0xc0) == 0x80; --continuations_num) {
+                c = c << 6 | (*source++ & 0x3f);
+            }
+            c = continuations_num == 0 && c >= 0xa0 && c < 0x100 ? c : '?';
+        }
+        c = c < 0x20 || c == 0x7f ? '?' : c;
+        if (*width + global_bar_glyph_widths[c] > max_width) {
+            break;
+        }
+        *width += global_bar_glyph_widths[c];
+        segment->text[length++] = c;
+    }
+    segment->text[length] = '\0';
+    segment->text_len = length;
+}
+
+void bar_fill(const struct bar *const bar, uint32_t pixel, int16_t x, int16_t y, uint16_t width,
+              uint16_t height)
+{
+    xcb_change_gc(global_xconnection, global_bar_gc, XCB_GC_FOREGROUND, &pixel);
+    xcb_rectangle_t rectangle = {x, y, width, height};
+    xcb_poly_fill_rectangle(global_xconnection, bar->pixmap, global_bar_gc, 1, &rectangle);
+}
+
+void bar_print(const struct bar *const bar, uint32_t foreground, uint32_t background, int16_t x,
+               const char *const text, uint8_t text_len)
+{
+    uint32_t values[] = {foreground, background};
+    xcb_change_gc(global_xconnection, global_bar_gc, XCB_GC_FOREGROUND | XCB_GC_BACKGROUND,
+                  values);
+    xcb_image_text_8(global_xconnection, text_len, bar->pixmap, global_bar_gc, x,
+                     global_bar_baseline, text);
+}
+
+// Blends the ARGB icon onto the background and puts it, from shared memory when there is some.
+void bar_put_icon(struct bar *const bar, const uint32_t *const icon, uint32_t background, int16_t x)
+{
+    uint32_t socket_pixels[ICON_SIZE * ICON_SIZE];
+    uint32_t *pixels = bar->shm_pixels != NULL ? bar->shm_pixels : socket_pixels;
+    for (uint32_t i = 0; i < ICON_SIZE * ICON_SIZE; ++i) {
+        uint32_t alpha = icon[i] >> 24;
+        uint32_t pixel = 0;
+        for (uint32_t shift = 0; shift < 24; shift += 8) {
+            uint32_t channel = (((icon[i] >> shift) & 0xff) * alpha +
+                                ((background >> shift) & 0xff) * (255 - alpha)) /
+                               255;
+            pixel |= channel << shift;
+        }
+        pixels[i] = pixel;
+    }
+    int16_t y = (global_bar_height - ICON_SIZE) / 2;
+    if (bar->shm_pixels != NULL) {
+        xcb_void_cookie_t cookie = xcb_shm_put_image(
+            global_xconnection, bar->pixmap, global_bar_gc, ICON_SIZE, ICON_SIZE, 0, 0, ICON_SIZE,
+            ICON_SIZE, x, y, global_screen->root_depth, XCB_IMAGE_FORMAT_Z_PIXMAP, true,
+            bar->shm_seg, 0);
+        error_route(cookie.sequence, ERROR_ROUTE_BAR_SHM, bar->window);
+        bar->is_shm_busy = true;
+        return;
+    }
+    xcb_put_image(global_xconnection, XCB_IMAGE_FORMAT_Z_PIXMAP, bar->pixmap, global_bar_gc,
+                  ICON_SIZE, ICON_SIZE, x, y, 0, global_screen->root_depth, sizeof(socket_pixels),
+                  (const uint8_t *)socket_pixels);
+}
+
+// Tag segment state: enabled tags, then occupied tags, then urgent tags, TAGS_NUM bits each. Title
+// segment state: the window, its icon serial, and whether it has an icon and its monitor focus.
+#define BAR_TITLE_HAS_ICON (1ull << 16)
+#define BAR_TITLE_IS_SELECTED (1ull << 17)
+
+void bar_draw_segment(struct bar *const bar, uint8_t segment_idx,
+                      const struct bar_segment *const segment, const uint32_t *const icon)
+{
+    int16_t x = segment->x;
+    switch (segment_idx) {
+    case BAR_SEGMENT_TAGS:
+        for (uint16_t i = 0; i < TAGS_NUM; ++i, x += global_bar_tag_width) {
+            bool is_enabled = (segment->state >> i) & 1;
+            bool is_occupied = (segment->state >> (TAGS_NUM + i)) & 1;
+            bool is_urgent = (segment->state >> (2 * TAGS_NUM + i)) & 1;
+            uint32_t background = is_urgent    ? global_bar_urgent_background_pixel
+                                  : is_enabled ? global_bar_selected_background_pixel
+                                               : global_bar_background_pixel;
+            uint32_t foreground = is_enabled || is_urgent ? global_bar_selected_foreground_pixel
+                                                          : global_bar_foreground_pixel;
+            char digit = '1' + i;
+            bar_fill(bar, background, x, 0, global_bar_tag_width, global_bar_height);
+            bar_print(bar, foreground, background, x + global_bar_padding, &digit, 1);
+            if (is_occupied == true) {
+                bar_fill(bar, foreground, x + 1, 1, 3, 3);
+            }
+        }
+        break;
+    case BAR_SEGMENT_TITLE: {
+        bool is_selected = segment->state & BAR_TITLE_IS_SELECTED;
+        uint32_t background =
+            is_selected ? global_bar_selected_background_pixel : global_bar_background_pixel;
+        uint32_t foreground =
+            is_selected ? global_bar_selected_foreground_pixel : global_bar_foreground_pixel;
+        bar_fill(bar, background, x, 0, segment->width, global_bar_height);
+        x += global_bar_padding;
+        if (segment->state & BAR_TITLE_HAS_ICON) {
+            bar_put_icon(bar, icon, background, x);
+            x += ICON_SIZE + global_bar_padding;
+        }
+        bar_print(bar, foreground, background, x, segment->text, segment->text_len);
+        break;
+    }
+    default:
+        bar_fill(bar, global_bar_background_pixel, x, 0, segment->width, global_bar_height);
+        bar_print(bar, global_bar_foreground_pixel, global_bar_background_pixel,
+                  x + global_bar_padding, segment->text, segment->text_len);
+        break;
+    }
+    xcb_copy_area(global_xconnection, bar->pixmap, bar->window, global_bar_gc, segment->x, 0,
+                  segment->x, 0, segment->width, global_bar_height);
+}
+
+// Works out what every segment shows now and draws those that differ from their last drawing. When
+// nothing changed this sends nothing, a new clock minute costs one segment.
+void bar_draw(struct monitor *const monitor)
+{
+    struct bar *bar = &monitor->bar;
+    struct box box = {monitor->crtc_box.x, monitor->crtc_box.y, monitor->crtc_box.width,
+                      global_bar_height};
+    if (bar->window == XCB_NONE) {
+        bar_create(bar, box);
+    } else if (box_compare(box, bar->box) == false) {
+        bar_place(bar, box);
+    }
+
+    struct bar_segment segments[BAR_SEGMENT_END];
+    uint16_t width = 0;
+    uint16_t occupied_tags = 0;
+    uint16_t urgent_tags = 0;
+    for (struct list_node *node = monitor->clients; node != NULL; node = node->next) {
+        struct client *client = container_of(node, struct client, list_node);
+        occupied_tags |= client->tags;
+        urgent_tags |= client->is_urgent == true ? client->tags : 0;
+    }
+    segments[BAR_SEGMENT_TAGS].x = 0;
+    segments[BAR_SEGMENT_TAGS].width = TAGS_NUM * global_bar_tag_width;
+    segments[BAR_SEGMENT_TAGS].state = monitor->enabled_tags |
+                                       (uint64_t)occupied_tags << TAGS_NUM |
+                                       (uint64_t)urgent_tags << (2 * TAGS_NUM);
+    bar_text(&segments[BAR_SEGMENT_TAGS], "", 0, &width);
+
+    struct bar_segment *layout = &segments[BAR_SEGMENT_LAYOUT];
+    bar_text(layout, monitor->layouts[monitor->current_layout_idx].name, box.width / 4, &width);
+    layout->x = segments[BAR_SEGMENT_TAGS].width;
+    layout->width = width + 2 * global_bar_padding;
+    layout->state = 0;
+
+    struct bar_segment *clock = &segments[BAR_SEGMENT_CLOCK];
+    bar_text(clock, global_bar_clock, box.width / 4, &width);
+    clock->width = clock->text_len > 0 ? width + 2 * global_bar_padding : 0;
+    clock->x = box.width - clock->width;
+    clock->state = 0;
+
+    struct bar_segment *status = &segments[BAR_SEGMENT_STATUS];
+    bar_text(status, global_bar_status, box.width / 3, &width);
+    status->width = status->text_len > 0 ? width + 2 * global_bar_padding : 0;
+    status->x = clock->x - status->width;
+    status->state = 0;
+
+    struct bar_segment *title = &segments[BAR_SEGMENT_TITLE];
+    struct client *client = monitor->focused_client;
+    const struct client_properties *properties = client != NULL ? client_properties(client) : NULL;
+    bool has_icon = properties != NULL && properties->has_icon == true && global_bar_has_icons;
+    title->x = layout->x + layout->width;
+    title->width = max(status->x - title->x, 0);
+    int32_t text_width = (int32_t)title->width - 2 * global_bar_padding -
+                         (has_icon == true ? ICON_SIZE + global_bar_padding : 0);
+    bar_text(title, properties != NULL ? properties->name : "", max(text_width, 0), &width);
+    title->state = 0;
+    if (client != NULL) {
+        title->state = (uint64_t)client->window << 32 | properties->icon_serial |
+                       (has_icon == true ? BAR_TITLE_HAS_ICON : 0) |
+                       (monitor == global_focused_monitor ? BAR_TITLE_IS_SELECTED : 0);
+    }
+
+    for (uint8_t i = 0; i < BAR_SEGMENT_END; ++i) {
+        const struct bar_segment *next = &segments[i];
+        const struct bar_segment *last = &bar->segments[i];
+        if (next->x == last->x && next->width == last->width && next->state == last->state &&
+            next->text_len == last->text_len &&
+            memcmp(next->text, last->text, next->text_len) == 0) {
+            ++global_bar_counters.segments_unchanged;
+            continue;
+        }
+        // The shared memory may still be read for the previous icon, the completion brings this
+        // segment around again.
+        if (i == BAR_SEGMENT_TITLE && has_icon == true && bar->is_shm_busy == true) {
+            ++global_bar_counters.icons_deferred;
+            continue;
+        }
+        if (next->width > 0) {
+            bar_draw_segment(bar, i, next, has_icon == true ? properties->icon : NULL);
+        }
+        bar->segments[i] = *next;
+        ++global_bar_counters.segments_drawn;
+    }
+}
+
+void bars_draw(void)
+{
+    if (global_bar_height == 0) {
+        return;
+    }
+    TRACE_SCOPE("bars_draw");
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        bar_draw(container_of(cursor, struct monitor, list_node));
+    }
+}
+
+// Matched by segment, since bar_place() may have replaced the pixmap the put went to.
+void handle_shm_completion(xcb_shm_completion_event_t *event)
+{
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        struct bar *bar = &container_of(cursor, struct monitor, list_node)->bar;
+        if (bar->shm_seg != XCB_NONE && bar->shm_seg == event->shmseg) {
+            bar->is_shm_busy = false;
+        }
+    }
+}
+
+void handle_expose(xcb_expose_event_t *event)
+{
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        struct bar *bar = &container_of(cursor, struct monitor, list_node)->bar;
+        if (bar->window == event->window) {
+            xcb_copy_area(global_xconnection, bar->pixmap, bar->window, global_bar_gc, event->x,
+                          event->y, event->x, event->y, event->width, event->height);
+        }
+    }
+}
+
+struct monitor *get_monitor_by_output(xcb_randr_output_t output)
+{
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        struct monitor *monitor = container_of(cursor, struct monitor, list_node);
+        if (monitor->output == output) {
+            return monitor;
+        }
+    }
+    return NULL;
+}
+
+// Snapshot of what only lives in memory, written on exit and read back by the next instance, so
+// that a restart keeps every window where it was. Monitors are keyed by RandR output and clients by
+// window, clients sorted by window. The file is the header followed by both arrays, all in native
+// byte order, and a different version is ignored.
+#define SESSION_MAGIC (0x534d5745)
+#define SESSION_VERSION (1)
+
+enum { SESSION_CLIENT_FLOATING = 1 << 0, SESSION_CLIENT_FULLSCREEN = 1 << 1 };
+
+struct session_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t monitors_num;
+    uint32_t clients_num;
+    xcb_randr_output_t focused_output;
+    uint32_t reserved;
+};
+
+struct session_monitor {
+    xcb_randr_output_t output;
+    xcb_window_t focused_window;
+    float main_area_fraction;
+    uint16_t enabled_tags;
+    uint8_t main_area_win_num;
+    uint8_t current_layout_idx;
+    uint8_t tag_layout_idxs[TAGS_NUM];
+};
+
+struct session_client {
+    xcb_window_t window;
+    xcb_randr_output_t output;
+    struct box box;
+    uint16_t tags;
+    uint8_t flags;
+    uint8_t reserved;
+};
+
+// Mapped read-only from startup until the adoption scan is done, NULL otherwise.
+static const struct session_header *global_session = NULL;
+static size_t global_session_size = 0;
+
+int session_path(char *const path, size_t size)
+{
+    const char *session = getenv("EWM_SESSION");
+    const char *display = getenv("DISPLAY");
+    int length = session != NULL ? snprintf(path, size, "%s", session)
+                                 : snprintf(path, size, "%s/ewm-session-%u%s", runtime_dir(),
+                                            getuid(), display != NULL ? display : "");
+    if (length < 0 || length >= size) {
+        fprintf(stderr, "Session path is too long!\n");
+        return 1;
+    }
+    return 0;
+}
+
+static inline const struct session_monitor *session_monitors(void)
+{
+    return (const struct session_monitor *)(global_session + 1);
+}
+
+static inline const struct session_client *session_clients(void)
+{
+    return (const struct session_client *)(session_monitors() + global_session->monitors_num);
+}
+
+int compare_session_clients(const void *a, const void *b)
+{
+    xcb_window_t window_a = ((const struct session_client *)a)->window;
+    xcb_window_t window_b = ((const struct session_client *)b)->window;
+    return (window_a > window_b) - (window_a < window_b);
+}
+
+const struct session_client *session_find_client(xcb_window_t window)
+{
+    if (global_session == NULL) {
+        return NULL;
+    }
+    struct session_client key = {.window = window};
+    return (const struct session_client *)bsearch(&key, session_clients(),
+                                                  global_session->clients_num,
+                                                  sizeof(struct session_client),
+                                                  compare_session_clients);
+}
+
+// Written to a new temporary file first and renamed over the old snapshot, so a crash never leaves
+// a torn one behind and nothing someone else put next to it is followed or written to.
+int session_save(const char *const path)
+{
+    uint64_t clients_num = 0;
+    uint64_t monitors_num = 0;
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        clients_num += container_of(cursor, struct monitor, list_node)->clients_num;
+        ++monitors_num;
+    }
+    size_t size = sizeof(struct session_header) + monitors_num * sizeof(struct session_monitor) +
+                  clients_num * sizeof(struct session_client);
+    struct session_header *header = (struct session_header *)calloc(1, size);
+    if (header == NULL) {
+        fprintf(stderr, "Can't allocate session snapshot!\n");
+        return 1;
+    }
+    header->magic = SESSION_MAGIC;
+    header->version = SESSION_VERSION;
+    header->monitors_num = monitors_num;
+    header->clients_num = clients_num;
+    header->focused_output = global_focused_monitor != NULL ? global_focused_monitor->output : 0;
+    struct session_monitor *saved_monitors = (struct session_monitor *)(header + 1);
+    struct session_client *saved_clients = (struct session_client *)(saved_monitors + monitors_num);
+    struct session_monitor *saved_monitor = saved_monitors;
+    struct session_client *saved_client = saved_clients;
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        struct monitor *monitor = container_of(cursor, struct monitor, list_node);
+        saved_monitor->output = monitor->output;
+        saved_monitor->focused_window =
+            monitor->focused_client != NULL ? monitor->focused_client->window : XCB_NONE;
+        saved_monitor->main_area_fraction = monitor->main_area_fraction;
+        saved_monitor->enabled_tags = monitor->enabled_tags;
+        saved_monitor->main_area_win_num = monitor->main_area_win_num;
+        saved_monitor->current_layout_idx = monitor->current_layout_idx;
+        memcpy(saved_monitor->tag_layout_idxs, monitor->tag_layout_idxs, TAGS_NUM);
+        ++saved_monitor;
+        for (struct list_node *node = monitor->clients; node != NULL; node = node->next) {
+            struct client *client = container_of(node, struct client, list_node);
+            saved_client->window = client->window;
+            saved_client->output = monitor->output;
+            saved_client->box = client->box;
+            saved_client->tags = client->tags;
+            saved_client->flags = (client->is_floating ? SESSION_CLIENT_FLOATING : 0) |
+                                  (client->is_fullscreen ? SESSION_CLIENT_FULLSCREEN : 0);
+            ++saved_client;
+        }
+    }
+    qsort(saved_clients, clients_num, sizeof(struct session_client), compare_session_clients);
+
+    int result = 1;
+    char temporary_path[PATH_MAX];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.%d", path, getpid());
+    unlink(temporary_path);
+    int fd = open(temporary_path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Can't write session to %s!\n", temporary_path);
+        goto CLEANUP;
+    }
+    ssize_t written = write(fd, header, size);
+    close(fd);
+    if (written != size || rename(temporary_path, path) != 0) {
+        unlink(temporary_path);
+        fprintf(stderr, "Can't write session to %s!\n", path);
+        goto CLEANUP;
+    }
+    result = 0;
+
+CLEANUP:
+    free(header);
+    return result;
+}
+
+void session_unload(void)
+{
+    if (global_session != NULL) {
+        munmap((void *)global_session, global_session_size);
+        global_session = NULL;
+        global_session_size = 0;
+    }
+}
+
+// A snapshot is used by one startup only, so it is removed once mapped. Only a regular file of the
+// same user is trusted. Returns 1 if there is none or it can't be used, which is not an error for
+// the caller.
+int session_load(const char *const path)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0) {
+        return 1;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || !S_ISREG(file_stat.st_mode) ||
+        file_stat.st_uid != getuid()) {
+        close(fd);
+        fprintf(stderr, "Ignoring session %s of another user!\n", path);
+        return 1;
+    }
+    unlink(path);
+    void *mapping = MAP_FAILED;
+    if (file_stat.st_size >= sizeof(struct session_header)) {
+        mapping = mmap(NULL, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Can't map session %s!\n", path);
+        return 1;
+    }
+    const struct session_header *header = (const struct session_header *)mapping;
+    if (header->magic != SESSION_MAGIC || header->version != SESSION_VERSION ||
+        file_stat.st_size != sizeof(struct session_header) +
+                                 (uint64_t)header->monitors_num * sizeof(struct session_monitor) +
+                                 (uint64_t)header->clients_num * sizeof(struct session_client)) {
+        munmap(mapping, file_stat.st_size);
+        fprintf(stderr, "Ignoring incompatible session %s!\n", path);
+        return 1;
+    }
+    global_session = header;
+    global_session_size = file_stat.st_size;
+    return 0;
+}
+
+// Runs before any client is adopted, so the monitors don't need arranging again.
+void session_restore_monitors(void)
+{
+    if (global_session == NULL) {
+        return;
+    }
+    const struct session_monitor *saved_monitors = session_monitors();
+    for (uint32_t i = 0; i < global_session->monitors_num; ++i) {
+        const struct session_monitor *saved_monitor = &saved_monitors[i];
+        struct monitor *monitor = get_monitor_by_output(saved_monitor->output);
+        if (monitor == NULL) {
+            continue;
+        }
+        // Values out of what the IPC commands accept keep the defaults. NaN fails both bounds.
+        if (saved_monitor->main_area_fraction >= MAIN_AREA_FRACTION_MIN &&
+            saved_monitor->main_area_fraction <= MAIN_AREA_FRACTION_MAX) {
+            monitor->main_area_fraction = saved_monitor->main_area_fraction;
+        }
+        monitor->enabled_tags = saved_monitor->enabled_tags & TAGS_MASK;
+        if (monitor->enabled_tags == 0) {
+            monitor->enabled_tags = MASK_TAG1;
+        }
+        if (saved_monitor->main_area_win_num <= MAIN_AREA_WIN_NUM_MAX) {
+            monitor->main_area_win_num = saved_monitor->main_area_win_num;
+        }
+        if (saved_monitor->current_layout_idx < LAYOUT_END) {
+            monitor->current_layout_idx = saved_monitor->current_layout_idx;
+        }
+        for (uint8_t j = 0; j < TAGS_NUM; ++j) {
+            if (saved_monitor->tag_layout_idxs[j] < LAYOUT_END) {
+                monitor->tag_layout_idxs[j] = saved_monitor->tag_layout_idxs[j];
+            }
+        }
+        if (monitor->output == global_session->focused_output) {
+            global_focused_monitor = monitor;
+        }
+    }
+}
+
+// Runs once the scan has adopted the clients the focus refers to.
+void session_restore_focus(void)
+{
+    if (global_session == NULL) {
+        return;
+    }
+    const struct session_monitor *saved_monitors = session_monitors();
+    for (uint32_t i = 0; i < global_session->monitors_num; ++i) {
+        struct monitor *monitor = get_monitor_by_output(saved_monitors[i].output);
+        struct client *client = get_client_by_win(saved_monitors[i].focused_window);
+        if (monitor == NULL || client == NULL || client->monitor != monitor) {
+            continue;
+        }
+        monitor_focus_client(monitor, client);
+    }
+}
+
+void x11_before_wait(void)
+{
+    if (global_x11_before_wait != NULL) {
+        global_x11_before_wait();
+    }
+}
+
+// Called after every wait on the X Server. A wait only costs a round trip if requests went out
+// since the previous one, the replies of a pipelined batch keep arriving together and waiting for
+// the later ones merely reads them off the socket.
+void x11_count_round_trip(void)
+{
+    uint64_t written = xcb_total_written(global_xconnection);
+    if (written != global_round_trips_written) {
+        global_round_trips_written = written;
+        ++global_round_trips;
+    }
+}
+
+// Every reply is waited for through here, typed by its caller, so that round trips are counted in
+// one place. A reply that was already read costs nothing.
+void *x11_wait_for_reply(unsigned int sequence, xcb_generic_error_t **error)
+{
+    void *reply = NULL;
+    if (xcb_poll_for_reply(global_xconnection, sequence, &reply, error) == 1) {
+        return reply;
+    }
+    x11_before_wait();
+    reply = xcb_wait_for_reply(global_xconnection, sequence, error);
+    x11_count_round_trip();
+    return reply;
+}
+
+xcb_generic_error_t *x11_request_check(xcb_void_cookie_t cookie)
+{
+    x11_before_wait();
+    xcb_generic_error_t *error = xcb_request_check(global_xconnection, cookie);
+    x11_count_round_trip();
+    return error;
+}
+
+// A window about to be managed. Its requests are sent as soon as it is queued and the replies are
+// only collected by adopt_pending_clients(), so any number of windows share a single round trip.
+struct pending_client {
+    xcb_window_t window;
+    bool requires_viewable;
+
+    xcb_get_window_attributes_cookie_t window_attributes_cookie;
+    xcb_get_geometry_cookie_t geometry_cookie;
+    xcb_get_property_cookie_t transient_for_cookie;
+    xcb_get_property_cookie_t normal_hints_cookie;
+    xcb_get_property_cookie_t wm_hints_cookie;
+    xcb_get_property_cookie_t wm_desktop_cookie;
+
+    xcb_get_window_attributes_reply_t *window_attributes_reply;
+    xcb_get_geometry_reply_t *geometry_reply;
+    xcb_window_t transient;
+    bool has_size_hints;
+    xcb_size_hints_t size_hints;
+    bool has_wm_hints;
+    xcb_icccm_wm_hints_t wm_hints;
+    bool has_wm_desktop;
+    uint32_t wm_desktop;
+};
+
+static struct pending_client *global_pending_clients = NULL;
+static uint64_t global_pending_clients_num = 0;
+static uint64_t global_pending_clients_capacity = 0;
+
+int pending_client_queue(xcb_window_t window, bool requires_viewable)
+{
+    if (global_pending_clients_num == global_pending_clients_capacity) {
+        uint64_t new_capacity =
+            global_pending_clients_capacity == 0 ? 16 : global_pending_clients_capacity * 2;
+        struct pending_client *new_pending_clients = (struct pending_client *)realloc(
+            global_pending_clients, new_capacity * sizeof(struct pending_client));
+        if (new_pending_clients == NULL) {
+            fprintf(stderr, "Can't queue window for adoption!\n");
+            return 1;
+        }
+        global_pending_clients = new_pending_clients;
+        global_pending_clients_capacity = new_capacity;
+    }
+    struct pending_client *pending = &global_pending_clients[global_pending_clients_num++];
+    memset(pending, 0, sizeof(struct pending_client));
+    pending->window = window;
+    pending->requires_viewable = requires_viewable;
+    // Selected before the properties are read, so no change in between goes unnoticed.
+    uint32_t event_mask[] = {XCB_EVENT_MASK_PROPERTY_CHANGE};
+    xcb_change_window_attributes(global_xconnection, window, XCB_CW_EVENT_MASK, event_mask);
+    pending->window_attributes_cookie = xcb_get_window_attributes(global_xconnection, window);
+    pending->geometry_cookie = xcb_get_geometry(global_xconnection, window);
+    pending->transient_for_cookie = xcb_icccm_get_wm_transient_for(global_xconnection, window);
+    pending->normal_hints_cookie = xcb_icccm_get_wm_normal_hints(global_xconnection, window);
+    pending->wm_hints_cookie = xcb_icccm_get_wm_hints(global_xconnection, window);
+    pending->wm_desktop_cookie = xcb_ewmh_get_wm_desktop(global_ewmh_connection, window);
+    return 0;
+}
+
+void pending_client_collect(struct pending_client *const pending)
+{
+    pending->window_attributes_reply = (xcb_get_window_attributes_reply_t *)x11_wait_for_reply(
+        pending->window_attributes_cookie.sequence, NULL);
+    pending->geometry_reply =
+        (xcb_get_geometry_reply_t *)x11_wait_for_reply(pending->geometry_cookie.sequence, NULL);
+    pending->transient = XCB_NONE;
+    xcb_get_property_reply_t *property_reply = (xcb_get_property_reply_t *)x11_wait_for_reply(
+        pending->transient_for_cookie.sequence, NULL);
+    if (property_reply != NULL) {
+        xcb_icccm_get_wm_transient_for_from_reply(&pending->transient, property_reply);
+    }
+    free(property_reply);
+    property_reply = (xcb_get_property_reply_t *)x11_wait_for_reply(
+        pending->normal_hints_cookie.sequence, NULL);
+    pending->has_size_hints =
+        property_reply != NULL &&
+        xcb_icccm_get_wm_size_hints_from_reply(&pending->size_hints, property_reply) != 0;
+    free(property_reply);
+    property_reply =
+        (xcb_get_property_reply_t *)x11_wait_for_reply(pending->wm_hints_cookie.sequence, NULL);
+    pending->has_wm_hints =
+        property_reply != NULL &&
+        xcb_icccm_get_wm_hints_from_reply(&pending->wm_hints, property_reply) != 0;
+    free(property_reply);
+    property_reply =
+        (xcb_get_property_reply_t *)x11_wait_for_reply(pending->wm_desktop_cookie.sequence, NULL);
+    pending->has_wm_desktop =
+        property_reply != NULL &&
+        xcb_ewmh_get_wm_desktop_from_reply(&pending->wm_desktop, property_reply) != 0;
+    free(property_reply);
+}
+
+void pending_client_free(struct pending_client *const pending)
+{
+    free(pending->geometry_reply);
+    free(pending->window_attributes_reply);
+}
+
+struct monitor *client_adopt(const struct pending_client *const pending)
+{
+    xcb_get_window_attributes_reply_t *window_attributes_reply = pending->window_attributes_reply;
+    xcb_get_geometry_reply_t *geometry_reply = pending->geometry_reply;
+    // The same window may have been queued twice in one burst.
+    if (window_attributes_reply == NULL || geometry_reply == NULL ||
+        get_client_by_win(pending->window) != NULL) {
+        return NULL;
+    }
+    if (window_attributes_reply->override_redirect != 0 ||
+        pending->requires_viewable == true &&
+            window_attributes_reply->map_state != XCB_MAP_STATE_VIEWABLE) {
+        uint32_t event_mask[] = {XCB_EVENT_MASK_NO_EVENT};
+        xcb_change_window_attributes(global_xconnection, pending->window, XCB_CW_EVENT_MASK,
+                                     event_mask);
+        return NULL;
+    }
+
+    struct monitor *monitor = global_focused_monitor;
+    uint16_t tags = global_focused_monitor->enabled_tags;
+
+    if (pending->transient != XCB_NONE) {
+        struct client *client = get_client_by_win(pending->transient);
+        if (client != NULL) {
+            monitor = client->monitor;
+            tags = client->tags;
+        }
+    } else if (pending->has_wm_desktop == true && pending->wm_desktop < TAGS_NUM) {
+        tags = 1 << pending->wm_desktop;
+    }
+    const struct session_client *saved = session_find_client(pending->window);
+    if (saved != NULL) {
+        struct monitor *saved_monitor = get_monitor_by_output(saved->output);
+        monitor = saved_monitor != NULL ? saved_monitor : monitor;
+        tags = saved->tags & TAGS_MASK ? saved->tags & TAGS_MASK : tags;
+    }
+
+    struct client *new_client = client_create(
+        monitor, pending->window, geometry_reply->x, geometry_reply->y, geometry_reply->width,
+        geometry_reply->height, global_client_border_width, tags);
+    if (new_client == NULL) {
+        return NULL;
+    }
+    new_client->is_floating = pending->transient != XCB_NONE;
+    if (saved != NULL) {
+        // The previous instance left the window at its committed box, or hidden off-screen, so
+        // the first arrange only sends what actually changes. A box that can't be on the monitor
+        // is left to the window.
+        if (saved->box.width != 0 && saved->box.height != 0 &&
+            box_intersects(saved->box, monitor->box) == true) {
+            new_client->box = saved->box;
+        }
+        new_client->is_floating = saved->flags & SESSION_CLIENT_FLOATING;
+        new_client->is_fullscreen = saved->flags & SESSION_CLIENT_FULLSCREEN;
+        new_client->is_hidden = (tags & monitor->enabled_tags) == 0;
+    }
+    if (pending->has_size_hints == true) {
+        client_set_size_hints(new_client, &pending->size_hints);
+    }
+    if (pending->has_wm_hints == true) {
+        new_client->is_urgent = pending->wm_hints.flags & XCB_ICCCM_WM_HINT_X_URGENCY;
+        new_client->never_focus =
+            (pending->wm_hints.flags & XCB_ICCCM_WM_HINT_INPUT) && pending->wm_hints.input == 0;
+    }
+
+    if (monitor_append_client(monitor, new_client) != 0) {
+        client_free(new_client);
+        return NULL;
+    }
+    if (pending->has_wm_desktop == false || pending->wm_desktop != __builtin_ctz(tags)) {
+        client_publish_desktop(new_client);
+    }
+    // The border starts unfocused, focus_publish() recolours it. Crossings are only selected now
+    // that the window is managed.
+    uint32_t border_width = new_client->border_width;
+    xcb_configure_window(global_xconnection, new_client->window, XCB_CONFIG_WINDOW_BORDER_WIDTH,
+                         &border_width);
+    uint32_t attributes[] = {global_client_unfocus_pixel,
+                             XCB_EVENT_MASK_PROPERTY_CHANGE | XCB_EVENT_MASK_ENTER_WINDOW};
+    xcb_change_window_attributes(global_xconnection, new_client->window,
+                                 XCB_CW_BORDER_PIXEL | XCB_CW_EVENT_MASK, attributes);
+    // Windows mapped while ewm runs take the focus, those found at startup leave it be.
+    if (pending->requires_viewable == false && client_is_visible(new_client) == true) {
+        monitor_focus_client(monitor, new_client);
+    }
+    client_mark_properties(new_client, PROPERTY_NET_WM_NAME | PROPERTY_WM_CLASS |
+                                           PROPERTY_WM_PROTOCOLS | PROPERTY_SYNC_REQUEST_COUNTER |
+                                           PROPERTY_NET_WM_PID | PROPERTY_NET_WM_ICON);
+    client_list_add(new_client->window);
+    if (new_client->is_floating == false || saved != NULL) {
+        return monitor;
+    }
+
+    // Tiled clients get their geometry from the next arrange, floating ones are kept on screen.
+    struct box box = new_client->box;
+    if (box.x + box.width + 2 * geometry_reply->border_width >
+        monitor->box.x + monitor->box.width + 2 * global_client_border_width) {
+        box.x = monitor->box.x;
+        box.width = monitor->box.width;
+    }
+    if (box.y + box.height + 2 * geometry_reply->border_width >
+        monitor->box.y + monitor->box.height + 2 * global_client_border_width) {
+        box.y = monitor->box.y;
+        box.height = monitor->box.height;
+    }
+    client_move_resize(new_client, box.x, box.y, box.width, box.height);
+    return monitor;
+}
+
+void adopt_pending_clients(void)
+{
+    TRACE_SCOPE("adopt_pending_clients");
+    // XCB flushes only up to the reply waited for, so the tail of a large batch would otherwise
+    // cost a round trip of its own.
+    xcb_flush(global_xconnection);
+    for (uint64_t i = 0; i < global_pending_clients_num; ++i) {
+        pending_client_collect(&global_pending_clients[i]);
+    }
+
+    // Transients go last so that their parent is already managed when they look it up, even if
+    // the parent came later in the batch.
+    for (uint64_t pass = 0; pass < 2; ++pass) {
+        for (uint64_t i = 0; i < global_pending_clients_num; ++i) {
+            struct pending_client *pending = &global_pending_clients[i];
+            if ((pending->transient != XCB_NONE) != (pass == 1)) {
+                continue;
+            }
+            struct monitor *monitor = client_adopt(pending);
+            if (monitor == NULL) {
+                pending->window = XCB_NONE;
+                continue;
+            }
+            monitor->needs_arrange = true;
+        }
+    }
+
+    // Arrange each affected monitor once for the whole batch, then map the new windows in place.
+    monitors_arrange_pending();
+    for (uint64_t i = 0; i < global_pending_clients_num; ++i) {
+        xcb_window_t window = global_pending_clients[i].window;
+        if (window != XCB_NONE) {
+            error_route(xcb_map_window(global_xconnection, window).sequence, ERROR_ROUTE_CLIENT,
+                        window);
+        }
+        pending_client_free(&global_pending_clients[i]);
+    }
+
+    global_pending_clients_num = 0;
+}
+
+int x11_scan_windows(xcb_query_tree_cookie_t query_tree_cookie)
+{
+    xcb_query_tree_reply_t *query_tree_reply =
+        (xcb_query_tree_reply_t *)x11_wait_for_reply(query_tree_cookie.sequence, NULL);
+    if (query_tree_reply == NULL) {
+        fprintf(stderr, "Can't query existing windows from X Server!\n");
+        return 1;
+    }
+    xcb_window_t *children = xcb_query_tree_children(query_tree_reply);
+    int children_len = xcb_query_tree_children_length(query_tree_reply);
+    for (int i = 0; i < children_len; ++i) {
+        pending_client_queue(children[i], true);
+    }
+    free(query_tree_reply);
+
+    adopt_pending_clients();
+    return 0;
+}
+
+void monitor_migrate_clients(struct monitor *const from, struct monitor *const to)
+{
+    while (from->clients != NULL) {
+        struct client *client = container_of(from->clients, struct client, list_node);
+        monitor_remove_client(from, client);
+        if (monitor_append_client(to, client) != 0) {
+            client_list_remove(client->window);
+            client_free(client);
+            continue;
+        }
+        if (to->focused_client == NULL && client_is_visible(client) == true) {
+            to->focused_client = client;
+        }
+        if (client->is_floating == true) {
+            client_move_resize(client, client->box.x - from->box.x + to->box.x,
+                               client->box.y - from->box.y + to->box.y, client->box.width,
+                               client->box.height);
+        }
+    }
+    to->needs_arrange = true;
+}
+
+uint64_t get_mode_refresh_interval_ns(
+    const xcb_randr_get_screen_resources_current_reply_t *const screen_resources_reply,
+    xcb_randr_mode_t mode)
+{
+    xcb_randr_mode_info_t *modes =
+        xcb_randr_get_screen_resources_current_modes(screen_resources_reply);
+    int modes_len = xcb_randr_get_screen_resources_current_modes_length(screen_resources_reply);
+    for (int i = 0; i < modes_len; ++i) {
+        if (modes[i].id == mode && modes[i].dot_clock != 0 && modes[i].htotal != 0 &&
+            modes[i].vtotal != 0) {
+            return (uint64_t)modes[i].htotal * modes[i].vtotal * 1000000000 / modes[i].dot_clock;
+        }
+    }
+    return global_default_refresh_interval_ns;
+}
+
+// Diffs the active CRTCs against global_monitors. A monitor is keyed by the first output of its
+// CRTC, so cloned outputs share one monitor. Monitors that are still present keep their clients and
+// settings, and only the ones whose geometry or clients changed get re-arranged.
+int update_monitors(xcb_randr_get_screen_resources_current_cookie_t screen_resources_cookie)
+{
+    TRACE_SCOPE("update_monitors");
+    xcb_randr_get_screen_resources_current_reply_t *screen_resources_reply =
+        (xcb_randr_get_screen_resources_current_reply_t *)x11_wait_for_reply(
+            screen_resources_cookie.sequence, NULL);
+    if (screen_resources_reply == NULL) {
+        fprintf(stderr, "Can't get screen resources from X Server!\n");
+        return 1;
+    }
+
+    int result = 1;
+    size_t crtcs_len = xcb_randr_get_screen_resources_current_crtcs_length(screen_resources_reply);
+    xcb_randr_crtc_t *crtcs = xcb_randr_get_screen_resources_current_crtcs(screen_resources_reply);
+    xcb_randr_get_crtc_info_cookie_t *crtc_info_cookies =
+        (xcb_randr_get_crtc_info_cookie_t *)calloc(crtcs_len,
+                                                   sizeof(xcb_randr_get_crtc_info_cookie_t));
+    xcb_randr_get_crtc_info_reply_t **crtc_info_replies =
+        (xcb_randr_get_crtc_info_reply_t **)calloc(crtcs_len,
+                                                   sizeof(xcb_randr_get_crtc_info_reply_t *));
+    if (crtc_info_cookies == NULL || crtc_info_replies == NULL) {
+        goto CLEANUP;
+    }
+
+    for (uint64_t i = 0; i < crtcs_len; ++i) {
+        crtc_info_cookies[i] = xcb_randr_get_crtc_info(global_xconnection, crtcs[i],
+                                                       screen_resources_reply->config_timestamp);
+    }
+    bool has_active_crtc = false;
+    for (uint64_t i = 0; i < crtcs_len; ++i) {
+        crtc_info_replies[i] = (xcb_randr_get_crtc_info_reply_t *)x11_wait_for_reply(
+            crtc_info_cookies[i].sequence, NULL);
+        if (crtc_info_replies[i] != NULL && crtc_info_replies[i]->mode != XCB_NONE &&
+            crtc_info_replies[i]->num_outputs > 0) {
+            has_active_crtc = true;
+        }
+    }
+    // Keep the current monitors rather than losing every client while all outputs are off.
+    if (has_active_crtc == false) {
+        result = 0;
+        goto CLEANUP;
+    }
+
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        container_of(cursor, struct monitor, list_node)->is_stale = true;
+    }
+    for (uint64_t i = 0; i < crtcs_len; ++i) {
+        xcb_randr_get_crtc_info_reply_t *crtc_info_reply = crtc_info_replies[i];
+        if (crtc_info_reply == NULL || crtc_info_reply->mode == XCB_NONE ||
+            crtc_info_reply->num_outputs == 0) {
+            continue;
+        }
+        xcb_randr_output_t output = xcb_randr_get_crtc_info_outputs(crtc_info_reply)[0];
+        struct box crtc_box = {crtc_info_reply->x, crtc_info_reply->y, crtc_info_reply->width,
+                               crtc_info_reply->height};
+        struct monitor *monitor = get_monitor_by_output(output);
+        if (monitor == NULL) {
+            monitor = monitor_create(output, crtc_box.x, crtc_box.y, crtc_box.width,
+                                     crtc_box.height);
+            if (monitor == NULL) {
+                continue;
+            }
+            list_append(&global_monitors, &monitor->list_node);
+        } else if (box_compare(monitor->crtc_box, crtc_box) == false) {
+            monitor_set_crtc_box(monitor, crtc_box);
+            monitor->needs_arrange = true;
+        }
+        monitor->refresh_interval_ns =
+            get_mode_refresh_interval_ns(screen_resources_reply, crtc_info_reply->mode);
+        monitor->is_stale = false;
+    }
+
+    struct monitor *fallback = global_focused_monitor;
+    if (fallback == NULL || fallback->is_stale == true) {
+        fallback = NULL;
+        for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+            struct monitor *monitor = container_of(cursor, struct monitor, list_node);
+            if (monitor->is_stale == false) {
+                fallback = monitor;
+                break;
+            }
+        }
+    }
+    if (fallback == NULL) {
+        goto CLEANUP;
+    }
+    struct list_node *cursor = global_monitors;
+    while (cursor != NULL) {
+        struct monitor *monitor = container_of(cursor, struct monitor, list_node);
+        cursor = cursor->next;
+        if (monitor->is_stale == false) {
+            continue;
+        }
+        monitor_migrate_clients(monitor, fallback);
+        list_remove(&global_monitors, &monitor->list_node);
+        monitor_free(monitor);
+    }
+    global_focused_monitor = fallback;
+    global_monitor_index_outdated = true;
+
+    monitors_arrange_pending();
+    result = 0;
+
+CLEANUP:
+    for (uint64_t i = 0; crtc_info_replies != NULL && i < crtcs_len; ++i) {
+        free(crtc_info_replies[i]);
+    }
+    free(crtc_info_replies);
+    free(crtc_info_cookies);
+    free(screen_resources_reply);
+    return result;
+}
+
+int x11_randr_init(xcb_randr_get_output_primary_cookie_t primary_output_cookie,
+                   xcb_randr_get_screen_resources_current_cookie_t screen_resources_cookie)
+{
+    xcb_randr_get_output_primary_reply_t *primary_output_reply =
+        (xcb_randr_get_output_primary_reply_t *)x11_wait_for_reply(primary_output_cookie.sequence,
+                                                                   NULL);
+    update_monitors(screen_resources_cookie);
+    if (primary_output_reply == NULL) {
+        fprintf(stderr, "Can't get primary output info from X Server!\n");
+        return 1;
+    }
+
+    if (global_monitors == NULL) {
+        free(primary_output_reply);
+        fprintf(stderr, "Can't find any active monitor!\n");
+        return 1;
+    }
+    global_focused_monitor = container_of(global_monitors, struct monitor, list_node);
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        struct monitor *monitor = container_of(cursor, struct monitor, list_node);
+        if (monitor->output == primary_output_reply->output) {
+            global_focused_monitor = monitor;
+        }
+    }
+
+    free(primary_output_reply);
+    session_restore_monitors();
+
+    global_randr_first_event =
+        xcb_get_extension_data(global_xconnection, &xcb_randr_id)->first_event;
+    xcb_randr_select_input(global_xconnection, global_screen->root,
+                           XCB_RANDR_NOTIFY_MASK_SCREEN_CHANGE | XCB_RANDR_NOTIFY_MASK_CRTC_CHANGE |
+                               XCB_RANDR_NOTIFY_MASK_OUTPUT_CHANGE);
+    xcb_set_input_focus(global_xconnection, XCB_INPUT_FOCUS_POINTER_ROOT, global_screen->root,
+                        XCB_CURRENT_TIME);
+
+    return 0;
+}
+
+// Publishes the static EWMH root properties and clears what a previous window manager left behind.
+void x11_ewmh_init(void)
+{
+    global_supporting_window = xcb_generate_id(global_xconnection);
+    xcb_create_window(global_xconnection, XCB_COPY_FROM_PARENT, global_supporting_window,
+                      global_screen->root, -1, -1, 1, 1, 0, XCB_WINDOW_CLASS_INPUT_ONLY,
+                      XCB_COPY_FROM_PARENT, 0, NULL);
+    xcb_window_t windows[] = {global_supporting_window, global_screen->root};
+    for (uint64_t i = 0; i < sizeof(windows) / sizeof(windows[0]); ++i) {
+        xcb_change_property(global_xconnection, XCB_PROP_MODE_REPLACE, windows[i],
+                            global_ewmh_connection->_NET_SUPPORTING_WM_CHECK, XCB_ATOM_WINDOW, 32,
+                            1, &global_supporting_window);
+    }
+    xcb_change_property(global_xconnection, XCB_PROP_MODE_REPLACE, global_supporting_window,
+                        global_ewmh_connection->_NET_WM_NAME, global_ewmh_connection->UTF8_STRING,
+                        8, strlen("ewm"), "ewm");
+
+    xcb_atom_t supported[] = {global_ewmh_connection->_NET_SUPPORTED,
+                              global_ewmh_connection->_NET_SUPPORTING_WM_CHECK,
+                              global_ewmh_connection->_NET_CLIENT_LIST,
+                              global_ewmh_connection->_NET_CLIENT_LIST_STACKING,
+                              global_ewmh_connection->_NET_ACTIVE_WINDOW,
+                              global_ewmh_connection->_NET_NUMBER_OF_DESKTOPS,
+                              global_ewmh_connection->_NET_CURRENT_DESKTOP,
+                              global_ewmh_connection->_NET_WM_NAME,
+                              global_ewmh_connection->_NET_WM_DESKTOP,
+                              global_ewmh_connection->_NET_WM_STATE,
+                              global_ewmh_connection->_NET_WM_STATE_FULLSCREEN,
+                              global_ewmh_connection->_NET_WM_SYNC_REQUEST,
+                              global_ewmh_connection->_NET_WM_SYNC_REQUEST_COUNTER};
+    xcb_change_property(global_xconnection, XCB_PROP_MODE_REPLACE, global_screen->root,
+                        global_ewmh_connection->_NET_SUPPORTED, XCB_ATOM_ATOM, 32,
+                        sizeof(supported) / sizeof(supported[0]), supported);
+    uint32_t desktops_num = TAGS_NUM;
+    xcb_change_property(global_xconnection, XCB_PROP_MODE_REPLACE, global_screen->root,
+                        global_ewmh_connection->_NET_NUMBER_OF_DESKTOPS, XCB_ATOM_CARDINAL, 32, 1,
+                        &desktops_num);
+    xcb_window_t active_window = XCB_NONE;
+    xcb_change_property(global_xconnection, XCB_PROP_MODE_REPLACE, global_screen->root,
+                        global_ewmh_connection->_NET_ACTIVE_WINDOW, XCB_ATOM_WINDOW, 32, 1,
+                        &active_window);
+    // Managed windows are appended from here on, starting with the ones found by the scan.
+    client_list_publish(global_ewmh_connection->_NET_CLIENT_LIST, XCB_PROP_MODE_REPLACE, NULL, 0);
+    client_list_publish(global_ewmh_connection->_NET_CLIENT_LIST_STACKING, XCB_PROP_MODE_REPLACE,
+                        NULL, 0);
+}
+
+// Everything startup needs is requested in one burst and the replies are collected afterwards, so
+// the number of round trips doesn't grow with the number of atoms. Only the RandR queries have to
+// wait for the extension to be known, since XCB can't encode them before.
+int x11_init(void)
+{
+    TRACE_SCOPE("x11_init");
+    int32_t screen_num = 0;
+    global_xconnection = global_x11_connect(NULL, &screen_num);
+    if (xcb_connection_has_error(global_xconnection)) {
+        fprintf(stderr, "Can't connect to X Server!\n");
+        return 1;
+    }
+    // The connection setup is a round trip of its own.
+    x11_count_round_trip();
+
+    xcb_screen_iterator_t iterator = xcb_setup_roots_iterator(xcb_get_setup(global_xconnection));
+    for (uint64_t i = 0; i < screen_num; ++i) {
+        xcb_screen_next(&iterator);
+    }
+    global_screen = iterator.data;
+
+    xcb_prefetch_extension_data(global_xconnection, &xcb_randr_id);
+    xcb_prefetch_extension_data(global_xconnection, &xcb_sync_id);
+    xcb_prefetch_extension_data(global_xconnection, &xcb_shm_id);
+    uint32_t event_mask[] = {(XCB_EVENT_MASK_SUBSTRUCTURE_REDIRECT |
+                              XCB_EVENT_MASK_SUBSTRUCTURE_NOTIFY | XCB_EVENT_MASK_STRUCTURE_NOTIFY |
+                              XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_POINTER_MOTION)};
+    xcb_void_cookie_t event_mask_cookie = xcb_change_window_attributes_checked(
+        global_xconnection, global_screen->root, XCB_CW_EVENT_MASK, event_mask);
+    // Grabbed once on the root for every window. NumLock and CapsLock must not prevent a drag, so
+    // each button is also grabbed with them.
+    const uint16_t lock_masks[] = {0, XCB_MOD_MASK_LOCK, XCB_MOD_MASK_2,
+                                   XCB_MOD_MASK_LOCK | XCB_MOD_MASK_2};
+    for (uint64_t i = 0; i < sizeof(lock_masks) / sizeof(lock_masks[0]); ++i) {
+        xcb_grab_button(global_xconnection, false, global_screen->root,
+                        XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE |
+                            XCB_EVENT_MASK_POINTER_MOTION,
+                        XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC, XCB_NONE, XCB_NONE,
+                        XCB_BUTTON_INDEX_1, global_drag_modifier | lock_masks[i]);
+        xcb_grab_button(global_xconnection, false, global_screen->root,
+                        XCB_EVENT_MASK_BUTTON_PRESS | XCB_EVENT_MASK_BUTTON_RELEASE |
+                            XCB_EVENT_MASK_POINTER_MOTION,
+                        XCB_GRAB_MODE_ASYNC, XCB_GRAB_MODE_ASYNC, XCB_NONE, XCB_NONE,
+                        XCB_BUTTON_INDEX_3, global_drag_modifier | lock_masks[i]);
+    }
+    global_ewmh_connection = (xcb_ewmh_connection_t *)malloc(sizeof(xcb_ewmh_connection_t));
+    if (global_ewmh_connection == NULL) {
+        fprintf(stderr, "Can't allocate EWMH connection!\n");
+        return 1;
+    }
+    xcb_intern_atom_cookie_t *ewmh_cookies =
+        xcb_ewmh_init_atoms(global_xconnection, global_ewmh_connection);
+    xcb_intern_atom_cookie_t wm_atom_cookies[WM_END];
+    for (uint64_t i = 0; i < WM_END; ++i) {
+        wm_atom_cookies[i] = xcb_intern_atom(global_xconnection, 0,
+                                             strlen(global_wm_atom_names[i]),
+                                             global_wm_atom_names[i]);
+    }
+    xcb_query_tree_cookie_t query_tree_cookie =
+        xcb_query_tree(global_xconnection, global_screen->root);
+    global_bar_font = xcb_generate_id(global_xconnection);
+    xcb_open_font(global_xconnection, global_bar_font, strlen(global_bar_font_name),
+                  global_bar_font_name);
+    xcb_query_font_cookie_t query_font_cookie = xcb_query_font(global_xconnection, global_bar_font);
+
+    // Waits for the extension only, the rest of the burst is still on its way.
+    x11_before_wait();
+    bool has_randr = xcb_get_extension_data(global_xconnection, &xcb_randr_id)->present != 0;
+    x11_count_round_trip();
+    // Answered in the same batch as RandR, and optional.
+    const xcb_query_extension_reply_t *sync_extension =
+        xcb_get_extension_data(global_xconnection, &xcb_sync_id);
+    if (sync_extension->present != 0) {
+        global_sync_first_event = sync_extension->first_event;
+        xcb_discard_reply(
+            global_xconnection,
+            xcb_sync_initialize(global_xconnection, XCB_SYNC_MAJOR_VERSION, XCB_SYNC_MINOR_VERSION)
+                .sequence);
+    }
+    const xcb_query_extension_reply_t *shm_extension =
+        xcb_get_extension_data(global_xconnection, &xcb_shm_id);
+    global_has_shm = shm_extension->present != 0;
+    global_shm_first_event = shm_extension->first_event;
+    xcb_randr_get_output_primary_cookie_t primary_output_cookie = {0};
+    xcb_randr_get_screen_resources_current_cookie_t screen_resources_cookie = {0};
+    if (has_randr == true) {
+        primary_output_cookie =
+            xcb_randr_get_output_primary(global_xconnection, global_screen->root);
+        screen_resources_cookie =
+            xcb_randr_get_screen_resources_current(global_xconnection, global_screen->root);
+    }
+
+    int result = 0;
+    x11_before_wait();
+    if (xcb_ewmh_init_atoms_replies(global_ewmh_connection, ewmh_cookies, NULL) == 0) {
+        free(global_ewmh_connection);
+        global_ewmh_connection = NULL;
+        fprintf(stderr, "Can't initialize EWMH atoms!\n");
+        result = 1;
+    }
+    x11_count_round_trip();
+    for (uint64_t i = 0; i < WM_END; ++i) {
+        xcb_intern_atom_reply_t *intern_atom_reply =
+            (xcb_intern_atom_reply_t *)x11_wait_for_reply(wm_atom_cookies[i].sequence, NULL);
+        global_wm_atoms[i] = intern_atom_reply != NULL ? intern_atom_reply->atom : XCB_ATOM_NONE;
+        free(intern_atom_reply);
+    }
+    // Known before the monitors are set up, which reserve the bar height at their top.
+    xcb_query_font_reply_t *query_font_reply =
+        (xcb_query_font_reply_t *)x11_wait_for_reply(query_font_cookie.sequence, NULL);
+    if (bar_init(query_font_reply) != 0) {
+        fprintf(stderr, "Can't load bar font, continuing without bar!\n");
+    }
+    free(query_font_reply);
+    // Checked only now that later replies are in, so XCB already knows the outcome and the check
+    // costs no round trip of its own.
+    xcb_generic_error_t *error = x11_request_check(event_mask_cookie);
+    if (error != NULL) {
+        free(error);
+        fprintf(stderr, "Can't register to X Server for reparenting!\n");
+        fprintf(stderr, "Maybe there's another window manager already running?\n");
+        result = 1;
+    }
+    if (has_randr == false) {
+        fprintf(stderr, "Failed to get RandR extension!\n");
+        result = 1;
+    }
+    if (result != 0) {
+        xcb_discard_reply(global_xconnection, query_tree_cookie.sequence);
+        if (has_randr == true) {
+            xcb_discard_reply(global_xconnection, primary_output_cookie.sequence);
+            xcb_discard_reply(global_xconnection, screen_resources_cookie.sequence);
+        }
+        return 1;
+    }
+
+    if (x11_randr_init(primary_output_cookie, screen_resources_cookie) != 0) {
+        xcb_discard_reply(global_xconnection, query_tree_cookie.sequence);
+        fprintf(stderr, "RandR-specific initialization failed!\n");
+        return 1;
+    }
+
+    x11_ewmh_init();
+
+    if (x11_scan_windows(query_tree_cookie) != 0) {
+        return 1;
+    }
+    session_restore_focus();
+    session_unload();
+
+    return 0;
+}
+
+void handle_client_message(xcb_client_message_event_t *event)
+{
+    struct client *client = get_client_by_win(event->window);
+    if (client == NULL) {
+        return;
+    }
+
+    if (event->type == global_ewmh_connection->_NET_WM_STATE) {
+        if (event->data.data32[1] != global_ewmh_connection->_NET_WM_STATE_FULLSCREEN &&
+            event->data.data32[2] != global_ewmh_connection->_NET_WM_STATE_FULLSCREEN) {
+            return;
+        }
+        if (event->data.data32[0] == XCB_EWMH_WM_STATE_ADD ||
+            event->data.data32[0] == XCB_EWMH_WM_STATE_TOGGLE && client->is_fullscreen == false) {
+            client_enable_fullscreen(client);
+            return;
+        }
+        if (client->is_fullscreen == true) {
+            client_disable_fullscreen(client);
+        }
+        return;
+    }
+
+    if (event->type == global_ewmh_connection->_NET_ACTIVE_WINDOW) {
+        if (client == global_focused_monitor->focused_client || client->is_urgent == true) {
+            return;
+        }
+        // Shown in the bar, focusing the client clears it.
+        client->is_urgent = true;
+    }
+}
+
+void handle_configure_notify(xcb_configure_notify_event_t *event)
+{
+    ;
+}
+
+void configure_request_apply(const xcb_configure_request_event_t *const event)
+{
+    ++global_configure_counters.requests_applied;
+    struct client *client = get_client_by_win(event->window);
+    if (client == NULL) {
+        uint32_t values[7];
+        uint8_t i = 0;
+        if (event->value_mask & XCB_CONFIG_WINDOW_X) {
+            values[i++] = event->x;
+        }
+        if (event->value_mask & XCB_CONFIG_WINDOW_Y) {
+            values[i++] = event->y;
+        }
+        if (event->value_mask & XCB_CONFIG_WINDOW_WIDTH) {
+            values[i++] = event->width;
+        }
+        if (event->value_mask & XCB_CONFIG_WINDOW_HEIGHT) {
+            values[i++] = event->height;
+        }
+        if (event->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) {
+            values[i++] = event->border_width;
+        }
+        if (event->value_mask & XCB_CONFIG_WINDOW_SIBLING) {
+            values[i++] = event->sibling;
+        }
+        if (event->value_mask & XCB_CONFIG_WINDOW_STACK_MODE) {
+            values[i++] = event->stack_mode;
+        }
+        xcb_configure_window(global_xconnection, event->window, event->value_mask, values);
+        return;
+    }
+
+    if (event->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) {
+        client->border_width = event->border_width;
+        return;
+    }
+
+    if (client->is_floating == false) {
+        client_configure(client);
+        return;
+    }
+
+    struct monitor *monitor = client->monitor;
+    struct box box = client->box;
+    if (event->value_mask & XCB_CONFIG_WINDOW_X) {
+        box.x = monitor->box.x + event->x;
+    }
+    if (event->value_mask & XCB_CONFIG_WINDOW_Y) {
+        box.y = monitor->box.y + event->y;
+    }
+    if (event->value_mask & XCB_CONFIG_WINDOW_WIDTH) {
+        box.width = event->width;
+    }
+    if (event->value_mask & XCB_CONFIG_WINDOW_HEIGHT) {
+        box.height = event->height;
+    }
+    uint16_t borders = 2 * client->border_width;
+    if (box.x + box.width > monitor->box.x + monitor->box.width) {
+        box.x = monitor->box.x + (monitor->box.width / 2 - (box.width + borders) / 2);
+    }
+    if (box.y + box.height > monitor->box.y + monitor->box.height) {
+        box.y = monitor->box.y + (monitor->box.height / 2 - (box.height + borders) / 2);
+    }
+    client_move_resize(client, box.x, box.y, box.width, box.height);
+    if (event->value_mask & (XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y) &&
+        !(event->value_mask & (XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT))) {
+        client_configure(client);
+    }
+}
+
+// ConfigureRequests are merged per window for the whole event batch. The last value of each
+// value-mask bit wins and configure_requests_apply() answers every window once, so a client
+// flooding requests while it is resized costs one configure per batch.
+static xcb_configure_request_event_t *global_configure_requests = NULL;
+static uint64_t global_configure_requests_num = 0;
+static uint64_t global_configure_requests_capacity = 0;
+
+// Open-addressing index from window to its pending request, hashed like the client table. It only
+// lives for one batch, so slots are never deleted: a request applied or discarded early gets its
+// window cleared instead, and the slot is pointed at the new request if the window asks again.
+struct configure_request_slot {
+    xcb_window_t window;
+    uint32_t idx;
+};
+
+static struct configure_request_slot *global_configure_request_slots = NULL;
+static uint32_t global_configure_request_slots_capacity = 0;
+static uint32_t global_configure_request_slots_shift = 0;
+static uint32_t global_configure_request_slots_size = 0;
+
+static inline uint32_t configure_request_slot_index(xcb_window_t window)
+{
+    return (uint32_t)(window * 2654435769u) >> global_configure_request_slots_shift;
+}
+
+int configure_request_slots_grow(void)
+{
+    uint32_t new_capacity = global_configure_request_slots_capacity == 0
+                                ? 64
+                                : global_configure_request_slots_capacity * 2;
+    struct configure_request_slot *new_slots = (struct configure_request_slot *)calloc(
+        new_capacity, sizeof(struct configure_request_slot));
+    if (new_slots == NULL) {
+        return 1;
+    }
+    struct configure_request_slot *old_slots = global_configure_request_slots;
+    uint32_t old_capacity = global_configure_request_slots_capacity;
+    global_configure_request_slots = new_slots;
+    global_configure_request_slots_capacity = new_capacity;
+    global_configure_request_slots_shift =
+        old_capacity == 0 ? 32 - 6 : global_configure_request_slots_shift - 1;
+    for (uint32_t i = 0; i < old_capacity; ++i) {
+        if (old_slots[i].window == XCB_NONE) {
+            continue;
+        }
+        uint32_t idx = configure_request_slot_index(old_slots[i].window);
+        while (new_slots[idx].window != XCB_NONE) {
+            idx = (idx + 1) & (new_capacity - 1);
+        }
+        new_slots[idx] = old_slots[i];
+    }
+    free(old_slots);
+    return 0;
+}
+
+// Returns the slot of the window, or the empty slot where it would go.
+struct configure_request_slot *configure_request_slot(xcb_window_t window)
+{
+    uint32_t idx = configure_request_slot_index(window);
+    while (global_configure_request_slots[idx].window != XCB_NONE &&
+           global_configure_request_slots[idx].window != window) {
+        idx = (idx + 1) & (global_configure_request_slots_capacity - 1);
+    }
+    return &global_configure_request_slots[idx];
+}
+
+int64_t configure_request_find(xcb_window_t window)
+{
+    if (global_configure_request_slots_size == 0) {
+        return -1;
+    }
+    struct configure_request_slot *slot = configure_request_slot(window);
+    if (slot->window == XCB_NONE || global_configure_requests[slot->idx].window != window) {
+        return -1;
+    }
+    return slot->idx;
+}
+
+void configure_request_remove(uint64_t idx)
+{
+    // Mark it in place to keep the order, restacking requests of other windows may depend on it.
+    global_configure_requests[idx].window = XCB_NONE;
+}
+
+void configure_requests_apply(void)
+{
+    TRACE_SCOPE("configure_requests_apply");
+    for (uint64_t i = 0; i < global_configure_requests_num; ++i) {
+        if (global_configure_requests[i].window != XCB_NONE) {
+            configure_request_apply(&global_configure_requests[i]);
+        }
+    }
+    global_configure_requests_num = 0;
+    if (global_configure_request_slots_size != 0) {
+        memset(global_configure_request_slots, 0,
+               global_configure_request_slots_capacity * sizeof(struct configure_request_slot));
+        global_configure_request_slots_size = 0;
+    }
+}
+
+// Applies the merged request of a window right away, for events that must see its outcome.
+void configure_request_apply_window(xcb_window_t window)
+{
+    int64_t idx = configure_request_find(window);
+    if (idx < 0) {
+        return;
+    }
+    xcb_configure_request_event_t request = global_configure_requests[idx];
+    configure_request_remove(idx);
+    configure_request_apply(&request);
+}
+
+void configure_request_discard_window(xcb_window_t window)
+{
+    int64_t idx = configure_request_find(window);
+    if (idx >= 0) {
+        configure_request_remove(idx);
+    }
+}
+
+void handle_configure_request(xcb_configure_request_event_t *event)
+{
+    ++global_configure_counters.requests_received;
+    int64_t idx = configure_request_find(event->window);
+    if (idx < 0) {
+        uint32_t slots_size = global_configure_request_slots_size;
+        if ((slots_size + 1) * 2 > global_configure_request_slots_capacity &&
+            configure_request_slots_grow() != 0) {
+            configure_request_apply(event);
+            return;
+        }
+        if (global_configure_requests_num == global_configure_requests_capacity) {
+            uint64_t new_capacity = global_configure_requests_capacity == 0
+                                        ? 16
+                                        : global_configure_requests_capacity * 2;
+            xcb_configure_request_event_t *new_configure_requests =
+                (xcb_configure_request_event_t *)realloc(
+                    global_configure_requests,
+                    new_capacity * sizeof(xcb_configure_request_event_t));
+            if (new_configure_requests == NULL) {
+                configure_request_apply(event);
+                return;
+            }
+            global_configure_requests = new_configure_requests;
+            global_configure_requests_capacity = new_capacity;
+        }
+        struct configure_request_slot *slot = configure_request_slot(event->window);
+        if (slot->window == XCB_NONE) {
+            slot->window = event->window;
+            ++global_configure_request_slots_size;
+        }
+        slot->idx = global_configure_requests_num;
+        global_configure_requests[global_configure_requests_num++] = *event;
+        return;
+    }
+
+    xcb_configure_request_event_t *request = &global_configure_requests[idx];
+    if (event->value_mask & XCB_CONFIG_WINDOW_X) {
+        request->x = event->x;
+    }
+    if (event->value_mask & XCB_CONFIG_WINDOW_Y) {
+        request->y = event->y;
+    }
+    if (event->value_mask & XCB_CONFIG_WINDOW_WIDTH) {
+        request->width = event->width;
+    }
+    if (event->value_mask & XCB_CONFIG_WINDOW_HEIGHT) {
+        request->height = event->height;
+    }
+    if (event->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) {
+        request->border_width = event->border_width;
+    }
+    if (event->value_mask & XCB_CONFIG_WINDOW_SIBLING) {
+        request->sibling = event->sibling;
+    }
+    if (event->value_mask & XCB_CONFIG_WINDOW_STACK_MODE) {
+        request->stack_mode = event->stack_mode;
+    }
+    request->value_mask |= event->value_mask;
+}
+
+void client_unmanage(struct client *const client)
+{
+    struct monitor *monitor = client->monitor;
+    monitor_remove_client(monitor, client);
+    client_list_remove(client->window);
+    client_free(client);
+    monitor->needs_arrange = true;
+}
+
+void handle_destroy_notify(xcb_destroy_notify_event_t *event)
+{
+    configure_request_discard_window(event->window);
+    struct client *client = get_client_by_win(event->window);
+    if (client == NULL) {
+        return;
+    }
+    client_unmanage(client);
+}
+
+// A BadWindow on a client window means the window died before its DestroyNotify was read, so the
+// client is dropped right away instead of receiving more requests. A failed alarm only turns sync
+// requests off for its client. Other errors without a route are just counted.
+void handle_error(xcb_generic_error_t *error)
+{
+    ++global_error_counters.received;
+    ++global_error_counters.codes[error->error_code];
+    // Routes are added in sequence order, so the search stops at the first older one.
+    struct error_route *route = NULL;
+    uint64_t first = global_error_routes_head > ERROR_ROUTES_NUM
+                         ? global_error_routes_head - ERROR_ROUTES_NUM
+                         : 0;
+    for (uint64_t i = global_error_routes_head; i > first; --i) {
+        struct error_route *candidate = &global_error_routes[(i - 1) & (ERROR_ROUTES_NUM - 1)];
+        if ((int32_t)(candidate->sequence - error->full_sequence) < 0) {
+            break;
+        }
+        if (candidate->sequence == error->full_sequence && candidate->type != ERROR_ROUTE_NONE) {
+            route = candidate;
+            break;
+        }
+    }
+    if (route == NULL) {
+        struct client *client =
+            error->error_code == XCB_WINDOW ? get_client_by_win(error->resource_id) : NULL;
+        if (client != NULL) {
+            configure_request_discard_window(client->window);
+            client_unmanage(client);
+            ++global_error_counters.clients_dropped;
+        }
+        return;
+    }
+    ++global_error_counters.routed;
+    uint8_t type = route->type;
+    route->type = ERROR_ROUTE_NONE;
+    if (type == ERROR_ROUTE_BAR_SHM) {
+        bars_disable_shm();
+        return;
+    }
+    struct client *client = get_client_by_win(route->window);
+    if (client == NULL) {
+        return;
+    }
+    switch (type) {
+    case ERROR_ROUTE_CLIENT:
+        if (error->error_code == XCB_WINDOW) {
+            configure_request_discard_window(client->window);
+            client_unmanage(client);
+            ++global_error_counters.clients_dropped;
+        }
+        break;
+    case ERROR_ROUTE_SYNC_ALARM:
+        client->sync_alarm = XCB_NONE;
+        if (client->is_waiting_sync == true) {
+            client_sync_done(client);
+        }
+        break;
+    }
+}
+
+// Focus follows the pointer into a client. Crossings that only happened because one of our own
+// configures moved a window under a resting pointer are dropped, see focus_barrier_update().
+void handle_enter_notify(xcb_enter_notify_event_t *event)
+{
+    if (event->mode != XCB_NOTIFY_MODE_NORMAL || event->detail == XCB_NOTIFY_DETAIL_INFERIOR ||
+        global_drag.mode != DRAG_NONE) {
+        return;
+    }
+    if ((int32_t)(((xcb_generic_event_t *)event)->full_sequence - global_focus_barrier_sequence) <
+        0) {
+        ++global_focus_counters.enters_suppressed;
+        return;
+    }
+    struct client *client = get_client_by_win(event->event);
+    if (client == NULL) {
+        return;
+    }
+    ++global_focus_counters.enters_handled;
+    if (client->monitor != global_focused_monitor) {
+        monitor_focus(client->monitor);
+    }
+    if (client != client->monitor->focused_client) {
+        monitor_focus_client(client->monitor, client);
+    }
+}
+
+void handle_focus_in(xcb_focus_in_event_t *event) {}
+void handle_mapping_notify(xcb_mapping_notify_event_t *event) {}
+
+void handle_map_request(xcb_map_request_event_t *event)
+{
+    // Clients commonly resize right before mapping, adoption must read the resulting geometry.
+    configure_request_apply_window(event->window);
+    if (get_client_by_win(event->window) != NULL) {
+        return;
+    }
+    pending_client_queue(event->window, false);
+}
+
+int hit_index_items_reserve(uint64_t items_num)
+{
+    if (items_num <= global_hit_index_items_capacity) {
+        return 0;
+    }
+    uint64_t new_capacity = max(items_num, global_hit_index_items_capacity * 2);
+    struct box_index_entry *new_items = (struct box_index_entry *)realloc(
+        global_hit_index_items, new_capacity * sizeof(struct box_index_entry));
+    if (new_items == NULL) {
+        return 1;
+    }
+    global_hit_index_items = new_items;
+    global_hit_index_items_capacity = new_capacity;
+    return 0;
+}
+
+struct monitor *get_monitor_by_point(int16_t x, int16_t y)
+{
+    if (global_monitor_index_outdated == true) {
+        uint64_t monitors_num = 0;
+        for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+            ++monitors_num;
+        }
+        if (hit_index_items_reserve(monitors_num) != 0) {
+            return NULL;
+        }
+        monitors_num = 0;
+        for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+            struct monitor *monitor = container_of(cursor, struct monitor, list_node);
+            struct box_index_entry item = {monitor->crtc_box, monitor};
+            global_hit_index_items[monitors_num++] = item;
+        }
+        if (box_index_build(&global_monitor_index, global_hit_index_items, monitors_num) != 0) {
+            return NULL;
+        }
+        global_monitor_index_outdated = false;
+    }
+    return (struct monitor *)box_index_find(&global_monitor_index, x, y);
+}
+
+void client_set_monitor(struct client *const client, struct monitor *const monitor)
+{
+    struct monitor *from = client->monitor;
+    bool was_focused = client == from->focused_client;
+    monitor_remove_client(from, client);
+    if (monitor_append_client(monitor, client) != 0) {
+        fprintf(stderr, "Can't move client to another monitor!\n");
+        monitor_append_client(from, client);
+        return;
+    }
+    bool is_desktop_changed = __builtin_ctz(monitor->enabled_tags) != __builtin_ctz(client->tags);
+    client->tags = monitor->enabled_tags;
+    if (is_desktop_changed == true) {
+        client_publish_desktop(client);
+    }
+    if (was_focused == true) {
+        monitor_focus_client(monitor, client);
+        if (from == global_focused_monitor) {
+            monitor_focus(monitor);
+        }
+    }
+    from->needs_arrange = true;
+    monitor->needs_arrange = true;
+}
+
+void drag_arm_timer(uint64_t interval_ns)
+{
+    struct itimerspec spec = {0};
+    spec.it_value.tv_sec = interval_ns / 1000000000;
+    spec.it_value.tv_nsec = interval_ns % 1000000000;
+    if (timerfd_settime(global_timer_fd, 0, &spec, NULL) != 0) {
+        fprintf(stderr, "Can't arm frame timer!\n");
+        return;
+    }
+    global_drag.is_timer_armed = interval_ns != 0;
+}
+
+// Sends the latest target and holds the next one back until the monitor has shown a frame.
+void drag_commit(void)
+{
+    global_drag.has_target = false;
+    struct client *client = global_drag.client;
+    if (client == NULL) {
+        return;
+    }
+    client_move_resize(client, global_drag.target.x, global_drag.target.y,
+                       global_drag.target.width, global_drag.target.height);
+    drag_arm_timer(client->monitor->refresh_interval_ns);
+}
+
+static inline int16_t snap_position(int16_t position, int16_t length, int16_t start, int16_t end)
+{
+    if (abs(position - start) < global_snap_distance) {
+        return start;
+    }
+    if (abs(end - position - length) < global_snap_distance) {
+        return end - length;
+    }
+    return position;
+}
+
+void drag_update(int16_t pointer_x, int16_t pointer_y)
+{
+    struct client *client = global_drag.client;
+    if (client == NULL) {
+        return;
+    }
+    struct box box = global_drag.box;
+    int32_t dx = pointer_x - global_drag.pointer_x;
+    int32_t dy = pointer_y - global_drag.pointer_y;
+    if (global_drag.mode == DRAG_MOVE) {
+        box.x += dx;
+        box.y += dy;
+    } else {
+        box.width = max(box.width + dx, 1);
+        box.height = max(box.height + dy, 1);
+    }
+
+    struct monitor *monitor = get_monitor_by_point(pointer_x, pointer_y);
+    if (monitor != NULL && monitor != client->monitor) {
+        client_set_monitor(client, monitor);
+        monitor_focus(monitor);
+        monitor_focus_client(monitor, client);
+    }
+    box = get_box_with_size_hints(client, box);
+    if (global_drag.mode == DRAG_MOVE) {
+        struct box area = client->monitor->box;
+        uint16_t borders = 2 * client->border_width;
+        box.x = snap_position(box.x, box.width + borders, area.x, area.x + area.width);
+        box.y = snap_position(box.y, box.height + borders, area.y, area.y + area.height);
+    }
+    global_drag.target = box;
+    global_drag.has_target = true;
+    if (global_drag.is_timer_armed == false) {
+        drag_commit();
+    }
+}
+
+void drag_end(void)
+{
+    if (global_drag.has_target == true) {
+        drag_commit();
+    }
+    if (global_drag.is_timer_armed == true) {
+        drag_arm_timer(0);
+    }
+    global_drag.mode = DRAG_NONE;
+    global_drag.client = NULL;
+}
+
+// Only reached through the button grabs of x11_init(), so the pointer is already grabbed until the
+// button is released.
+void handle_button_press(xcb_button_press_event_t *event)
+{
+    if (global_drag.mode != DRAG_NONE || (event->state & global_drag_modifier) == 0) {
+        return;
+    }
+    struct client *client = get_client_by_win(event->child);
+    if (client == NULL || client->is_fullscreen == true) {
+        return;
+    }
+    if (event->detail == XCB_BUTTON_INDEX_1) {
+        global_drag.mode = DRAG_MOVE;
+    } else if (event->detail == XCB_BUTTON_INDEX_3) {
+        global_drag.mode = DRAG_RESIZE;
+    } else {
+        return;
+    }
+    if (client->is_floating == false) {
+        client->is_floating = true;
+        client->monitor->needs_arrange = true;
+    }
+    global_drag.client = client;
+    global_drag.pointer_x = event->root_x;
+    global_drag.pointer_y = event->root_y;
+    global_drag.box = client->box;
+    global_drag.has_target = false;
+
+    uint32_t values[] = {XCB_STACK_MODE_ABOVE};
+    xcb_void_cookie_t cookie = xcb_configure_window(global_xconnection, client->window,
+                                                    XCB_CONFIG_WINDOW_STACK_MODE, values);
+    error_route(cookie.sequence, ERROR_ROUTE_CLIENT, client->window);
+    client_list_raise(client->window);
+    if (client->monitor != global_focused_monitor) {
+        monitor_focus(client->monitor);
+    }
+    monitor_focus_client(client->monitor, client);
+}
+
+void handle_button_release(xcb_button_release_event_t *event)
+{
+    if (global_drag.mode == DRAG_NONE) {
+        return;
+    }
+    drag_update(event->root_x, event->root_y);
+    drag_end();
+}
+
+void handle_motion_notify(xcb_motion_notify_event_t *event)
+{
+    if (event->root != global_screen->root) {
+        return;
+    }
+    if (global_drag.mode != DRAG_NONE) {
+        drag_update(event->root_x, event->root_y);
+        return;
+    }
+    struct monitor *monitor = get_monitor_by_point(event->root_x, event->root_y);
+    if (monitor == NULL || monitor == global_focused_monitor) {
+        return;
+    }
+    monitor_focus(monitor);
+}
+
+void handle_property_notify(xcb_property_notify_event_t *event)
+{
+    struct client *client = get_client_by_win(event->window);
+    if (client == NULL) {
+        return;
+    }
+    uint16_t property = 0;
+    if (event->atom == global_ewmh_connection->_NET_WM_NAME) {
+        property = PROPERTY_NET_WM_NAME;
+    } else if (event->atom == XCB_ATOM_WM_NAME) {
+        property = PROPERTY_WM_NAME;
+    } else if (event->atom == XCB_ATOM_WM_CLASS) {
+        property = PROPERTY_WM_CLASS;
+    } else if (event->atom == XCB_ATOM_WM_HINTS) {
+        property = PROPERTY_WM_HINTS;
+    } else if (event->atom == XCB_ATOM_WM_NORMAL_HINTS) {
+        property = PROPERTY_WM_NORMAL_HINTS;
+    } else if (event->atom == global_wm_atoms[WM_PROTOCOLS]) {
+        property = PROPERTY_WM_PROTOCOLS;
+    } else if (event->atom == global_ewmh_connection->_NET_WM_SYNC_REQUEST_COUNTER) {
+        property = PROPERTY_SYNC_REQUEST_COUNTER;
+    } else if (event->atom == global_ewmh_connection->_NET_WM_PID) {
+        property = PROPERTY_NET_WM_PID;
+    } else if (event->atom == global_ewmh_connection->_NET_WM_ICON) {
+        property = PROPERTY_NET_WM_ICON;
+    } else {
+        return;
+    }
+    ++global_property_counters.notifies;
+    client_mark_properties(client, property);
+}
+void handle_unmap_notify(xcb_unmap_notify_event_t *event) {}
+
+void handle_randr_screen_change_notify(xcb_randr_screen_change_notify_event_t *event)
+{
+    if (event->root != global_screen->root) {
+        return;
+    }
+    global_screen_width = event->width;
+    global_screen_height = event->height;
+    global_monitors_outdated = true;
+}
+
+void handle_randr_notify(xcb_randr_notify_event_t *event)
+{
+    if (event->subCode == XCB_RANDR_NOTIFY_CRTC_CHANGE ||
+        event->subCode == XCB_RANDR_NOTIFY_OUTPUT_CHANGE) {
+        global_monitors_outdated = true;
+    }
+}
+
+void handle_sync_alarm_notify(xcb_sync_alarm_notify_event_t *event)
+{
+    uint64_t counter_value =
+        (uint64_t)(uint32_t)event->counter_value.hi << 32 | event->counter_value.lo;
+    for (uint64_t i = 0; i < global_sync_waits_num; ++i) {
+        struct client *client = get_client_by_win(global_sync_waits[i]);
+        if (client == NULL || client->sync_alarm != event->alarm) {
+            continue;
+        }
+        if (client->is_waiting_sync == true && counter_value >= client->sync_value) {
+            sync_waits_remove(i);
+            client_sync_done(client);
+        }
+        return;
+    }
+}
+
+void handle_event(xcb_generic_event_t *event)
+{
+    if (XCB_EVENT_RESPONSE_TYPE(event) == 0) {
+        handle_error((xcb_generic_error_t *)event);
+        return;
+    }
+    // A single hot-plug produces a handful of these. They only flag the monitors as outdated, and
+    // update_monitors() runs once the whole batch has been handled.
+    if (XCB_EVENT_RESPONSE_TYPE(event) ==
+        global_randr_first_event + XCB_RANDR_SCREEN_CHANGE_NOTIFY) {
+        handle_randr_screen_change_notify((xcb_randr_screen_change_notify_event_t *)event);
+        return;
+    }
+    if (XCB_EVENT_RESPONSE_TYPE(event) == global_randr_first_event + XCB_RANDR_NOTIFY) {
+        handle_randr_notify((xcb_randr_notify_event_t *)event);
+        return;
+    }
+    if (global_sync_first_event != 0 &&
+        XCB_EVENT_RESPONSE_TYPE(event) == global_sync_first_event + XCB_SYNC_ALARM_NOTIFY) {
+        handle_sync_alarm_notify((xcb_sync_alarm_notify_event_t *)event);
+        return;
+    }
+    if (global_has_shm == true &&
+        XCB_EVENT_RESPONSE_TYPE(event) == global_shm_first_event + XCB_SHM_COMPLETION) {
+        handle_shm_completion((xcb_shm_completion_event_t *)event);
+        return;
+    }
+
+    switch (XCB_EVENT_RESPONSE_TYPE(event)) {
+    case XCB_BUTTON_PRESS:
+        handle_button_press((xcb_button_press_event_t *)event);
+        break;
+    case XCB_BUTTON_RELEASE:
+        handle_button_release((xcb_button_release_event_t *)event);
+        break;
+    case XCB_CLIENT_MESSAGE:
+        handle_client_message((xcb_client_message_event_t *)event);
+        break;
+    case XCB_CONFIGURE_NOTIFY:
+        handle_configure_notify((xcb_configure_notify_event_t *)event);
+        break;
+    case XCB_CONFIGURE_REQUEST:
+        handle_configure_request((xcb_configure_request_event_t *)event);
+        break;
+    case XCB_DESTROY_NOTIFY:
+        handle_destroy_notify((xcb_destroy_notify_event_t *)event);
+        break;
+    case XCB_ENTER_NOTIFY:
+        handle_enter_notify((xcb_enter_notify_event_t *)event);
+        break;
+    case XCB_EXPOSE:
+        handle_expose((xcb_expose_event_t *)event);
+        break;
+    case XCB_FOCUS_IN:
+        handle_focus_in((xcb_focus_in_event_t *)event);
+        break;
+    case XCB_MAPPING_NOTIFY:
+        handle_mapping_notify((xcb_mapping_notify_event_t *)event);
+        break;
+    case XCB_MAP_REQUEST:
+        handle_map_request((xcb_map_request_event_t *)event);
+        break;
+    case XCB_MOTION_NOTIFY:
+        global_pending_motion = *(xcb_motion_notify_event_t *)event;
+        global_has_pending_motion = true;
+        ++global_motion_counters.received;
+        break;
+    case XCB_PROPERTY_NOTIFY:
+        handle_property_notify((xcb_property_notify_event_t *)event);
+        break;
+    case XCB_UNMAP_NOTIFY:
+        handle_unmap_notify((xcb_unmap_notify_event_t *)event);
+        break;
+    }
+}
+
+int event_loop_add(int fd, uint32_t source)
+{
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = source};
+    return epoll_ctl(global_epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0;
+}
+
+#ifdef EWM_TRACE
+// Writes the spans, the counters and the event histograms to ewm-trace-<pid>.json in the runtime
+// directory and returns that path, or NULL if it can't be written.
+const char *trace_dump(void)
+{
+    static char path[PATH_MAX];
+    int length = snprintf(path, sizeof(path), "%s/ewm-trace-%d.json", runtime_dir(), getpid());
+    // The previous dump is replaced by a new file, so nothing someone else put at the path is ever
+    // followed or written to.
+    unlink(path);
+    int fd = length < sizeof(path)
+                 ? open(path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600)
+                 : -1;
+    FILE *file = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (file == NULL) {
+        if (fd >= 0) {
+            close(fd);
+        }
+        fprintf(stderr, "Can't write trace to %s!\n", path);
+        return NULL;
+    }
+    // The sequence number of a NoOperation is the number of requests sent so far.
+    unsigned int sequence = xcb_no_operation(global_xconnection).sequence;
+    uint64_t requests_num = sequence > 0 ? sequence - 1 : 0;
+    uint64_t now_ns = monotonic_now_ns();
+
+    fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    uint64_t head = __atomic_load_n(&global_trace_spans_head, __ATOMIC_RELAXED);
+    uint64_t first = head > TRACE_SPANS_NUM ? head - TRACE_SPANS_NUM : 0;
+    for (uint64_t i = first; i < head; ++i) {
+        const struct trace_span *span = &global_trace_spans[i & (TRACE_SPANS_NUM - 1)];
+        fprintf(file,
+                "{\"name\":\"%s\",\"cat\":\"ewm\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,"
+                "\"ts\":%.3f,\"dur\":%.3f},\n",
+                span->name, getpid(), (double)span->start_ns / 1000,
+                (double)span->duration_ns / 1000);
+    }
+    fprintf(file,
+            "{\"name\":\"counters\",\"ph\":\"C\",\"pid\":%d,\"tid\":1,\"ts\":%.3f,\"args\":{"
+            "\"requests\":%lu,\"round_trips\":%u,\"configures_sent\":%lu,"
+            "\"configures_skipped\":%lu,\"configure_requests\":%lu,\"property_fetches\":%lu,"
+            "\"client_list_rewrites\":%lu,\"errors\":%lu,\"errors_routed\":%lu,"
+            "\"metadata_records\":%lu}}\n",
+            getpid(), (double)now_ns / 1000, requests_num, global_round_trips,
+            global_configure_counters.sent, global_configure_counters.skipped,
+            global_configure_counters.requests_received, global_property_counters.fetches_sent,
+            global_ewmh_counters.rewrites, global_error_counters.received,
+            global_error_counters.routed, global_metadata_counters.records);
+
+    // Trace viewers ignore keys they don't know, so the histograms ride along in the same file.
+    fprintf(file, "],\"ewmEventHistograms\":{");
+    bool is_first = true;
+    for (uint64_t type = 0; type < TRACE_EVENT_TYPES_NUM; ++type) {
+        const struct trace_histogram *histogram = &global_trace_histograms[type];
+        if (histogram->count == 0) {
+            continue;
+        }
+        fprintf(file,
+                "%s\n\"%s/%lu\":{\"count\":%lu,\"total_ns\":%lu,\"max_ns\":%lu,"
+                "\"log2_ns_buckets\":[",
+                is_first == true ? "" : ",",
+                global_trace_event_names[type] != NULL ? global_trace_event_names[type]
+                                                       : "ExtensionEvent",
+                type, histogram->count, histogram->total_ns, histogram->max_ns);
+        for (uint64_t i = 0; i < TRACE_BUCKETS_NUM; ++i) {
+            fprintf(file, "%s%lu", i == 0 ? "" : ",", histogram->buckets[i]);
+        }
+        fprintf(file, "]}");
+        is_first = false;
+    }
+    fprintf(file, "}}\n");
+    fclose(file);
+    return path;
+}
+#endif
+
+// The IPC protocol is line based. A line holds one or more commands separated by ';' and is parsed
+// completely before any of it is applied, so a batch either applies as a whole or not at all. Its
+// effects are arranged together at the end of the event loop iteration and go out in one flush.
+// Every line is answered with "ok" or "error <reason>", a query prints its state lines first.
+enum {
+    IPC_COMMAND_VIEW,
+    IPC_COMMAND_TOGGLE_VIEW,
+    IPC_COMMAND_TAG,
+    IPC_COMMAND_TOGGLE_TAG,
+    IPC_COMMAND_FOCUS,
+    IPC_COMMAND_LAYOUT,
+    IPC_COMMAND_MAIN_FRACTION,
+    IPC_COMMAND_MAIN_COUNT,
+    IPC_COMMAND_QUERY,
+    IPC_COMMAND_SUBSCRIBE,
+    IPC_COMMAND_TRACE,
+    IPC_COMMAND_RESTART,
+    IPC_COMMAND_ERRORS,
+    IPC_COMMAND_STATUS,
+    IPC_COMMAND_END
+};
+
+static const char *const global_ipc_command_names[IPC_COMMAND_END] = {
+    [IPC_COMMAND_VIEW] = "view",
+    [IPC_COMMAND_TOGGLE_VIEW] = "toggle-view",
+    [IPC_COMMAND_TAG] = "tag",
+    [IPC_COMMAND_TOGGLE_TAG] = "toggle-tag",
+    [IPC_COMMAND_FOCUS] = "focus",
+    [IPC_COMMAND_LAYOUT] = "layout",
+    [IPC_COMMAND_MAIN_FRACTION] = "main-fraction",
+    [IPC_COMMAND_MAIN_COUNT] = "main-count",
+    [IPC_COMMAND_QUERY] = "query",
+    [IPC_COMMAND_SUBSCRIBE] = "subscribe",
+    [IPC_COMMAND_TRACE] = "trace",
+    [IPC_COMMAND_RESTART] = "restart",
+    [IPC_COMMAND_ERRORS] = "errors",
+    [IPC_COMMAND_STATUS] = "status",
+};
+
+#define IPC_BATCH_MAX (64)
+
+struct ipc_command {
+    uint8_t type;
+    int32_t value;
+    float fraction;
+    // Points into the line being handled.
+    const char *text;
+};
+
+// Returns NULL on success, or the reason the command was rejected.
+const char *ipc_parse_command(char *const text, struct ipc_command *const command)
+{
+    char *saveptr = NULL;
+    char *name = strtok_r(text, " \t", &saveptr);
+    if (name == NULL) {
+        return "empty command";
+    }
+    // The status text is everything after the name and may hold spaces, but not ';'.
+    if (strcmp(name, global_ipc_command_names[IPC_COMMAND_STATUS]) == 0) {
+        command->type = IPC_COMMAND_STATUS;
+        command->text = saveptr + strspn(saveptr, " \t");
+        return NULL;
+    }
+    char *argument = strtok_r(NULL, " \t", &saveptr);
+    if (strtok_r(NULL, " \t", &saveptr) != NULL) {
+        return "too many arguments";
+    }
+    command->type = IPC_COMMAND_END;
+    for (uint8_t i = 0; i < IPC_COMMAND_END; ++i) {
+        if (strcmp(name, global_ipc_command_names[i]) == 0) {
+            command->type = i;
+        }
+    }
+
+    char *end = NULL;
+    switch (command->type) {
+    case IPC_COMMAND_VIEW:
+    case IPC_COMMAND_TOGGLE_VIEW:
+    case IPC_COMMAND_TAG:
+    case IPC_COMMAND_TOGGLE_TAG:
+        if (argument == NULL) {
+            return "missing tag";
+        }
+        command->value = strtol(argument, &end, 10);
+        if (*end != '\0' || command->value < 1 || command->value > TAGS_NUM) {
+            return "tag out of range";
+        }
+        command->value = 1 << (command->value - 1);
+        return NULL;
+    case IPC_COMMAND_FOCUS:
+        if (argument != NULL && strcmp(argument, "next") == 0) {
+            command->value = 1;
+            return NULL;
+        }
+        if (argument != NULL && strcmp(argument, "prev") == 0) {
+            command->value = -1;
+            return NULL;
+        }
+        return "focus takes next or prev";
+    case IPC_COMMAND_LAYOUT:
+        for (uint8_t i = 0; argument != NULL && i < LAYOUT_END; ++i) {
+            if (strcmp(argument, global_layouts[i].name) == 0) {
+                command->value = i;
+                return NULL;
+            }
+        }
+        return "unknown layout";
+    case IPC_COMMAND_MAIN_FRACTION:
+        if (argument == NULL) {
+            return "missing fraction";
+        }
+        command->fraction = strtof(argument, &end);
+        if (*end != '\0' || !(command->fraction >= MAIN_AREA_FRACTION_MIN &&
+                               command->fraction <= MAIN_AREA_FRACTION_MAX)) {
+            return "fraction out of range";
+        }
+        return NULL;
+    case IPC_COMMAND_MAIN_COUNT:
+        if (argument == NULL) {
+            return "missing count";
+        }
+        command->value = strtol(argument, &end, 10);
+        if (*end != '\0' || command->value < 0 || command->value > MAIN_AREA_WIN_NUM_MAX) {
+            return "count out of range";
+        }
+        return NULL;
+    case IPC_COMMAND_QUERY:
+    case IPC_COMMAND_SUBSCRIBE:
+    case IPC_COMMAND_RESTART:
+    case IPC_COMMAND_ERRORS:
+        return argument == NULL ? NULL : "too many arguments";
+    case IPC_COMMAND_TRACE:
+#ifdef EWM_TRACE
+        return argument == NULL ? NULL : "too many arguments";
+#else
+        return "built without EWM_TRACE";
+#endif
+    }
+    return "unknown command";
+}
 
-    if (x11_randr_init() != 0) {
-        fprintf(stderr, "RandR-specific initialization failed!\n");
-        return 1;
+void ipc_query(struct ipc_connection *const connection)
+{
+    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
+        struct monitor *monitor = container_of(cursor, struct monitor, list_node);
+        ipc_write(connection,
+                  "monitor 0x%x focused %d view %u layout %s main-fraction %.2f main-count %u "
+                  "box %d %d %u %u\n",
+                  monitor->output, monitor == global_focused_monitor, monitor->enabled_tags,
+                  monitor->layouts[monitor->current_layout_idx].name, monitor->main_area_fraction,
+                  monitor->main_area_win_num, monitor->box.x, monitor->box.y, monitor->box.width,
+                  monitor->box.height);
+        for (struct list_node *node = monitor->clients; node != NULL; node = node->next) {
+            struct client *client = container_of(node, struct client, list_node);
+            const char *name = client_name(client);
+            // The name goes last and is cut at a newline, so it can't break the line protocol.
+            ipc_write(connection,
+                      "client 0x%x monitor 0x%x focused %d tags %u floating %d fullscreen %d "
+                      "pid %u name %.*s\n",
+                      client->window, monitor->output, client == monitor->focused_client,
+                      client->tags, client->is_floating, client->is_fullscreen,
+                      client_properties(client)->pid, (int)strcspn(name, "\n"), name);
+        }
     }
-
-    return 0;
 }
 
-void handle_button_press(xcb_button_press_event_t *event) {}
-
-void handle_client_message(xcb_client_message_event_t *event)
+// One line with the totals followed by "code <error code> <count>" for every code seen.
+void ipc_errors(struct ipc_connection *const connection)
 {
-    struct client *client = get_client_by_win(event->window);
-    if (client == NULL) {
-        return;
+    ipc_write(connection, "errors received %lu routed %lu clients-dropped %lu",
+              global_error_counters.received, global_error_counters.routed,
+              global_error_counters.clients_dropped);
+    for (uint64_t i = 0; i < sizeof(global_error_counters.codes) / sizeof(uint64_t); ++i) {
+        if (global_error_counters.codes[i] != 0) {
+            ipc_write(connection, " code %lu %lu", i, global_error_counters.codes[i]);
+        }
     }
+    ipc_write(connection, "\n");
+}
 
-    if (event->type == global_ewmh_connection->_NET_WM_STATE) {
-        if (event->data.data32[1] != global_ewmh_connection->_NET_WM_STATE_FULLSCREEN &&
-            event->data.data32[2] != global_ewmh_connection->_NET_WM_STATE_FULLSCREEN) {
-            return;
+void ipc_focus_step(struct monitor *const monitor, int32_t step)
+{
+    struct list_node *start = monitor->focused_client != NULL
+                                  ? &monitor->focused_client->list_node
+                                  : monitor->clients;
+    struct list_node *cursor = start;
+    while (cursor != NULL) {
+        if (step > 0) {
+            cursor = cursor->next != NULL ? cursor->next : monitor->clients;
+        } else {
+            cursor = cursor != monitor->clients ? cursor->prev : monitor->clients->prev;
         }
-        if (event->data.data32[0] == XCB_EWMH_WM_STATE_ADD ||
-            event->data.data32[0] == XCB_EWMH_WM_STATE_TOGGLE && client->is_fullscreen == false) {
-            client_enable_fullscreen(client);
+        struct client *client = container_of(cursor, struct client, list_node);
+        if (client_is_visible(client) == true) {
+            monitor_focus_client(monitor, client);
             return;
         }
-        if (client->is_fullscreen == true) {
-            client_disable_fullscreen(client);
+        if (cursor == start) {
+            return;
         }
+    }
+}
+
+void ipc_apply_command(struct ipc_connection *const connection,
+                       const struct ipc_command *const command)
+{
+    struct monitor *monitor = global_focused_monitor;
+    struct client *client = monitor != NULL ? monitor->focused_client : NULL;
+    if (monitor == NULL) {
         return;
     }
+    switch (command->type) {
+    case IPC_COMMAND_VIEW:
+        monitor_view(monitor, command->value);
+        break;
+    case IPC_COMMAND_TOGGLE_VIEW:
+        monitor_toggle_view(monitor, command->value);
+        break;
+    case IPC_COMMAND_TAG:
+        if (client != NULL) {
+            client_tag(client, command->value);
+        }
+        break;
+    case IPC_COMMAND_TOGGLE_TAG:
+        if (client != NULL) {
+            client_toggle_tag(client, command->value);
+        }
+        break;
+    case IPC_COMMAND_FOCUS:
+        ipc_focus_step(monitor, command->value);
+        break;
+    case IPC_COMMAND_LAYOUT:
+        monitor_set_layout(monitor, command->value);
+        break;
+    case IPC_COMMAND_MAIN_FRACTION:
+        monitor->main_area_fraction = command->fraction;
+        monitor->needs_arrange = true;
+        break;
+    case IPC_COMMAND_MAIN_COUNT:
+        monitor->main_area_win_num = command->value;
+        monitor->needs_arrange = true;
+        break;
+    case IPC_COMMAND_QUERY:
+        ipc_query(connection);
+        break;
+    case IPC_COMMAND_SUBSCRIBE:
+        connection->is_subscribed = true;
+        break;
+    case IPC_COMMAND_TRACE: {
+#ifdef EWM_TRACE
+        const char *path = trace_dump();
+        ipc_write(connection, "trace %s\n", path != NULL ? path : "failed");
+#endif
+        break;
+    }
+    case IPC_COMMAND_RESTART:
+        global_should_restart = true;
+        global_running = false;
+        break;
+    case IPC_COMMAND_ERRORS:
+        ipc_errors(connection);
+        break;
+    case IPC_COMMAND_STATUS:
+        snprintf(global_bar_status, sizeof(global_bar_status), "%s", command->text);
+        break;
+    }
+}
 
-    if (event->type == global_ewmh_connection->_NET_ACTIVE_WINDOW) {
-        if (client == global_focused_monitor->focused_client || client->is_urgent == true) {
+void ipc_handle_line(struct ipc_connection *const connection, char *const line)
+{
+    TRACE_SCOPE("ipc_handle_line");
+    struct ipc_command commands[IPC_BATCH_MAX];
+    uint64_t commands_num = 0;
+    char *saveptr = NULL;
+    for (char *text = strtok_r(line, ";", &saveptr); text != NULL;
+         text = strtok_r(NULL, ";", &saveptr)) {
+        if (commands_num == IPC_BATCH_MAX) {
+            ipc_write(connection, "error too many commands\n");
+            return;
+        }
+        const char *error = ipc_parse_command(text, &commands[commands_num++]);
+        if (error != NULL) {
+            ipc_write(connection, "error %s\n", error);
             return;
         }
-        seturgent(client);
     }
+    for (uint64_t i = 0; i < commands_num; ++i) {
+        ipc_apply_command(connection, &commands[i]);
+    }
+    ipc_write(connection, "ok\n");
 }
 
-void handle_configure_notify(xcb_configure_notify_event_t *event)
+void handle_ipc_connection(struct ipc_connection *const connection)
 {
-    ;
+    while (connection->fd >= 0) {
+        ssize_t length = read(connection->fd, &connection->input[connection->input_len],
+                              IPC_INPUT_SIZE - connection->input_len);
+        if (length < 0 && (errno == EAGAIN || errno == EINTR)) {
+            return;
+        }
+        if (length <= 0) {
+            ipc_connection_close(connection);
+            return;
+        }
+        connection->input_len += length;
+
+        uint32_t consumed = 0;
+        char *newline = NULL;
+        while ((newline = memchr(&connection->input[consumed], '\n',
+                                 connection->input_len - consumed)) != NULL) {
+            *newline = '\0';
+            ipc_handle_line(connection, &connection->input[consumed]);
+            consumed = newline - connection->input + 1;
+        }
+        memmove(connection->input, &connection->input[consumed], connection->input_len - consumed);
+        connection->input_len -= consumed;
+        if (connection->input_len == IPC_INPUT_SIZE) {
+            ipc_write(connection, "error line too long\n");
+            connection->input_len = 0;
+        }
+    }
 }
 
-void handle_configure_request(xcb_configure_request_event_t *event)
+void handle_ipc_accept(void)
 {
-    struct client *client = get_client_by_win(event->window);
-    if (client == NULL) {
-        uint32_t values[7];
-        uint8_t i = 0;
-        if (event->value_mask & XCB_CONFIG_WINDOW_X) {
-            values[i++] = event->x;
+    int fd = -1;
+    while ((fd = accept(global_ipc_fd, NULL, NULL)) >= 0) {
+        struct ipc_connection *connection = NULL;
+        for (uint64_t i = 0; i < IPC_CONNECTIONS_MAX && connection == NULL; ++i) {
+            if (global_ipc_connections[i].fd < 0) {
+                connection = &global_ipc_connections[i];
+            }
         }
-        if (event->value_mask & XCB_CONFIG_WINDOW_Y) {
-            values[i++] = event->y;
+        struct epoll_event event = {.events = EPOLLIN};
+        if (connection != NULL) {
+            event.data.u32 = EVENT_SOURCE_END + (connection - global_ipc_connections);
         }
-        if (event->value_mask & XCB_CONFIG_WINDOW_WIDTH) {
-            values[i++] = event->width;
+        if (connection == NULL || fcntl(fd, F_SETFL, O_NONBLOCK) != 0 ||
+            fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+            epoll_ctl(global_epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            fprintf(stderr, "Can't accept IPC connection!\n");
+            close(fd);
+            continue;
         }
-        if (event->value_mask & XCB_CONFIG_WINDOW_HEIGHT) {
-            values[i++] = event->height;
+        memset(connection, 0, offsetof(struct ipc_connection, input));
+        connection->fd = fd;
+    }
+}
+
+// Sends what the iteration buffered. A connection that can't take all of it is woken again once it
+// becomes writable, the rest stays buffered until then.
+void ipc_flush(void)
+{
+    for (uint64_t i = 0; i < IPC_CONNECTIONS_MAX; ++i) {
+        struct ipc_connection *connection = &global_ipc_connections[i];
+        if (connection->fd < 0 ||
+            (connection->output_len == 0 && connection->is_waiting_writable == false)) {
+            continue;
         }
-        if (event->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) {
-            values[i++] = event->border_width;
+        ssize_t length = send(connection->fd, connection->output, connection->output_len,
+                              MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (length < 0 && errno != EAGAIN && errno != EINTR) {
+            ipc_connection_close(connection);
+            continue;
         }
-        if (event->value_mask & XCB_CONFIG_WINDOW_SIBLING) {
-            values[i++] = event->sibling;
+        if (length > 0) {
+            memmove(connection->output, &connection->output[length],
+                    connection->output_len - length);
+            connection->output_len -= length;
         }
-        if (event->value_mask & XCB_CONFIG_WINDOW_STACK_MODE) {
-            values[i++] = event->stack_mode;
+        bool should_wait_writable = connection->output_len != 0;
+        if (should_wait_writable != connection->is_waiting_writable) {
+            struct epoll_event event = {.events = should_wait_writable ? EPOLLIN | EPOLLOUT
+                                                                       : EPOLLIN,
+                                        .data.u32 = EVENT_SOURCE_END + i};
+            epoll_ctl(global_epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+            connection->is_waiting_writable = should_wait_writable;
         }
-        xcb_configure_window(global_xconnection, event->window, event->value_mask, values);
-        return;
     }
+}
 
-    if (event->value_mask & XCB_CONFIG_WINDOW_BORDER_WIDTH) {
-        client->border_width = event->border_width;
-        return;
+// The socket is $EWM_SOCKET, or ewm-<uid><display>.sock in the runtime directory when that isn't
+// set.
+int ipc_socket_address(struct sockaddr_un *const address)
+{
+    const char *path = getenv("EWM_SOCKET");
+    const char *display = getenv("DISPLAY");
+    address->sun_family = AF_UNIX;
+    int length = path != NULL
+                     ? snprintf(address->sun_path, sizeof(address->sun_path), "%s", path)
+                     : snprintf(address->sun_path, sizeof(address->sun_path), "%s/ewm-%u%s.sock",
+                                runtime_dir(), getuid(), display != NULL ? display : "");
+    if (length < 0 || length >= sizeof(address->sun_path)) {
+        address->sun_path[0] = '\0';
+        fprintf(stderr, "IPC socket path is too long!\n");
+        return 1;
     }
+    return 0;
+}
 
-    if (client->is_floating == false) {
-        client_configure(client);
+// Only one window manager runs per display, so a socket of ours that nobody listens on is left
+// behind by a previous instance. Anything else at the path is kept and makes bind() fail.
+void ipc_remove_stale_socket(const struct sockaddr_un *const address)
+{
+    struct stat socket_stat;
+    if (lstat(address->sun_path, &socket_stat) != 0 || !S_ISSOCK(socket_stat.st_mode) ||
+        socket_stat.st_uid != getuid()) {
         return;
     }
-
-    struct monitor *monitor = client->monitor;
-    if (event->value_mask & XCB_CONFIG_WINDOW_X) {
-        client->box.x = monitor->box.x + event->x;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return;
     }
-    if (event->value_mask & XCB_CONFIG_WINDOW_Y) {
-        client->box.y = monitor->box.y + event->y;
+    if (connect(fd, (const struct sockaddr *)address, sizeof(*address)) != 0 &&
+        errno == ECONNREFUSED) {
+        unlink(address->sun_path);
     }
-    if (event->value_mask & XCB_CONFIG_WINDOW_WIDTH) {
-        client->box.width = monitor->box.width + event->width;
+    close(fd);
+}
+
+int ipc_init(void)
+{
+    if (ipc_socket_address(&global_ipc_address) != 0) {
+        return 1;
     }
-    if (event->value_mask & XCB_CONFIG_WINDOW_HEIGHT) {
-        client->box.height = monitor->box.height + event->height;
+    global_ipc_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (global_ipc_fd < 0) {
+        global_ipc_address.sun_path[0] = '\0';
+        fprintf(stderr, "Can't create IPC socket!\n");
+        return 1;
+    }
+    ipc_remove_stale_socket(&global_ipc_address);
+    if (bind(global_ipc_fd, (struct sockaddr *)&global_ipc_address, sizeof(global_ipc_address)) !=
+            0 ||
+        listen(global_ipc_fd, IPC_CONNECTIONS_MAX) != 0) {
+        fprintf(stderr, "Can't listen on IPC socket %s!\n", global_ipc_address.sun_path);
+        global_ipc_address.sun_path[0] = '\0';
+        return 1;
     }
-    if (client->box.x + client->box.width > monitor->box.x + monitor->box.width) {
-        client->box.x = monitor->box.x + (monitor->box.width / 2 - client_width(client) / 2);
+    return event_loop_add(global_ipc_fd, EVENT_SOURCE_IPC);
+}
+
+// Client side of --command, prints the replies until the batch is answered. A subscribing batch
+// keeps printing events until ewm goes away.
+int ipc_send(const char *const commands)
+{
+    struct sockaddr_un address = {0};
+    if (ipc_socket_address(&address) != 0) {
+        return 1;
     }
-    if (client->box.x + client->box.height > monitor->box.x + monitor->box.height) {
-        client->box.x = monitor->box.x + (monitor->box.height / 2 - client_height(client) / 2);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        fprintf(stderr, "Can't connect to ewm at %s!\n", address.sun_path);
+        if (fd >= 0) {
+            close(fd);
+        }
+        return 1;
     }
-    if (event->value_mask & (XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y) &&
-        !(event->value_mask & (XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT))) {
-        client_configure(client);
+    FILE *stream = fdopen(fd, "r+");
+    if (stream == NULL) {
+        close(fd);
+        return 1;
     }
-    if (client->tags & monitor->enabled_tags) {
-        client_move_resize(client, client->box.x, client->box.y, client->box.width,
-                           client->box.height);
+    fprintf(stream, "%s\n", commands);
+    fflush(stream);
+
+    int result = 1;
+    bool is_subscribing = strstr(commands, global_ipc_command_names[IPC_COMMAND_SUBSCRIBE]) != NULL;
+    char line[IPC_INPUT_SIZE];
+    while (fgets(line, sizeof(line), stream) != NULL) {
+        fputs(line, stdout);
+        fflush(stdout);
+        if (strncmp(line, "error ", strlen("error ")) == 0) {
+            break;
+        }
+        if (strcmp(line, "ok\n") == 0) {
+            result = 0;
+            if (is_subscribing == false) {
+                break;
+            }
+        }
     }
+    fclose(stream);
+    return result;
 }
 
-void handle_destroy_notify(xcb_destroy_notify_event_t *event)
+void ipc_deinit(void)
 {
-    struct client *client = get_client_by_win(event->window);
-    if (client == NULL) {
-        return;
+    for (uint64_t i = 0; i < IPC_CONNECTIONS_MAX; ++i) {
+        ipc_connection_close(&global_ipc_connections[i]);
+    }
+    if (global_ipc_fd >= 0) {
+        close(global_ipc_fd);
+    }
+    if (global_ipc_address.sun_path[0] != '\0') {
+        unlink(global_ipc_address.sun_path);
     }
-    struct monitor *monitor = client->monitor;
-    monitor_remove_client(monitor, client);
-    free(client);
-    monitor->layouts[monitor->current_layout_idx].arrange(monitor);
 }
 
-void handle_enter_notify(xcb_enter_notify_event_t *event) {}
-void handle_focus_in(xcb_focus_in_event_t *event) {}
-void handle_mapping_notify(xcb_mapping_notify_event_t *event) {}
-
-void handle_map_request(xcb_map_request_event_t *event)
+int event_loop_init(void)
 {
-    xcb_get_window_attributes_reply_t *window_attributes_reply = xcb_get_window_attributes_reply(
-        global_xconnection, xcb_get_window_attributes(global_xconnection, event->window), NULL);
-    if (window_attributes_reply == NULL || window_attributes_reply->override_redirect != 0 ||
-        get_client_by_win(event->window) != NULL) {
-        goto WINDOW_ATTRIBUTES_REPLY_FREE;
+    global_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (global_epoll_fd < 0) {
+        fprintf(stderr, "Can't create epoll instance!\n");
+        return 1;
     }
 
-    struct monitor *monitor = global_focused_monitor;
-    uint8_t tags = global_focused_monitor->enabled_tags;
-
-    xcb_window_t transient = XCB_NONE;
-    xcb_icccm_get_wm_transient_for_reply(
-        global_xconnection, xcb_icccm_get_wm_transient_for(global_xconnection, event->window),
-        &transient, NULL);
-    if (transient != XCB_NONE) {
-        struct client *client = get_client_by_win(transient);
-        monitor = client->monitor;
-        tags = client->tags;
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGHUP);
+#ifdef EWM_TRACE
+    sigaddset(&signals, SIGUSR1);
+#endif
+    if (sigprocmask(SIG_BLOCK, &signals, NULL) != 0) {
+        fprintf(stderr, "Can't block signals for signalfd!\n");
+        return 1;
     }
-
-    xcb_get_geometry_reply_t *geometry_reply = xcb_get_geometry_reply(
-        global_xconnection, xcb_get_geometry(global_xconnection, event->window), NULL);
-    if (geometry_reply == NULL) {
-        goto GEOMETRY_REPLY_FREE;
+    global_signal_fd = signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (global_signal_fd < 0) {
+        fprintf(stderr, "Can't create signalfd!\n");
+        return 1;
     }
 
-    int16_t x = geometry_reply->x;
-    uint16_t width = geometry_reply->width;
-    if (x + width + 2 * geometry_reply->border_width > global_focused_monitor->box.x +
-                                                           global_focused_monitor->box.width +
-                                                           2 * global_client_border_width) {
-        x = global_focused_monitor->box.x;
-        width = global_focused_monitor->box.width;
+    // Created disarmed, timerfd_settime() on it wakes the event loop for deferred work.
+    global_timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (global_timer_fd < 0) {
+        fprintf(stderr, "Can't create timerfd!\n");
+        return 1;
     }
 
-    int16_t y = geometry_reply->y;
-    uint16_t height = geometry_reply->height;
-    if (y + width + 2 * geometry_reply->border_width > global_focused_monitor->box.y +
-                                                           global_focused_monitor->box.height +
-                                                           2 * global_client_border_width) {
-        y = global_focused_monitor->box.y;
-        height = global_focused_monitor->box.height;
+    if (event_loop_add(xcb_get_file_descriptor(global_xconnection), EVENT_SOURCE_X11) != 0 ||
+        event_loop_add(global_signal_fd, EVENT_SOURCE_SIGNAL) != 0 ||
+        event_loop_add(global_timer_fd, EVENT_SOURCE_TIMER) != 0) {
+        fprintf(stderr, "Can't register file descriptors to epoll!\n");
+        return 1;
     }
-
-    struct client *new_client = client_create(monitor, event->window, x, y, width, height,
-                                              global_client_border_width, tags);
-    if (new_client == NULL) {
-        goto GEOMETRY_REPLY_FREE;
+    // Started after the signals are blocked, which the worker thread inherits.
+    if (metadata_worker_start() != 0 ||
+        event_loop_add(global_metadata_record_fd, EVENT_SOURCE_METADATA) != 0) {
+        metadata_worker_stop();
+        fprintf(stderr, "Continuing with metadata on the main connection!\n");
+    }
+    if (global_bar_height > 0) {
+        global_clock_timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+        bar_clock_update();
+        if (global_clock_timer_fd < 0 || bar_clock_arm() != 0 ||
+            event_loop_add(global_clock_timer_fd, EVENT_SOURCE_CLOCK) != 0) {
+            fprintf(stderr, "Continuing without bar clock!\n");
+            global_bar_clock[0] = '\0';
+        }
+    }
+    if (ipc_init() != 0) {
+        fprintf(stderr, "Continuing without IPC!\n");
     }
 
-    monitor_append_client(monitor, new_client);
-    monitor->layouts[monitor->current_layout_idx].arrange(monitor);
-    xcb_map_window(global_xconnection, event->window);
-
-GEOMETRY_REPLY_FREE:
-    free(geometry_reply);
-WINDOW_ATTRIBUTES_REPLY_FREE:
-    free(window_attributes_reply);
+    return 0;
 }
 
-static inline uint32_t get_intersect_area_size(struct box a, struct box b)
+void event_loop_deinit(void)
 {
-    return max(0, (min(a.x + a.width, b.x + b.width) - max(a.x, b.x))) *
-           max(0, (min(a.y + a.height, b.x + b.height) - max(a.y, b.y)));
+    ipc_deinit();
+    metadata_worker_stop();
+    if (global_clock_timer_fd >= 0) {
+        close(global_clock_timer_fd);
+    }
+    if (global_timer_fd >= 0) {
+        close(global_timer_fd);
+    }
+    if (global_signal_fd >= 0) {
+        close(global_signal_fd);
+    }
+    if (global_epoll_fd >= 0) {
+        close(global_epoll_fd);
+    }
 }
 
-static inline struct monitor *get_monitor_by_box(struct box box)
+void handle_signal(void)
 {
-    struct monitor *result = NULL;
-    uint32_t max_intersect_area_size = 0;
-    for (struct list_node *cursor = global_monitors; cursor != NULL; cursor = cursor->next) {
-        struct monitor *monitor = container_of(cursor, struct monitor, list_node);
-        uint32_t intersect_area_size = get_intersect_area_size(box, monitor->box);
-        if (intersect_area_size <= max_intersect_area_size) {
-            continue;
+    struct signalfd_siginfo info;
+    while (read(global_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        if (info.ssi_signo == SIGINT || info.ssi_signo == SIGTERM || info.ssi_signo == SIGHUP) {
+            global_running = false;
+        }
+#ifdef EWM_TRACE
+        if (info.ssi_signo == SIGUSR1) {
+            const char *path = trace_dump();
+            if (path != NULL) {
+                fprintf(stderr, "Trace written to %s\n", path);
+            }
         }
-        max_intersect_area_size = intersect_area_size;
-        result = monitor;
+#endif
     }
-    return result;
 }
 
-void monitor_focus(struct monitor *const monitor)
+void handle_timer(void)
 {
-    if (global_focused_monitor->focused_client != NULL) {
-        client_unfocus(global_focused_monitor->focused_client);
+    uint64_t expirations = 0;
+    if (counter_fd_read(global_timer_fd, &expirations) != 0) {
+        return;
     }
-    global_focused_monitor = monitor;
-    if (global_focused_monitor->focused_client != NULL) {
-        client_focus(global_focused_monitor->focused_client);
+    global_drag.is_timer_armed = false;
+    if (global_drag.mode != DRAG_NONE && global_drag.has_target == true) {
+        drag_commit();
     }
 }
 
-void handle_motion_notify(xcb_motion_notify_event_t *event)
+// Motion is compressed per batch: only the last event is handled, the ones before it are stale.
+void motion_flush(void)
 {
-    if (event->root != global_screen->root) {
-        return;
-    }
-    struct box mouse_box = {event->root_x, event->root_y, 1, 1};
-    struct monitor *monitor = get_monitor_by_box(mouse_box);
-    if (monitor == NULL || monitor == global_focused_monitor) {
+    if (global_has_pending_motion == false) {
         return;
     }
-    monitor_focus(monitor);
+    global_has_pending_motion = false;
+    ++global_motion_counters.handled;
+    handle_motion_notify(&global_pending_motion);
 }
 
-void handle_property_notify(xcb_property_notify_event_t *event) {}
-void handle_unmap_notify(xcb_unmap_notify_event_t *event) {}
+void x11_drain_events(void)
+{
+    TRACE_SCOPE("x11_drain_events");
+    xcb_generic_event_t *event = NULL;
+    while (true) {
+        while ((event = xcb_poll_for_event(global_xconnection)) != NULL) {
+            TRACE_EVENT_BEGIN();
+            handle_event(event);
+            TRACE_EVENT_END(XCB_EVENT_RESPONSE_TYPE(event));
+            free(event);
+        }
+        motion_flush();
+        if (global_sync_waits_num != 0) {
+            sync_waits_expire(monotonic_now_ns());
+        }
+        if (global_property_fetches_num != 0) {
+            property_fetches_poll();
+        }
+        if (global_configure_requests_num != 0) {
+            configure_requests_apply();
+        }
+        if (global_monitors_outdated == true) {
+            global_monitors_outdated = false;
+            update_monitors(
+                xcb_randr_get_screen_resources_current(global_xconnection, global_screen->root));
+            continue;
+        }
+        if (global_pending_clients_num == 0) {
+            break;
+        }
+        // Waiting for the adoption replies may queue further events, so go around again.
+        adopt_pending_clients();
+    }
+    client_properties_refresh();
+    monitors_arrange_pending();
+    focus_barrier_update();
+    focus_publish();
+    ewmh_publish();
+    bars_draw();
+}
 
-void handle_event(xcb_generic_event_t *event)
+int event_loop_run(void)
 {
-    switch (XCB_EVENT_RESPONSE_TYPE(event)) {
-    case XCB_BUTTON_PRESS:
-        handle_button_press((xcb_button_press_event_t *)event);
-        break;
-    case XCB_CLIENT_MESSAGE:
-        handle_client_message((xcb_client_message_event_t *)event);
-        break;
-    case XCB_CONFIGURE_NOTIFY:
-        handle_configure_notify((xcb_configure_notify_event_t *)event);
-        break;
-    case XCB_CONFIGURE_REQUEST:
-        handle_configure_request((xcb_configure_request_event_t *)event);
-        break;
-    case XCB_DESTROY_NOTIFY:
-        handle_destroy_notify((xcb_destroy_notify_event_t *)event);
-        break;
-    case XCB_ENTER_NOTIFY:
-        handle_enter_notify((xcb_enter_notify_event_t *)event);
-        break;
-    case XCB_FOCUS_IN:
-        handle_focus_in((xcb_focus_in_event_t *)event);
-        break;
-    case XCB_MAPPING_NOTIFY:
-        handle_mapping_notify((xcb_mapping_notify_event_t *)event);
-        break;
-    case XCB_MAP_REQUEST:
-        handle_map_request((xcb_map_request_event_t *)event);
-        break;
-    case XCB_MOTION_NOTIFY:
-        handle_motion_notify((xcb_motion_notify_event_t *)event);
-        break;
-    case XCB_PROPERTY_NOTIFY:
-        handle_property_notify((xcb_property_notify_event_t *)event);
-        break;
-    case XCB_UNMAP_NOTIFY:
-        handle_unmap_notify((xcb_unmap_notify_event_t *)event);
-        break;
+    struct epoll_event events[EVENT_SOURCE_END + IPC_CONNECTIONS_MAX];
+    while (global_running) {
+        // Blocking replies may have queued events inside XCB without leaving the socket readable,
+        // so drain before sleeping. Requests issued by the whole batch go out in a single flush.
+        x11_drain_events();
+        xcb_flush(global_xconnection);
+        if (xcb_connection_has_error(global_xconnection)) {
+            fprintf(stderr, "Lost connection to X Server!\n");
+            return 1;
+        }
+        ipc_flush();
+
+        // Sync waits have no file descriptor, their deadline bounds the wait instead.
+        int events_num = epoll_wait(global_epoll_fd, events, sizeof(events) / sizeof(events[0]),
+                                    sync_waits_timeout_ms());
+        if (events_num < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to wait for events!\n");
+            return 1;
+        }
+
+        for (int i = 0; i < events_num; ++i) {
+            switch (events[i].data.u32) {
+            case EVENT_SOURCE_X11:
+                break;
+            case EVENT_SOURCE_SIGNAL:
+                handle_signal();
+                break;
+            case EVENT_SOURCE_TIMER:
+                handle_timer();
+                break;
+            case EVENT_SOURCE_IPC:
+                handle_ipc_accept();
+                break;
+            case EVENT_SOURCE_METADATA:
+                handle_metadata_records();
+                break;
+            case EVENT_SOURCE_CLOCK:
+                handle_clock_timer();
+                break;
+            default:
+                handle_ipc_connection(
+                    &global_ipc_connections[events[i].data.u32 - EVENT_SOURCE_END]);
+                break;
+            }
+        }
     }
+    return 0;
 }
 
+// bench.c includes this file with EWM_BENCH defined.
+#ifndef EWM_BENCH
 int main(int argc, char *argv[])
 {
-    x11_init();
+    if (argc > 2 && strcmp(argv[1], "--command") == 0) {
+        return ipc_send(argv[2]);
+    }
 
-    while (true) {
-        xcb_generic_event_t *event = xcb_poll_for_event(global_xconnection);
-        if (event == NULL) {
-            continue;
-        }
-        handle_event(event);
-        free(event);
+    int result = 1;
+    bool should_report_startup = argc > 1 && strcmp(argv[1], "--startup-time") == 0;
+    char session[PATH_MAX];
+    bool has_session_path = session_path(session, sizeof(session)) == 0;
+    uint64_t start = monotonic_now_ns();
+    if (has_session_path == true) {
+        session_load(session);
+    }
+    if (x11_init() != 0) {
+        goto CLEANUP;
+    }
+    if (should_report_startup == true) {
+        fprintf(stderr, "x11_init took %.2f ms and %u round trips\n",
+                (double)(monotonic_now_ns() - start) / 1000000, global_round_trips);
+    }
+    if (event_loop_init() != 0) {
+        goto CLEANUP;
+    }
+
+    result = event_loop_run();
+    if (has_session_path == true) {
+        session_save(session);
     }
 
+CLEANUP:
+    session_unload();
+    event_loop_deinit();
+    if (global_ewmh_connection != NULL) {
+        xcb_ewmh_connection_wipe(global_ewmh_connection);
+        free(global_ewmh_connection);
+    }
     xcb_disconnect(global_xconnection);
 
-    return 0;
+    if (global_should_restart == true) {
+        execvp(argv[0], argv);
+        fprintf(stderr, "Can't restart ewm!\n");
+    }
+    return result;
 }
+#endif